@@ -0,0 +1,664 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gutil.h"
+#include "gutil_c.h"
+#include "mock.h"
+
+using namespace std;
+using namespace bluez;
+using namespace bluez::mock;
+
+static const int SIZES[] = {10, 100, 1000};
+
+static void quiet(const gchar *domain, GLogLevelFlags level, const gchar *message, gpointer data) {
+    if (level & (G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG)) return;
+    g_log_default_handler(domain, level, message, data);
+}
+
+static gint64 percentile(vector<gint64> &samples, double p) {
+    if (samples.empty()) return 0;
+    sort(samples.begin(), samples.end());
+    auto index = (size_t)(p * (samples.size() - 1) + 0.5);
+    return samples[index];
+}
+
+static void report(const char *name, vector<gint64> &samples) {
+    printf("%-36s p50 %8lld us  p90 %8lld us  p99 %8lld us  max %8lld us  (n=%zu)\n", name,
+           (long long)percentile(samples, 0.5), (long long)percentile(samples, 0.9),
+           (long long)percentile(samples, 0.99), (long long)percentile(samples, 1.0), samples.size());
+}
+
+static void add_devices(MockBluez &mock, vector<string> &paths, size_t count) {
+    while (paths.size() < count) {
+        auto i = paths.size();
+        char addr[18];
+        snprintf(addr, sizeof(addr), "00:00:00:00:%02X:%02X", (unsigned)(i >> 8) & 0xff, (unsigned)i & 0xff);
+        paths.push_back(mock.AddDevice(0, i % 2 ? "Joy-Con (L)" : "Pro Controller", addr, i % 2 == 0));
+    }
+}
+
+// constructor time, GetDevices() and GetDeviceSnapshot() latency as the
+// device count grows
+static void bench_devices(MockBluez &mock, vector<string> &paths) {
+    printf("== startup and GetDevices()\n");
+    for (auto size : SIZES) {
+        add_devices(mock, paths, size);
+        vector<gint64> startup, get_devices, snapshot;
+        for (int run = 0; run < 5; run++) {
+            auto start = g_get_monotonic_time();
+            BluezUtil util;
+            startup.push_back(g_get_monotonic_time() - start);
+            for (int i = 0; i < 200; i++) {
+                auto start = g_get_monotonic_time();
+                auto devices = util.GetDevices();
+                get_devices.push_back(g_get_monotonic_time() - start);
+                if (devices.size() != (size_t)size) {
+                    fprintf(stderr, "GetDevices() returned %zu of %d devices\n", devices.size(), size);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            for (int i = 0; i < 200; i++) {
+                auto start = g_get_monotonic_time();
+                auto devices = util.GetDeviceSnapshot();
+                snapshot.push_back(g_get_monotonic_time() - start);
+                if (devices.size() != (size_t)size) {
+                    fprintf(stderr, "GetDeviceSnapshot() returned %zu of %d devices\n", devices.size(), size);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "BluezUtil() %4d devices", size);
+        report(name, startup);
+        snprintf(name, sizeof(name), "GetDevices() %4d devices", size);
+        report(name, get_devices);
+        snprintf(name, sizeof(name), "GetDeviceSnapshot() %4d devices", size);
+        report(name, snapshot);
+    }
+}
+
+// time until the constructor returns and until Ready() completes, with the
+// synchronous and the lazy start, against a prompt and a slow bluetoothd
+static void bench_startup(MockBluez &mock, size_t devices) {
+    printf("== startup, %zu devices\n", devices);
+    for (int delay : {0, 100}) {
+        mock.SetReplyDelay(delay);
+        for (bool lazy : {false, true}) {
+            BluezOptions options;
+            options.lazy_start = lazy;
+            vector<gint64> constructed, ready;
+            for (int run = 0; run < 5; run++) {
+                auto start = g_get_monotonic_time();
+                BluezUtil util(options);
+                constructed.push_back(g_get_monotonic_time() - start);
+                util.Ready().get();
+                ready.push_back(g_get_monotonic_time() - start);
+                if (util.GetDevices().size() != devices) {
+                    fprintf(stderr, "Ready() with %zu of %zu devices\n", util.GetDevices().size(), devices);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            char name[64];
+            snprintf(name, sizeof(name), "%s BluezUtil() +%dms replies", lazy ? "lazy" : "sync", delay);
+            report(name, constructed);
+            snprintf(name, sizeof(name), "%s Ready() +%dms replies", lazy ? "lazy" : "sync", delay);
+            report(name, ready);
+        }
+    }
+    mock.SetReplyDelay(0);
+}
+
+// lazy start against a slow bluetoothd, without and with a device cache:
+// time until the snapshot holds every device, and until Ready()
+static void bench_cache(MockBluez &mock, size_t devices) {
+    printf("== warm start, %zu devices\n", devices);
+    char cache[] = "/tmp/bench-cache-XXXXXX";
+    int fd = mkstemp(cache);
+    if (fd < 0) return;
+    close(fd);
+    unlink(cache);
+    mock.SetReplyDelay(100);
+    for (bool warm : {false, true}) {
+        BluezOptions options;
+        options.lazy_start = true;
+        if (warm) {
+            options.cache.path = cache;
+            // the first run writes the cache when it goes
+            BluezUtil util(options);
+            util.Ready().get();
+        }
+        vector<gint64> listed, ready;
+        for (int run = 0; run < 5; run++) {
+            auto start = g_get_monotonic_time();
+            BluezUtil util(options);
+            while (util.GetDeviceSnapshot().size() < devices) usleep(100);
+            listed.push_back(g_get_monotonic_time() - start);
+            util.Ready().get();
+            ready.push_back(g_get_monotonic_time() - start);
+        }
+        report(warm ? "cache: all devices listed" : "no cache: all devices listed", listed);
+        report(warm ? "cache: Ready() after reconcile" : "no cache: Ready()", ready);
+    }
+    mock.SetReplyDelay(0);
+    unlink(cache);
+}
+
+// time from emitting PropertiesChanged in the mock to the listener call,
+// paced so that queueing does not dominate
+static void bench_latency(MockBluez &mock, const string &path) {
+    printf("== signal to callback latency\n");
+    const int count = 2000;
+    vector<gint64> sent(count), received(count);
+    atomic<int> seen(0);
+    BluezUtil util;
+    util.Subscribe([&](BluetoothEvent, const BluetoothDevice *) {
+        auto i = seen++;
+        if (i < count) received[i] = g_get_monotonic_time();
+    }, BluetoothEventBit(BluetoothEvent::EV_DEVICE_CONNECTED) | BluetoothEventBit(BluetoothEvent::EV_DEVICE_DISCONNECTED));
+    for (int i = 0; i < count; i++) {
+        sent[i] = g_get_monotonic_time();
+        mock.SetConnected(path, i % 2 == 0);
+        usleep(200);
+    }
+    for (int i = 0; i < 100 && seen < count; i++) usleep(10000);
+    vector<gint64> latency;
+    for (int i = 0; i < min(count, seen.load()); i++) latency.push_back(received[i] - sent[i]);
+    report("PropertiesChanged -> listener", latency);
+}
+
+// events per second the whole pipeline sustains when flooded
+static void bench_throughput(MockBluez &mock, const vector<string> &paths) {
+    printf("== sustained event rate\n");
+    const int count = 20000;
+    BluezOptions options;
+    options.event_overflow = EventOverflow::BLOCK;
+    BluezUtil util(options);
+    atomic<int> seen(0);
+    atomic<gint64> last(0);
+    util.Subscribe([&](BluetoothEvent, const BluetoothDevice *) {
+        seen++;
+        last = g_get_monotonic_time();
+    }, EV_MASK_DEVICE);
+    auto before = util.Stats();
+    auto start = g_get_monotonic_time();
+    for (int i = 0; i < count; i++) {
+        mock.SetConnected(paths[i % 10], (i / 10) % 2 == 0);
+    }
+    for (int i = 0; i < 500 && seen < count; i++) usleep(10000);
+    auto elapsed = last - start;
+    printf("%-36s %8.0f events/s  (%d of %d delivered in %lld ms)\n", "PropertiesChanged flood",
+           elapsed > 0 ? seen * 1e6 / elapsed : 0.0, seen.load(), count, (long long)elapsed / 1000);
+    auto stats = util.GetEventQueueStats();
+    printf("%-36s high water %zu of %zu, dropped %llu\n", "event queue", stats.high_water, stats.capacity,
+           (unsigned long long)stats.dropped);
+    auto after = util.Stats();
+    if (after.enabled) {
+        auto busy = after.loop_busy_us - before.loop_busy_us, uptime = after.loop_uptime_us - before.loop_uptime_us;
+        printf("%-36s %5.1f %% busy\n", "loop thread", uptime > 0 ? busy * 100.0 / uptime : 0.0);
+    }
+    if (getenv("BENCH_STATS")) printf("%s", after.ToText().c_str());
+}
+
+// Pair, Trust and Connect through the built-in agent, one device at a time
+static void bench_setup(const vector<string> &paths) {
+    printf("== pair + trust + connect\n");
+    BluezUtil util;
+    vector<gint64> pair, trust, connect, total;
+    // the same attempts from the device state machine
+    vector<gint64> to_paired, to_link, to_resolved, to_ready;
+    // odd devices were added unpaired, skip the ones the other sections touch
+    for (size_t i = 11; i < paths.size() && pair.size() < 200; i += 2) {
+        auto result = util.PairAndConnectAsync(paths[i].c_str()).get();
+        if (!result.ok) {
+            fprintf(stderr, "%s failed at %s: %s\n", paths[i].c_str(), result.step.c_str(), result.error.c_str());
+            exit(EXIT_FAILURE);
+        }
+        pair.push_back(result.pair_us);
+        trust.push_back(result.trust_us);
+        connect.push_back(result.connect_us);
+        total.push_back(result.total_us);
+        BluezConnectPhases phases;
+        util.GetDeviceState(paths[i].c_str(), &phases);
+        to_paired.push_back(phases.paired_us - phases.requested_us);
+        to_link.push_back(phases.link_up_us - phases.paired_us);
+        to_resolved.push_back(phases.resolved_us - phases.link_up_us);
+        to_ready.push_back(phases.ready_us - phases.resolved_us);
+    }
+    report("Pair (agent confirmation)", pair);
+    report("Trusted = true", trust);
+    report("Connect", connect);
+    report("PairAndConnectAsync() total", total);
+    report("phase: requested -> paired", to_paired);
+    report("phase: paired -> link up", to_link);
+    report("phase: link up -> services resolved", to_resolved);
+    report("phase: services resolved -> ready", to_ready);
+}
+
+// time from a drop in the mock to the supervisor's reconnect showing up as
+// EV_DEVICE_CONNECTED, all devices dropping at once
+static void bench_reconnect(MockBluez &mock, const vector<string> &paths) {
+    printf("== reconnect after drop\n");
+    vector<string> wanted;
+    // paired devices no other section touches
+    for (size_t i = 500; i < paths.size() && wanted.size() < 20; i += 2) wanted.push_back(paths[i]);
+    BluezUtil util;
+    mutex lock;
+    map<string, gint64> dropped;
+    vector<gint64> recovery;
+    atomic<int> up(0);
+    util.Subscribe([&](BluetoothEvent, const BluetoothDevice *device) {
+        auto now = g_get_monotonic_time();
+        lock_guard<mutex> _1(lock);
+        auto it = dropped.find(device->object_path());
+        if (it == dropped.end()) return;
+        recovery.push_back(now - it->second);
+        dropped.erase(it);
+        up++;
+    }, BluetoothEventBit(BluetoothEvent::EV_DEVICE_CONNECTED));
+    for (auto &path : wanted) util.Supervise(path.c_str());
+    for (int round = 0; round < 20; round++) {
+        // the second half of the rounds fails every other first attempt
+        if (round >= 10) {
+            for (size_t i = 0; i < wanted.size(); i += 2) mock.FailNext(wanted[i], 1, "org.bluez.Error.Failed");
+        }
+        usleep(20000);
+        up = 0;
+        for (auto &path : wanted) {
+            {
+                lock_guard<mutex> _1(lock);
+                dropped[path] = g_get_monotonic_time();
+            }
+            mock.SetConnected(path, false);
+        }
+        for (int i = 0; i < 500 && up < (int)wanted.size(); i++) usleep(10000);
+        if (round == 9 || round == 19) {
+            report(round == 9 ? "Connected=false -> reconnected" : "  with 1 failed attempt per 2", recovery);
+            recovery.clear();
+        }
+    }
+    int attempts = 0, drops = 0;
+    for (auto &stats : util.GetReconnectStats()) {
+        attempts += stats.attempts;
+        drops += stats.drops;
+    }
+    printf("%-36s %d drops, %d Connect calls for %zu devices\n", "supervisor", drops, attempts, wanted.size());
+}
+
+// An RSSI and connect storm recorded from the mock, then replayed offline
+// through the same handlers as fast as possible and at recorded speed.
+static void bench_replay(MockBluez &mock, const vector<string> &paths) {
+    printf("== signal record and replay\n");
+    const int count = 10000;
+    char log[] = "/tmp/bench-signals-XXXXXX";
+    int fd = mkstemp(log);
+    if (fd < 0) return;
+    close(fd);
+    {
+        BluezUtil util;
+        atomic<int> seen(0);
+        util.Subscribe([&](BluetoothEvent, const BluetoothDevice *) { seen++; }, EV_MASK_DEVICE);
+        util.StartRecording(log);
+        for (int i = 0; i < count; i++) {
+            if (i % 4) mock.SetRssi(paths[i % 100], -40 - (i / 100) % 50);
+            else mock.SetConnected(paths[i % 10], (i / 10) % 2 == 0);
+        }
+        // until the mock stopped sending
+        for (int last = -1; last != seen;) {
+            last = seen;
+            usleep(200000);
+        }
+        util.StopRecording();
+    }
+    for (bool realtime : {false, true}) {
+        BluezOptions options;
+        options.offline = true;
+        options.event_overflow = EventOverflow::BLOCK;
+        BluezUtil util(options);
+        atomic<int> seen(0);
+        util.Subscribe([&](BluetoothEvent, const BluetoothDevice *) { seen++; }, EV_MASK_DEVICE);
+        BluezReplayOptions replay;
+        replay.realtime = realtime;
+        auto result = util.Replay(log, replay).get();
+        // listeners run behind the loop thread
+        for (int last = -1; last != seen;) {
+            last = seen;
+            usleep(10000);
+        }
+        printf("%-36s %8.0f signals/s  (%zu signals, %lld of %lld recorded ms, %d events)\n",
+               realtime ? "replay at recorded speed" : "replay as fast as possible",
+               result.elapsed_us > 0 ? result.signals * 1e6 / result.elapsed_us : 0.0, result.signals,
+               (long long)result.elapsed_us / 1000, (long long)result.recorded_us / 1000, seen.load());
+    }
+    unlink(log);
+}
+
+// the same startup, latency and flood runs through each transport, with the
+// CPU time the process spent on them
+static void bench_transports(MockBluez &mock, const vector<string> &paths) {
+    printf("== transports\n");
+    for (auto type : {BluezTransportType::GDBUS, BluezTransportType::SDBUS}) {
+        auto name = type == BluezTransportType::GDBUS ? "gdbus" : "sd-bus";
+        BluezOptions options;
+        options.transport = type;
+        options.event_overflow = EventOverflow::BLOCK;
+        vector<gint64> ready;
+        for (int run = 0; run < 5; run++) {
+            auto start = g_get_monotonic_time();
+            try {
+                BluezUtil util(options);
+            } catch (const BluezError &e) {
+                printf("%-36s skipped: %s\n", name, e.message.c_str());
+                break;
+            }
+            ready.push_back(g_get_monotonic_time() - start);
+        }
+        if (ready.empty()) continue;
+        char label[64];
+        snprintf(label, sizeof(label), "%s BluezUtil(), %zu devices", name, paths.size());
+        report(label, ready);
+
+        BluezUtil util(options);
+        const int count = 20000;
+        atomic<int> seen(0);
+        vector<gint64> sent(count), received(count);
+        util.Subscribe([&](BluetoothEvent, const BluetoothDevice *) {
+            auto i = seen++;
+            if (i < count) received[i] = g_get_monotonic_time();
+        }, EV_MASK_DEVICE);
+        for (int i = 0; i < 1000; i++) {
+            sent[i] = g_get_monotonic_time();
+            mock.SetConnected(paths[0], i % 2 == 0);
+            usleep(200);
+        }
+        for (int i = 0; i < 100 && seen < 1000; i++) usleep(10000);
+        vector<gint64> latency;
+        for (int i = 0; i < min(1000, seen.load()); i++) latency.push_back(received[i] - sent[i]);
+        snprintf(label, sizeof(label), "%s PropertiesChanged -> listener", name);
+        report(label, latency);
+
+        seen = 0;
+        timespec cpu0, cpu1;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+        auto start = g_get_monotonic_time();
+        for (int i = 0; i < count; i++) mock.SetConnected(paths[i % 10], (i / 10) % 2 == 0);
+        for (int i = 0; i < 500 && seen < count; i++) usleep(10000);
+        auto elapsed = seen > 0 ? received[min(count, seen.load()) - 1] - start : 0;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+        // the mock runs in this process too, its share is the same for both
+        auto cpu = (cpu1.tv_sec - cpu0.tv_sec) * 1000000LL + (cpu1.tv_nsec - cpu0.tv_nsec) / 1000;
+        snprintf(label, sizeof(label), "%s PropertiesChanged flood", name);
+        printf("%-36s %8.0f events/s  %5.2f us cpu/event  (%d of %d delivered)\n", label,
+               elapsed > 0 ? seen * 1e6 / elapsed : 0.0, seen > 0 ? (double)cpu / seen : 0.0, seen.load(), count);
+    }
+}
+
+// HID reports through HidStreamer, socketpairs standing in for hidraw nodes.
+// Every writer sends a 49 byte report with its send time every period_us.
+static void bench_stream() {
+    printf("== hid report streaming\n");
+    const int devices = 8, count = 1000, period_us = 2000;
+    HidStreamer streamer;
+    vector<int> writers;
+    vector<shared_ptr<HidStream>> streams;
+    for (int i = 0; i < devices; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) return;
+        char addr[18];
+        snprintf(addr, sizeof(addr), "98:B6:E9:00:00:%02X", i);
+        streams.push_back(streamer.Attach(addr, fds[0]));
+        writers.push_back(fds[1]);
+    }
+    mutex lock;
+    vector<gint64> ring, consumed, jitter;
+    vector<thread> consumers;
+    for (auto &stream : streams) {
+        consumers.emplace_back([&, stream]() {
+            vector<gint64> r, c, j;
+            int seen = 0;
+            while (seen < count && stream->Wait(1000)) {
+                auto batch = stream->Peek();
+                auto now = g_get_monotonic_time();
+                for (size_t i = 0; i < batch.size(); i++) {
+                    gint64 sent;
+                    memcpy(&sent, batch[i].data() + 1, sizeof(sent));
+                    auto delay = batch[i].timestamp_us - sent;
+                    c.push_back(now - sent);
+                    // change of the delay between consecutive reports
+                    if (!r.empty()) j.push_back(llabs(delay - r.back()));
+                    r.push_back(delay);
+                }
+                seen += batch.size();
+                stream->Release(batch.size());
+            }
+            lock_guard<mutex> _1(lock);
+            ring.insert(ring.end(), r.begin(), r.end());
+            consumed.insert(consumed.end(), c.begin(), c.end());
+            jitter.insert(jitter.end(), j.begin(), j.end());
+        });
+    }
+    guint8 input[49] = {0x30};
+    auto next = g_get_monotonic_time();
+    for (int n = 0; n < count; n++) {
+        for (auto fd : writers) {
+            auto now = g_get_monotonic_time();
+            memcpy(input + 1, &now, sizeof(now));
+            if (write(fd, input, sizeof(input)) < 0) break;
+        }
+        next += period_us;
+        auto wait = next - g_get_monotonic_time();
+        if (wait > 0) usleep(wait);
+    }
+    for (auto &consumer : consumers) consumer.join();
+    for (auto fd : writers) close(fd);
+    guint64 dropped = 0;
+    for (auto &stream : streams) dropped += stream->dropped();
+    report("write -> ring", ring);
+    report("write -> consumer", consumed);
+    report("jitter (delay change per report)", jitter);
+    printf("%-36s %d devices, %d us period, %llu dropped\n", "streamer", devices, period_us, (unsigned long long)dropped);
+}
+
+// RSSI storm over every device with and without the link rings, then the
+// cost of reading them back
+static void bench_telemetry(MockBluez &mock, const vector<string> &paths) {
+    printf("== link telemetry, %zu devices\n", paths.size());
+    const int count = 20000;
+    for (bool enabled : {false, true}) {
+        BluezOptions options;
+        options.event_overflow = EventOverflow::BLOCK;
+        options.telemetry.enabled = enabled;
+        BluezUtil util(options);
+        atomic<int> seen(0);
+        atomic<gint64> last(0);
+        util.Subscribe([&](BluetoothEvent, const BluetoothDevice *) {
+            seen++;
+            last = g_get_monotonic_time();
+        }, BluetoothEventBit(BluetoothEvent::EV_DEVICE_RSSI));
+        auto before = util.Stats();
+        auto start = g_get_monotonic_time();
+        for (int i = 0; i < count; i++) {
+            // every round changes each device's value, so each report is an event
+            mock.SetRssi(paths[i % paths.size()], -40 - (gint16)(i / paths.size() % 40));
+        }
+        for (int i = 0; i < 500 && seen < count; i++) usleep(10000);
+        auto elapsed = last - start;
+        printf("%-36s %8.0f reports/s  (%d of %d)\n", enabled ? "RSSI storm, telemetry" : "RSSI storm, no telemetry",
+               elapsed > 0 ? seen * 1e6 / elapsed : 0.0, seen.load(), count);
+        auto after = util.Stats();
+        if (after.enabled) {
+            auto busy = after.loop_busy_us - before.loop_busy_us, uptime = after.loop_uptime_us - before.loop_uptime_us;
+            printf("%-36s %5.1f %% busy\n", "loop thread", uptime > 0 ? busy * 100.0 / uptime : 0.0);
+        }
+        if (!enabled) continue;
+        vector<gint64> one, all;
+        BluezLinkStats stats;
+        for (int run = 0; run < 1000; run++) {
+            auto t0 = g_get_monotonic_time();
+            util.GetLinkStats(paths[run % paths.size()].c_str(), stats);
+            one.push_back(g_get_monotonic_time() - t0);
+        }
+        for (int run = 0; run < 20; run++) {
+            auto t0 = g_get_monotonic_time();
+            util.GetLinkStats();
+            all.push_back(g_get_monotonic_time() - t0);
+        }
+        report("GetLinkStats(path)", one);
+        report("GetLinkStats() all devices", all);
+    }
+}
+
+// Calls through the C interface, drained the way an FFI host polls the
+// eventfd. Every request id, also of a rejected or failed call, must
+// complete exactly once.
+static void bench_c_api(MockBluez &mock, const vector<string> &paths) {
+    printf("== C interface\n");
+    char error[128];
+    auto util = bluez_util_new(nullptr, error, sizeof(error));
+    if (!util) {
+        fprintf(stderr, "bluez_util_new: %s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    map<uint64_t, int> completed;
+    bluez_event events[64];
+    // counts the completions queued, true if id was among them
+    auto drain = [&](uint64_t id, bluez_event &done) {
+        bool found = false;
+        size_t n;
+        while ((n = bluez_util_drain(util, events, G_N_ELEMENTS(events))) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                if (events[i].kind != BLUEZ_KIND_COMPLETION) continue;
+                completed[events[i].request_id]++;
+                if (events[i].request_id != id) continue;
+                done = events[i];
+                found = true;
+            }
+        }
+        return found;
+    };
+    // false if id did not complete within 5 s
+    auto await = [&](uint64_t id, bluez_event &done) {
+        pollfd fd = {bluez_util_event_fd(util), POLLIN, 0};
+        auto deadline = g_get_monotonic_time() + 5000000;
+        while (g_get_monotonic_time() < deadline) {
+            if (poll(&fd, 1, 100) > 0 && drain(id, done)) return true;
+        }
+        return false;
+    };
+    // a paired device no other section touches
+    auto &path = paths[800];
+    const int count = 200;
+    vector<gint64> latency;
+    vector<uint64_t> ids;
+    bluez_event done = {};
+    for (int i = 0; i < count; i++) {
+        auto start = g_get_monotonic_time();
+        auto id = i % 2 ? bluez_util_disconnect(util, path.c_str(), -1) : bluez_util_connect(util, path.c_str(), -1);
+        ids.push_back(id);
+        if (!await(id, done) || done.error_code) {
+            fprintf(stderr, "request %llu: %s\n", (unsigned long long)id, done.error_code ? done.error_message : "no completion");
+            exit(EXIT_FAILURE);
+        }
+        latency.push_back(g_get_monotonic_time() - start);
+    }
+    report("call -> completion drained", latency);
+    // rejected before it is sent, and failed by bluetoothd
+    mock.FailNext(path, 1, "org.bluez.Error.Failed");
+    for (auto id : {bluez_util_connect(util, nullptr, -1), bluez_util_connect(util, path.c_str(), -1)}) {
+        ids.push_back(id);
+        if (!await(id, done) || !done.error_code) {
+            fprintf(stderr, "request %llu did not fail\n", (unsigned long long)id);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // late duplicates would show up here
+    usleep(100000);
+    drain(0, done);
+    for (auto id : ids) {
+        if (completed[id] == 1) continue;
+        fprintf(stderr, "request %llu completed %d times\n", (unsigned long long)id, completed[id]);
+        exit(EXIT_FAILURE);
+    }
+    printf("%-36s %zu requests, each completed once, %llu events dropped\n", "bluez_util_drain()", ids.size(),
+           (unsigned long long)bluez_util_dropped(util));
+    bluez_util_free(util);
+}
+
+// Filtered scan among strangers: time until the wanted controllers matched.
+// No stranger may be announced while the scan runs, and once it ended the
+// registry must hold every device bluetoothd knows again. Adds devices to
+// the mock, so it runs last.
+static void bench_scan(MockBluez &mock) {
+    const int strangers = 200, wanted = 4;
+    printf("== filtered scan, %d strangers\n", strangers);
+    BluezUtil util;
+    mutex lock;
+    int matched = 0, early = 0;
+    util.Subscribe([&](BluetoothEvent, const BluetoothDevice *device) {
+        lock_guard<mutex> _1(lock);
+        if (strcmp(device->name(), "Pro Controller") == 0) matched++;
+        else if (matched < wanted) early++;
+    }, BluetoothEventBit(BluetoothEvent::EV_DEVICE_FOUND));
+    auto before = util.GetDeviceSnapshot().size();
+    BluezScanOptions options;
+    options.max_matches = wanted;
+    options.timeout_ms = 10000;
+    auto start = g_get_monotonic_time();
+    auto scan = util.StartScan(options);
+    // discovery is turned on from the loop thread
+    usleep(50000);
+    for (int i = 0; i < strangers; i++) {
+        char addr[18];
+        snprintf(addr, sizeof(addr), "11:22:33:44:%02X:%02X", (unsigned)(i >> 8) & 0xff, (unsigned)i & 0xff);
+        mock.AddDevice(0, i % (strangers / wanted) == strangers / wanted - 1 ? "Pro Controller" : "Keyboard", addr);
+    }
+    auto result = scan.get();
+    auto elapsed = g_get_monotonic_time() - start;
+    // the strangers are admitted after the scan
+    usleep(200000);
+    auto added = util.GetDeviceSnapshot().size() - before;
+    printf("%-36s %zu matched in %lld ms (%s), registry +%zu after\n", "StartScan()", result.matches.size(), (long long)elapsed / 1000,
+           result.reason.c_str(), added);
+    lock_guard<mutex> _1(lock);
+    if (early || added != (size_t)strangers) {
+        fprintf(stderr, "filtered scan announced %d strangers early, registry +%zu of %d\n", early, added, strangers);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (!getenv("BENCH_VERBOSE")) g_log_set_default_handler(quiet, nullptr);
+
+    PrivateBus bus;
+    // BluezUtil talks to the system bus, point it at the private one
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", bus.address(), 1);
+    MockBluez mock(bus.address());
+    vector<string> paths;
+
+    bench_devices(mock, paths);
+    bench_startup(mock, paths.size());
+    bench_cache(mock, paths.size());
+    bench_latency(mock, paths[0]);
+    bench_throughput(mock, paths);
+    bench_telemetry(mock, paths);
+    bench_setup(paths);
+    bench_reconnect(mock, paths);
+    bench_replay(mock, paths);
+    bench_transports(mock, paths);
+    bench_stream();
+    bench_c_api(mock, paths);
+    bench_scan(mock);
+    return EXIT_SUCCESS;
+}
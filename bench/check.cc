@@ -0,0 +1,406 @@
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gutil.h"
+#include "gutil_c.h"
+#include "mock.h"
+
+using namespace std;
+using namespace bluez;
+using namespace bluez::mock;
+
+// Behaviour checks against the mock, each on a fresh bus. A mismatch is
+// listed on stderr and makes the run, and 'make check', fail.
+
+static int failures = 0;
+
+static void quiet(const gchar *domain, GLogLevelFlags level, const gchar *message, gpointer data) {
+    if (level & (G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG)) return;
+    g_log_default_handler(domain, level, message, data);
+}
+
+// false and a line on stderr when ok is not set
+static bool expect(bool ok, const char *check, const char *format, ...) {
+    if (ok) return true;
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s: ", check);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return false;
+}
+
+static void result(const char *check, bool ok) {
+    printf("%-36s %s\n", check, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+// polls until done() or timeout_ms passed, false on timeout
+static bool settle(const function<bool()> &done, int timeout_ms = 2000) {
+    auto deadline = g_get_monotonic_time() + timeout_ms * 1000ll;
+    while (!done()) {
+        if (g_get_monotonic_time() >= deadline) return false;
+        usleep(1000);
+    }
+    return true;
+}
+
+// A private bus with its own bluetoothd, BluezUtil finds it as the system bus.
+struct Bench {
+    PrivateBus bus;
+    unique_ptr<MockBluez> bluez;
+    Bench() {
+        setenv("DBUS_SYSTEM_BUS_ADDRESS", bus.address(), 1);
+        bluez.reset(new MockBluez(bus.address()));
+    }
+};
+
+// Events in the order a listener got them.
+struct EventLog {
+    struct Entry {
+        BluetoothEvent event;
+        string path;
+        string name;
+        bool operator==(const Entry &other) const { return event == other.event && path == other.path; }
+    };
+    mutex lock;
+    vector<Entry> entries;
+    BluetoothEventCallback listener() {
+        return [this](BluetoothEvent event, const BluetoothDevice *device) {
+            lock_guard<mutex> _1(lock);
+            entries.push_back({event, device ? device->object_path() : "", device ? device->name() : ""});
+        };
+    }
+    vector<Entry> get() {
+        lock_guard<mutex> _1(lock);
+        return entries;
+    }
+    size_t count(BluetoothEvent event, const string &path) {
+        auto all = get();
+        return count_if(all.begin(), all.end(), [&](const Entry &e) { return e.event == event && e.path == path; });
+    }
+    // waits until no event arrived for 200 ms
+    void idle() {
+        for (size_t last = -1; last != get().size();) {
+            last = get().size();
+            usleep(200000);
+        }
+    }
+};
+
+// One line per device, sorted. The cache does not keep the link state.
+static string describe(const BluetoothDeviceSnapshot &snapshot, bool link = true) {
+    vector<string> lines;
+    for (auto &device : snapshot) {
+        char line[512];
+        snprintf(line, sizeof(line), "%s %s '%s' paired %d trusted %d class %x", device.object_path, device.address, device.name,
+                 device.paired, device.trusted, device.device_class);
+        lines.push_back(line);
+        if (link) lines.back() += " connected " + to_string(device.connected) + " rssi " + to_string(device.rssi);
+    }
+    sort(lines.begin(), lines.end());
+    string all;
+    for (auto &line : lines) all += line + "\n";
+    return all;
+}
+
+static string name_of(BluezUtil &util, const string &path) {
+    auto snapshot = util.GetDeviceSnapshot();
+    for (auto &device : snapshot) {
+        if (path == device.object_path) return device.name;
+    }
+    return "";
+}
+
+// index of the first difference, the shorter size if one starts the other
+static size_t mismatch_at(const vector<EventLog::Entry> &a, const vector<EventLog::Entry> &b) {
+    size_t i = 0;
+    while (i < a.size() && i < b.size() && a[i] == b[i]) i++;
+    return i;
+}
+
+// Sync Connect, Disconnect and a failing Connect leave the final state
+// behind when they return, the signals announce it once. An async call shows
+// its transition first and the final state in its callback.
+static void check_states() {
+    const char *check = "state transitions";
+    Bench bench;
+    auto path = bench.bluez->AddDevice(0, "Pro Controller", "AA:00:00:00:00:01", true);
+    BluezUtil util;
+    EventLog log;
+    util.Subscribe(log.listener(), EV_MASK_DEVICE);
+    bool ok = true;
+    BluezConnectPhases phases;
+
+    util.Connect(path.c_str());
+    auto state = util.GetDeviceState(path.c_str(), &phases);
+    ok &= expect(state == BluetoothEvent::EV_DEVICE_CONNECTED, check, "state %x after Connect()", BluetoothEventValue(state));
+    ok &= expect(phases.requested_us && phases.link_up_us, check, "Connect() returned without the link up phase");
+    ok &= expect(settle([&]() { return util.GetDeviceState(path.c_str(), &phases) == BluetoothEvent::EV_DEVICE_CONNECTED && phases.ready_us; }),
+                 check, "Connect() never became ready");
+
+    util.Disconnect(path.c_str());
+    state = util.GetDeviceState(path.c_str());
+    ok &= expect(state == BluetoothEvent::EV_DEVICE_PAIRED, check, "state %x after Disconnect()", BluetoothEventValue(state));
+
+    bench.bluez->FailNext(path, 1, "org.bluez.Error.Failed");
+    string error;
+    try {
+        util.Connect(path.c_str());
+    } catch (const BluezError &e) {
+        error = e.name;
+    }
+    state = util.GetDeviceState(path.c_str(), &phases);
+    ok &= expect(error == "org.bluez.Error.Failed", check, "failing Connect() raised '%s'", error.c_str());
+    ok &= expect(state == BluetoothEvent::EV_DEVICE_PAIRED && phases.failed_us, check, "state %x after a failed Connect()",
+                 BluetoothEventValue(state));
+
+    log.idle();
+    auto before = log.get().size();
+    atomic<int> answered(-1);
+    util.ConnectAsync(path.c_str(), -1, [&](const BluezError *e) {
+        answered = e ? 0 : BluetoothEventValue(util.GetDeviceState(path.c_str()));
+    });
+    ok &= expect(settle([&]() { return answered >= 0; }), check, "ConnectAsync() did not complete");
+    ok &= expect(answered == BluetoothEventValue(BluetoothEvent::EV_DEVICE_CONNECTED), check, "state %x in the ConnectAsync() callback",
+                 answered.load());
+    log.idle();
+
+    // every change announced once, the async transition before its end
+    ok &= expect(log.count(BluetoothEvent::EV_DEVICE_CONNECTED, path) == 2, check, "%zu EV_DEVICE_CONNECTED for 2 connects",
+                 log.count(BluetoothEvent::EV_DEVICE_CONNECTED, path));
+    ok &= expect(log.count(BluetoothEvent::EV_DEVICE_DISCONNECTED, path) == 1, check, "%zu EV_DEVICE_DISCONNECTED for 1 disconnect",
+                 log.count(BluetoothEvent::EV_DEVICE_DISCONNECTED, path));
+    auto events = log.get();
+    auto connecting = find_if(events.begin() + before, events.end(), [](const EventLog::Entry &e) { return e.event == BluetoothEvent::EV_DEVICE_CONNECTING; });
+    auto connected = find_if(events.begin() + before, events.end(), [](const EventLog::Entry &e) { return e.event == BluetoothEvent::EV_DEVICE_CONNECTED; });
+    ok &= expect(connecting < connected && connected != events.end(), check, "ConnectAsync() did not announce its transition first");
+    result(check, ok);
+}
+
+// The cache written by one instance lists the same devices in the next one
+// before bluetoothd answered, marked as cached until reconciled.
+static void check_cache() {
+    const char *check = "cache round trip";
+    Bench bench;
+    char cache[] = "/tmp/check-cache-XXXXXX";
+    int fd = mkstemp(cache);
+    if (fd < 0) return result(check, expect(false, check, "mkstemp: %s", strerror(errno)));
+    close(fd);
+    unlink(cache);
+    bench.bluez->AddDevice(0, "Pro Controller", "AA:00:00:00:00:01", true);
+    bench.bluez->AddDevice(0, "Joy-Con (L)", "AA:00:00:00:00:02", false);
+    auto renamed = bench.bluez->AddDevice(0, "Joy-Con (R)", "AA:00:00:00:00:03", true);
+    BluezOptions options;
+    options.cache.path = cache;
+    string written;
+    {
+        BluezUtil util(options);
+        util.Ready().get();
+        bench.bluez->SetName(renamed, "Joy-Con (R) 2");
+        settle([&]() { return name_of(util, renamed) == "Joy-Con (R) 2"; });
+        written = describe(util.GetDeviceSnapshot(), false);
+    }
+    bool ok = true;
+    bench.bluez->SetReplyDelay(300);
+    {
+        options.lazy_start = true;
+        BluezUtil util(options);
+        auto cached = util.GetDeviceSnapshot();
+        ok &= expect(describe(cached, false) == written, check, "cached devices differ:\n%sinstead of\n%s", describe(cached, false).c_str(),
+                     written.c_str());
+        ok &= expect(all_of(cached.begin(), cached.end(), [](const BluetoothDeviceInfo &d) { return d.cached; }), check,
+                     "devices not marked as cached");
+        util.Ready().get();
+        auto reconciled = util.GetDeviceSnapshot();
+        ok &= expect(describe(reconciled, false) == written, check, "devices after reconciling differ");
+        ok &= expect(none_of(reconciled.begin(), reconciled.end(), [](const BluetoothDeviceInfo &d) { return d.cached; }), check,
+                     "devices still marked as cached after Ready()");
+    }
+    unlink(cache);
+    result(check, ok);
+}
+
+// Replaying a recording raises the events the live run raised, in the same
+// order, and leaves the same registry.
+static void check_replay() {
+    const char *check = "replay equivalence";
+    Bench bench;
+    char log_path[] = "/tmp/check-signals-XXXXXX";
+    int fd = mkstemp(log_path);
+    if (fd < 0) return result(check, expect(false, check, "mkstemp: %s", strerror(errno)));
+    close(fd);
+    vector<string> paths;
+    for (int i = 0; i < 3; i++) {
+        char addr[18];
+        snprintf(addr, sizeof(addr), "AA:00:00:00:00:%02X", i);
+        paths.push_back(bench.bluez->AddDevice(0, "Joy-Con (L)", addr, true));
+    }
+    vector<EventLog::Entry> live;
+    string registry;
+    {
+        BluezUtil util;
+        util.Ready().get();
+        EventLog log;
+        util.Subscribe(log.listener(), EV_MASK_DEVICE);
+        util.StartRecording(log_path);
+        for (int i = 3; i < 6; i++) {
+            char addr[18];
+            snprintf(addr, sizeof(addr), "AA:00:00:00:00:%02X", i);
+            paths.push_back(bench.bluez->AddDevice(0, "Pro Controller", addr, false));
+        }
+        for (int i = 0; i < 30; i++) bench.bluez->SetRssi(paths[i % paths.size()], -30 - i);
+        bench.bluez->SetConnected(paths[1], true);
+        bench.bluez->SetName(paths[2], "renamed");
+        bench.bluez->SetConnected(paths[1], false);
+        bench.bluez->RemoveDevice(paths[5]);
+        log.idle();
+        util.StopRecording();
+        live = log.get();
+        registry = describe(util.GetDeviceSnapshot());
+    }
+    BluezOptions options;
+    options.offline = true;
+    options.event_overflow = EventOverflow::BLOCK;
+    BluezUtil util(options);
+    EventLog log;
+    util.Subscribe(log.listener(), EV_MASK_DEVICE);
+    auto replay = util.Replay(log_path).get();
+    log.idle();
+    unlink(log_path);
+    // the devices known when recording started are found first
+    auto replayed = log.get();
+    for (int i = 0; i < 3; i++) {
+        auto found = find(replayed.begin(), replayed.end(), EventLog::Entry{BluetoothEvent::EV_DEVICE_FOUND, paths[i], ""});
+        if (found != replayed.end()) replayed.erase(found);
+    }
+    bool ok = expect(replay.signals > 0, check, "nothing replayed");
+    auto mismatch = mismatch_at(live, replayed);
+    ok &= expect(live.size() == replayed.size() && mismatch == live.size(), check, "%zu live and %zu replayed events, first difference at %zu",
+                 live.size(), replayed.size(), mismatch);
+    ok &= expect(describe(util.GetDeviceSnapshot()) == registry, check, "registry differs after replay:\n%sinstead of\n%s",
+                 describe(util.GetDeviceSnapshot()).c_str(), registry.c_str());
+    result(check, ok);
+}
+
+// Entries past queue_capacity drop the oldest device event, so the host gets
+// the latest state. Completions are never dropped, a device event that finds
+// only completions in a full queue is dropped itself.
+static void check_c_queue() {
+    const char *check = "C queue overflow";
+    Bench bench;
+    auto path = bench.bluez->AddDevice(0, "Pro Controller", "AA:00:00:00:00:01", true);
+    bluez_options options = {};
+    options.queue_capacity = 4;
+    options.event_mask = BluetoothEventBit(BluetoothEvent::EV_DEVICE_RSSI);
+    char error[128];
+    auto util = bluez_util_new(&options, error, sizeof(error));
+    if (!util) return result(check, expect(false, check, "bluez_util_new: %s", error));
+    bool ok = true;
+    bluez_event events[16];
+
+    for (int i = 0; i < 20; i++) bench.bluez->SetRssi(path, -1 - i);
+    ok &= expect(settle([&]() { return bluez_util_dropped(util) >= 16; }), check, "%llu of 16 events dropped",
+                 (unsigned long long)bluez_util_dropped(util));
+    auto n = bluez_util_drain(util, events, G_N_ELEMENTS(events));
+    ok &= expect(n == 4, check, "%zu entries kept in a queue of 4", n);
+    for (size_t i = 0; i < n; i++) {
+        // the newest, -17 to -20
+        auto rssi = -(int)(21 - n + i);
+        ok &= expect(events[i].kind == BLUEZ_KIND_EVENT && events[i].rssi == rssi, check, "entry %zu has RSSI %d instead of %d", i, events[i].rssi, rssi);
+    }
+
+    set<uint64_t> ids;
+    for (int i = 0; i < 6; i++) ids.insert(i % 2 ? bluez_util_disconnect(util, path.c_str(), -1) : bluez_util_connect(util, path.c_str(), -1));
+    // the completions fill the queue before the next events come
+    pollfd pfd = {bluez_util_event_fd(util), POLLIN, 0};
+    poll(&pfd, 1, 2000);
+    usleep(300000);
+    auto dropped = bluez_util_dropped(util);
+    for (int i = 0; i < 3; i++) bench.bluez->SetRssi(path, -50 - i);
+    ok &= expect(settle([&]() { return bluez_util_dropped(util) >= dropped + 3; }), check, "%llu of 3 events dropped behind completions",
+                 (unsigned long long)(bluez_util_dropped(util) - dropped));
+    n = bluez_util_drain(util, events, G_N_ELEMENTS(events));
+    set<uint64_t> completed;
+    for (size_t i = 0; i < n; i++) {
+        if (events[i].kind == BLUEZ_KIND_COMPLETION && completed.insert(events[i].request_id).second) continue;
+        ok &= expect(false, check, "unexpected entry, kind %u request %llu", events[i].kind, (unsigned long long)events[i].request_id);
+    }
+    ok &= expect(completed == ids, check, "%zu of %zu completions drained", completed.size(), ids.size());
+    bluez_util_free(util);
+    result(check, ok);
+}
+
+// A filtered scan among strangers announces no stranger before the wanted
+// controllers matched, one that is unnamed at first matches once its name
+// resolves, and afterwards the registry holds every device bluetoothd knows.
+static void check_filter() {
+    const char *check = "filter admission";
+    const int strangers = 20;
+    Bench bench;
+    bench.bluez->AddDevice(0, "Keyboard", "AA:00:00:00:00:01", true);
+    BluezUtil util;
+    util.Ready().get();
+    EventLog log;
+    util.Subscribe(log.listener(), BluetoothEventBit(BluetoothEvent::EV_DEVICE_FOUND) | BluetoothEventBit(BluetoothEvent::EV_DEVICE_NAME));
+    BluezScanOptions options;
+    options.max_matches = 2;
+    options.timeout_ms = 5000;
+    auto scan = util.StartScan(options);
+    // discovery is turned on from the loop thread
+    usleep(50000);
+    for (int i = 0; i < strangers; i++) {
+        char addr[18];
+        snprintf(addr, sizeof(addr), "BB:00:00:00:00:%02X", i);
+        bench.bluez->AddDevice(0, "Keyboard", addr);
+    }
+    auto unnamed = bench.bluez->AddDevice(0, "", "CC:00:00:00:00:01");
+    auto wanted = bench.bluez->AddDevice(0, "Pro Controller", "CC:00:00:00:00:02");
+    bench.bluez->SetName(unnamed, "Joy-Con (L)");
+    auto found = scan.get();
+    log.idle();
+
+    bool ok = expect(found.reason == "matches", check, "scan ended with '%s'", found.reason.c_str());
+    ok &= expect(set<string>(found.matches.begin(), found.matches.end()) == set<string>{unnamed, wanted}, check, "%zu devices matched",
+                 found.matches.size());
+    // the last match is the rename, strangers only come after it
+    auto events = log.get();
+    auto renamed = find_if(events.begin(), events.end(), [&](const EventLog::Entry &e) { return e.event == BluetoothEvent::EV_DEVICE_NAME && e.path == unnamed; });
+    ok &= expect(renamed != events.end(), check, "the unnamed device was not announced under its name");
+    auto early = count_if(events.begin(), renamed, [](const EventLog::Entry &e) { return e.name == "Keyboard"; });
+    ok &= expect(early == 0, check, "%zd strangers announced while scanning", (ssize_t)early);
+    auto late = count_if(renamed, events.end(), [](const EventLog::Entry &e) { return e.event == BluetoothEvent::EV_DEVICE_FOUND && e.name == "Keyboard"; });
+    ok &= expect(late == strangers, check, "%zd of %d strangers found after the scan", (ssize_t)late, strangers);
+
+    set<string> known, listed;
+    for (auto &path : bench.bluez->DevicePaths()) known.insert(path);
+    auto snapshot = util.GetDeviceSnapshot();
+    for (auto &device : snapshot) listed.insert(device.object_path);
+    ok &= expect(listed == known, check, "registry holds %zu of %zu devices", listed.size(), known.size());
+    result(check, ok);
+}
+
+int main(int argc, char **argv) {
+    if (!getenv("BENCH_VERBOSE")) g_log_set_default_handler(quiet, nullptr);
+    check_states();
+    check_cache();
+    check_replay();
+    check_c_queue();
+    check_filter();
+    if (failures) fprintf(stderr, "%d of 5 checks failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
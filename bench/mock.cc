@@ -0,0 +1,514 @@
+#include "mock.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <future>
+
+#define BLUEZ "org.bluez"
+#define BLUEZ_MANAGER_IFACE "org.freedesktop.DBus.ObjectManager"
+#define BLUEZ_PROPERTY_IFACE "org.freedesktop.DBus.Properties"
+#define BLUEZ_ADAPTER_IFACE "org.bluez.Adapter1"
+#define BLUEZ_DEVICE_IFACE "org.bluez.Device1"
+#define BLUEZ_AGENT_MANAGER_IFACE "org.bluez.AgentManager1"
+#define BLUEZ_AGENT_IFACE "org.bluez.Agent1"
+
+#define log(fmt, ...) g_message("[MockBluez]" fmt "", __VA_ARGS__)
+
+using namespace bluez::mock;
+
+static const char *BUS_CONFIG =
+    "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+    " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+    "<busconfig>\n"
+    "  <type>session</type>\n"
+    "  <listen>unix:tmpdir=/tmp</listen>\n"
+    "  <auth>EXTERNAL</auth>\n"
+    "  <policy context=\"default\">\n"
+    "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+    "    <allow eavesdrop=\"true\"/>\n"
+    "    <allow own=\"*\"/>\n"
+    "  </policy>\n"
+    "</busconfig>\n";
+
+static const char *INTROSPECTION =
+    "<node>"
+    "  <interface name='org.freedesktop.DBus.ObjectManager'>"
+    "    <method name='GetManagedObjects'><arg type='a{oa{sa{sv}}}' direction='out'/></method>"
+    "    <signal name='InterfacesAdded'><arg type='o'/><arg type='a{sa{sv}}'/></signal>"
+    "    <signal name='InterfacesRemoved'><arg type='o'/><arg type='as'/></signal>"
+    "  </interface>"
+    "  <interface name='org.bluez.AgentManager1'>"
+    "    <method name='RegisterAgent'><arg type='o' direction='in'/><arg type='s' direction='in'/></method>"
+    "    <method name='UnregisterAgent'><arg type='o' direction='in'/></method>"
+    "    <method name='RequestDefaultAgent'><arg type='o' direction='in'/></method>"
+    "  </interface>"
+    "  <interface name='org.bluez.Adapter1'>"
+    "    <method name='StartDiscovery'/>"
+    "    <method name='StopDiscovery'/>"
+    "    <method name='SetDiscoveryFilter'><arg type='a{sv}' direction='in'/></method>"
+    "    <method name='RemoveDevice'><arg type='o' direction='in'/></method>"
+    "    <property name='Address' type='s' access='read'/>"
+    "    <property name='Name' type='s' access='read'/>"
+    "    <property name='Powered' type='b' access='read'/>"
+    "    <property name='Discovering' type='b' access='read'/>"
+    "  </interface>"
+    "  <interface name='org.bluez.Device1'>"
+    "    <method name='Connect'/>"
+    "    <method name='Disconnect'/>"
+    "    <method name='Pair'/>"
+    "    <method name='CancelPairing'/>"
+    "    <property name='Address' type='s' access='read'/>"
+    "    <property name='Name' type='s' access='read'/>"
+    "    <property name='Paired' type='b' access='read'/>"
+    "    <property name='Trusted' type='b' access='readwrite'/>"
+    "    <property name='Connected' type='b' access='read'/>"
+    "    <property name='ServicesResolved' type='b' access='read'/>"
+    "    <property name='RSSI' type='n' access='read'/>"
+    "    <property name='Class' type='u' access='read'/>"
+    "    <property name='Adapter' type='o' access='read'/>"
+    "  </interface>"
+    "</node>";
+
+PrivateBus::PrivateBus() : pid(-1) {
+    char config[] = "/tmp/bluez-mock-XXXXXX";
+    int fd = mkstemp(config);
+    g_assert(fd >= 0);
+    g_assert(write(fd, BUS_CONFIG, strlen(BUS_CONFIG)) == (ssize_t)strlen(BUS_CONFIG));
+    close(fd);
+    config_path = config;
+    int pipefd[2];
+    g_assert(pipe(pipefd) == 0);
+    pid = fork();
+    g_assert(pid >= 0);
+    if (pid == 0) {
+        close(pipefd[0]);
+        // keep the daemon's warnings (e.g. fd limits) out of the report
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDERR_FILENO);
+        auto config_arg = std::string("--config-file=") + config_path;
+        auto fd_arg = std::string("--print-address=") + std::to_string(pipefd[1]);
+        execlp("dbus-daemon", "dbus-daemon", config_arg.c_str(), "--nofork", fd_arg.c_str(), nullptr);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    char buf[512];
+    ssize_t len = 0, n;
+    while (len < (ssize_t)sizeof(buf) - 1 && (n = read(pipefd[0], buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+        if (memchr(buf, '\n', len)) break;
+    }
+    close(pipefd[0]);
+    buf[len] = 0;
+    if (auto nl = strchr(buf, '\n')) *nl = 0;
+    address_ = buf;
+    if (address_.empty()) {
+        log("%s", "dbus-daemon failed to start");
+        abort();
+    }
+}
+
+PrivateBus::~PrivateBus() {
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+    unlink(config_path.c_str());
+}
+
+MockBluez::MockBluez(const char *bus_address, int n_adapters)
+    : context(g_main_context_new()), loop(g_main_loop_new(context, false)), conn(nullptr), introspection(nullptr),
+      bus_address(bus_address), reply_delay_ms(0), discovering(false), ready(false) {
+    for (int i = 0; i < n_adapters; i++)
+        adapters[std::string("/org/bluez/hci") + std::to_string(i)] = 0;
+    thread = std::thread(&MockBluez::run, this);
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return ready; });
+}
+
+MockBluez::~MockBluez() {
+    g_main_loop_quit(loop);
+    thread.join();
+    g_main_loop_unref(loop);
+    g_main_context_unref(context);
+}
+
+void MockBluez::run() {
+    g_main_context_push_thread_default(context);
+    GError *err = nullptr;
+    conn = g_dbus_connection_new_for_address_sync(bus_address.c_str(), (GDBusConnectionFlags)(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION), nullptr, nullptr, &err);
+    g_assert(conn);
+    auto reply = g_dbus_connection_call_sync(conn, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "RequestName",
+                                             g_variant_new("(su)", BLUEZ, 4), nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, &err);
+    g_assert(reply);
+    g_variant_unref(reply);
+    introspection = g_dbus_node_info_new_for_xml(INTROSPECTION, &err);
+    g_assert(introspection);
+    static const GDBusInterfaceVTable vtable = {method_call_cb, get_property_cb, nullptr, {}};
+    auto manager = g_dbus_connection_register_object(conn, "/", g_dbus_node_info_lookup_interface(introspection, BLUEZ_MANAGER_IFACE), &vtable, this, nullptr, &err);
+    g_assert(manager);
+    auto agent_manager = g_dbus_connection_register_object(conn, "/org/bluez", g_dbus_node_info_lookup_interface(introspection, BLUEZ_AGENT_MANAGER_IFACE), &vtable, this, nullptr, &err);
+    g_assert(agent_manager);
+    for (auto &adapter : adapters) {
+        adapter.second = g_dbus_connection_register_object(conn, adapter.first.c_str(), g_dbus_node_info_lookup_interface(introspection, BLUEZ_ADAPTER_IFACE), &vtable, this, nullptr, &err);
+        g_assert(adapter.second);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready = true;
+    }
+    cond.notify_all();
+    g_main_loop_run(loop);
+    for (auto &device : devices)
+        g_dbus_connection_unregister_object(conn, device.second.registration);
+    for (auto &adapter : adapters)
+        g_dbus_connection_unregister_object(conn, adapter.second);
+    g_dbus_connection_unregister_object(conn, agent_manager);
+    g_dbus_connection_unregister_object(conn, manager);
+    g_dbus_connection_close_sync(conn, nullptr, nullptr);
+    g_object_unref(conn);
+    g_dbus_node_info_unref(introspection);
+    g_main_context_pop_thread_default(context);
+}
+
+struct Invocation {
+    std::function<void()> fn;
+    std::promise<void> done;
+};
+
+void MockBluez::invoke(std::function<void()> fn) {
+    auto invocation = new Invocation{fn, {}};
+    auto done = invocation->done.get_future();
+    g_main_context_invoke_full(context, G_PRIORITY_DEFAULT, [](gpointer data) -> gboolean {
+        auto invocation = reinterpret_cast<Invocation *>(data);
+        invocation->fn();
+        invocation->done.set_value();
+        delete invocation;
+        return G_SOURCE_REMOVE;
+    }, invocation, nullptr);
+    done.wait();
+}
+
+GVariant *MockBluez::device_properties(const MockDevice &d) {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "Address", g_variant_new_string(d.address.c_str()));
+    g_variant_builder_add(&builder, "{sv}", "Name", g_variant_new_string(d.name.c_str()));
+    g_variant_builder_add(&builder, "{sv}", "Paired", g_variant_new_boolean(d.paired));
+    g_variant_builder_add(&builder, "{sv}", "Trusted", g_variant_new_boolean(d.trusted));
+    g_variant_builder_add(&builder, "{sv}", "Connected", g_variant_new_boolean(d.connected));
+    g_variant_builder_add(&builder, "{sv}", "ServicesResolved", g_variant_new_boolean(d.services_resolved));
+    g_variant_builder_add(&builder, "{sv}", "RSSI", g_variant_new_int16(d.rssi));
+    g_variant_builder_add(&builder, "{sv}", "Class", g_variant_new_uint32(d.klass));
+    g_variant_builder_add(&builder, "{sv}", "Adapter", g_variant_new_object_path(d.adapter.c_str()));
+    return g_variant_builder_end(&builder);
+}
+
+GVariant *MockBluez::adapter_properties(const char *path) {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    auto name = std::string(path + strlen("/org/bluez/"));
+    g_variant_builder_add(&builder, "{sv}", "Address", g_variant_new_string("00:00:00:00:00:00"));
+    g_variant_builder_add(&builder, "{sv}", "Name", g_variant_new_string(name.c_str()));
+    g_variant_builder_add(&builder, "{sv}", "Powered", g_variant_new_boolean(true));
+    g_variant_builder_add(&builder, "{sv}", "Discovering", g_variant_new_boolean(discovering));
+    return g_variant_builder_end(&builder);
+}
+
+void MockBluez::emit_changed(const char *path, const char *iface, GVariant *changed, const char *invalidated) {
+    const char *names[] = {invalidated, nullptr};
+    g_dbus_connection_emit_signal(conn, nullptr, path, BLUEZ_PROPERTY_IFACE, "PropertiesChanged",
+                                  g_variant_new("(s@a{sv}@as)", iface, changed, g_variant_new_strv(names, -1)), nullptr);
+}
+
+static GVariant *single(const char *key, GVariant *value) {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", key, value);
+    return g_variant_builder_end(&builder);
+}
+
+void MockBluez::register_device(MockDevice &device) {
+    static const GDBusInterfaceVTable vtable = {method_call_cb, get_property_cb, set_property_cb, {}};
+    GError *err = nullptr;
+    device.registration = g_dbus_connection_register_object(conn, device.path.c_str(), g_dbus_node_info_lookup_interface(introspection, BLUEZ_DEVICE_IFACE), &vtable, this, nullptr, &err);
+    g_assert(device.registration);
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa{sv}}"));
+    g_variant_builder_add(&builder, "{s@a{sv}}", BLUEZ_DEVICE_IFACE, device_properties(device));
+    g_dbus_connection_emit_signal(conn, nullptr, "/", BLUEZ_MANAGER_IFACE, "InterfacesAdded",
+                                  g_variant_new("(o@a{sa{sv}})", device.path.c_str(), g_variant_builder_end(&builder)), nullptr);
+}
+
+std::string MockBluez::AddDevice(int adapter, const char *name, const char *address, bool paired) {
+    auto adapter_path = std::string("/org/bluez/hci") + std::to_string(adapter);
+    auto path = adapter_path + "/dev_" + address;
+    for (auto &c : path)
+        if (c == ':') c = '_';
+    invoke([&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &device = devices[path];
+        device = MockDevice{path, adapter_path, name, address, paired, paired, false, false, -60, 0x2508, 0, 0, {}};
+        register_device(device);
+    });
+    return path;
+}
+
+void MockBluez::SetRunning(bool running) {
+    invoke([&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        // a restarted bluetoothd forgets its agents
+        if (!running) agents.clear();
+        auto reply = g_dbus_connection_call_sync(conn, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                                 running ? "RequestName" : "ReleaseName",
+                                                 running ? g_variant_new("(su)", BLUEZ, 4) : g_variant_new("(s)", BLUEZ),
+                                                 nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, nullptr);
+        g_assert(reply);
+        g_variant_unref(reply);
+    });
+}
+
+size_t MockBluez::AgentCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return agents.size();
+}
+
+void MockBluez::RemoveDevice(const std::string &path) {
+    invoke([&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = devices.find(path);
+        if (it == devices.end()) return;
+        g_dbus_connection_unregister_object(conn, it->second.registration);
+        devices.erase(it);
+        const char *ifaces[] = {BLUEZ_DEVICE_IFACE, nullptr};
+        g_dbus_connection_emit_signal(conn, nullptr, "/", BLUEZ_MANAGER_IFACE, "InterfacesRemoved",
+                                      g_variant_new("(o@as)", path.c_str(), g_variant_new_strv(ifaces, -1)), nullptr);
+    });
+}
+
+void MockBluez::SetConnected(const std::string &path, bool connected) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = devices.find(path);
+    if (it == devices.end()) return;
+    it->second.connected = connected;
+    emit_changed(path.c_str(), BLUEZ_DEVICE_IFACE, single("Connected", g_variant_new_boolean(connected)));
+}
+
+void MockBluez::SetPaired(const std::string &path, bool paired) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = devices.find(path);
+    if (it == devices.end()) return;
+    it->second.paired = paired;
+    emit_changed(path.c_str(), BLUEZ_DEVICE_IFACE, single("Paired", g_variant_new_boolean(paired)));
+}
+
+void MockBluez::SetName(const std::string &path, const char *name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = devices.find(path);
+    if (it == devices.end()) return;
+    it->second.name = name;
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "Name", g_variant_new_string(name));
+    g_variant_builder_add(&builder, "{sv}", "Alias", g_variant_new_string(name));
+    emit_changed(path.c_str(), BLUEZ_DEVICE_IFACE, g_variant_builder_end(&builder));
+}
+
+void MockBluez::SetRssi(const std::string &path, gint16 rssi) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = devices.find(path);
+    if (it == devices.end()) return;
+    it->second.rssi = rssi;
+    emit_changed(path.c_str(), BLUEZ_DEVICE_IFACE, single("RSSI", g_variant_new_int16(rssi)));
+}
+
+void MockBluez::FailNext(const std::string &path, int count, const char *error) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = devices.find(path);
+    if (it == devices.end()) return;
+    it->second.failures = count;
+    it->second.failure = error;
+}
+
+std::vector<std::string> MockBluez::DevicePaths() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> paths;
+    for (auto &device : devices)
+        paths.push_back(device.first);
+    return paths;
+}
+
+void MockBluez::method_call(const gchar *sender, const gchar *object_path, const gchar *interface_name, const gchar *method_name, GVariant *parameters, GDBusMethodInvocation *invocation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (strcmp(interface_name, BLUEZ_AGENT_MANAGER_IFACE) == 0) {
+        const gchar *agent;
+        g_variant_get_child(parameters, 0, "&o", &agent);
+        if (strcmp(method_name, "RegisterAgent") == 0) {
+            if (agents.count(sender)) {
+                g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.AlreadyExists", "Already Exists");
+                return;
+            }
+            agents[sender] = agent;
+        } else if (strcmp(method_name, "UnregisterAgent") == 0) {
+            agents.erase(sender);
+        }
+        g_dbus_method_invocation_return_value(invocation, nullptr);
+        return;
+    }
+    if (strcmp(interface_name, BLUEZ_MANAGER_IFACE) == 0) {
+        GVariantBuilder builder;
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+        for (auto &adapter : adapters) {
+            g_variant_builder_open(&builder, G_VARIANT_TYPE("{oa{sa{sv}}}"));
+            g_variant_builder_add(&builder, "o", adapter.first.c_str());
+            g_variant_builder_open(&builder, G_VARIANT_TYPE("a{sa{sv}}"));
+            g_variant_builder_add(&builder, "{s@a{sv}}", BLUEZ_ADAPTER_IFACE, adapter_properties(adapter.first.c_str()));
+            g_variant_builder_close(&builder);
+            g_variant_builder_close(&builder);
+        }
+        for (auto &device : devices) {
+            g_variant_builder_open(&builder, G_VARIANT_TYPE("{oa{sa{sv}}}"));
+            g_variant_builder_add(&builder, "o", device.first.c_str());
+            g_variant_builder_open(&builder, G_VARIANT_TYPE("a{sa{sv}}"));
+            g_variant_builder_add(&builder, "{s@a{sv}}", BLUEZ_DEVICE_IFACE, device_properties(device.second));
+            g_variant_builder_close(&builder);
+            g_variant_builder_close(&builder);
+        }
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(@a{oa{sa{sv}}})", g_variant_builder_end(&builder)));
+        return;
+    }
+    if (strcmp(interface_name, BLUEZ_ADAPTER_IFACE) == 0) {
+        if (strcmp(method_name, "StartDiscovery") == 0 || strcmp(method_name, "StopDiscovery") == 0) {
+            discovering = strcmp(method_name, "StartDiscovery") == 0;
+            emit_changed(object_path, BLUEZ_ADAPTER_IFACE, single("Discovering", g_variant_new_boolean(discovering)));
+            // like bluetoothd, RSSI is only known while discovering
+            for (auto &device : devices) {
+                if (discovering || device.second.adapter != object_path) continue;
+                GVariantBuilder builder;
+                g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+                emit_changed(device.first.c_str(), BLUEZ_DEVICE_IFACE, g_variant_builder_end(&builder), "RSSI");
+            }
+        }
+        g_dbus_method_invocation_return_value(invocation, nullptr);
+        return;
+    }
+    auto it = devices.find(object_path);
+    if (it == devices.end()) {
+        g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.DoesNotExist", "No such device");
+        return;
+    }
+    auto &device = it->second;
+    if (device.failures > 0) {
+        device.failures--;
+        g_dbus_method_invocation_return_dbus_error(invocation, device.failure.c_str(), "Injected failure");
+        return;
+    }
+    if (strcmp(method_name, "Connect") == 0) {
+        device.connected = true;
+        emit_changed(object_path, BLUEZ_DEVICE_IFACE, single("Connected", g_variant_new_boolean(true)));
+        device.services_resolved = true;
+        emit_changed(object_path, BLUEZ_DEVICE_IFACE, single("ServicesResolved", g_variant_new_boolean(true)));
+    } else if (strcmp(method_name, "Disconnect") == 0) {
+        device.services_resolved = false;
+        emit_changed(object_path, BLUEZ_DEVICE_IFACE, single("ServicesResolved", g_variant_new_boolean(false)));
+        device.connected = false;
+        emit_changed(object_path, BLUEZ_DEVICE_IFACE, single("Connected", g_variant_new_boolean(false)));
+    } else if (strcmp(method_name, "Pair") == 0) {
+        auto agent = agents.find(sender);
+        if (agent != agents.end() && !device.paired) {
+            // like bluetoothd, let the caller's agent confirm the pairing
+            confirm_pairing(sender, agent->second.c_str(), object_path, invocation);
+            return;
+        }
+        device.paired = true;
+        emit_changed(object_path, BLUEZ_DEVICE_IFACE, single("Paired", g_variant_new_boolean(true)));
+    }
+    g_dbus_method_invocation_return_value(invocation, nullptr);
+}
+
+struct PendingPairing {
+    MockBluez *mock;
+    std::string path;
+    GDBusMethodInvocation *invocation;
+};
+
+void MockBluez::confirm_pairing(const char *sender, const char *agent, const char *object_path, GDBusMethodInvocation *invocation) {
+    auto pending = new PendingPairing{this, object_path, invocation};
+    g_dbus_connection_call(conn, sender, agent, BLUEZ_AGENT_IFACE, "RequestConfirmation", g_variant_new("(ou)", object_path, 123456),
+                           nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, [](GObject *source, GAsyncResult *res, gpointer data) {
+        auto pending = reinterpret_cast<PendingPairing *>(data);
+        auto mock = pending->mock;
+        auto reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, nullptr);
+        std::lock_guard<std::mutex> lock(mock->mutex);
+        auto it = mock->devices.find(pending->path);
+        if (!reply || it == mock->devices.end()) {
+            g_dbus_method_invocation_return_dbus_error(pending->invocation, "org.bluez.Error.AuthenticationRejected", "Authentication Rejected");
+        } else {
+            g_variant_unref(reply);
+            it->second.paired = true;
+            mock->emit_changed(pending->path.c_str(), BLUEZ_DEVICE_IFACE, single("Paired", g_variant_new_boolean(true)));
+            g_dbus_method_invocation_return_value(pending->invocation, nullptr);
+        }
+        delete pending;
+    }, pending);
+}
+
+struct DelayedCall {
+    MockBluez *mock;
+    std::string sender, path, iface, method;
+    GVariant *parameters;
+    GDBusMethodInvocation *invocation;
+};
+
+void MockBluez::method_call_cb(GDBusConnection *connection, const gchar *sender, const gchar *object_path, const gchar *interface_name, const gchar *method_name, GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data) {
+    auto mock = reinterpret_cast<MockBluez *>(user_data);
+    int delay = mock->reply_delay_ms;
+    if (delay <= 0) {
+        mock->method_call(sender, object_path, interface_name, method_name, parameters, invocation);
+        return;
+    }
+    auto call = new DelayedCall{mock, sender, object_path, interface_name, method_name, g_variant_ref(parameters), invocation};
+    auto source = g_timeout_source_new(delay);
+    g_source_set_callback(source, [](gpointer data) -> gboolean {
+        auto call = reinterpret_cast<DelayedCall *>(data);
+        call->mock->method_call(call->sender.c_str(), call->path.c_str(), call->iface.c_str(), call->method.c_str(), call->parameters, call->invocation);
+        g_variant_unref(call->parameters);
+        delete call;
+        return G_SOURCE_REMOVE;
+    }, call, nullptr);
+    g_source_attach(source, mock->context);
+    g_source_unref(source);
+}
+
+GVariant *MockBluez::get_property_cb(GDBusConnection *connection, const gchar *sender, const gchar *object_path, const gchar *interface_name, const gchar *property_name, GError **error, gpointer user_data) {
+    auto mock = reinterpret_cast<MockBluez *>(user_data);
+    std::lock_guard<std::mutex> lock(mock->mutex);
+    GVariant *props;
+    if (strcmp(interface_name, BLUEZ_ADAPTER_IFACE) == 0) {
+        props = mock->adapter_properties(object_path);
+    } else {
+        auto it = mock->devices.find(object_path);
+        if (it == mock->devices.end()) return nullptr;
+        props = mock->device_properties(it->second);
+    }
+    g_variant_ref_sink(props);
+    auto value = g_variant_lookup_value(props, property_name, nullptr);
+    g_variant_unref(props);
+    return value;
+}
+
+gboolean MockBluez::set_property_cb(GDBusConnection *connection, const gchar *sender, const gchar *object_path, const gchar *interface_name, const gchar *property_name, GVariant *value, GError **error, gpointer user_data) {
+    auto mock = reinterpret_cast<MockBluez *>(user_data);
+    std::lock_guard<std::mutex> lock(mock->mutex);
+    auto it = mock->devices.find(object_path);
+    if (it == mock->devices.end() || strcmp(property_name, "Trusted") != 0) {
+        g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_PROPERTY_READ_ONLY, "Read-only property %s", property_name);
+        return false;
+    }
+    it->second.trusted = g_variant_get_boolean(value);
+    mock->emit_changed(object_path, BLUEZ_DEVICE_IFACE, single("Trusted", g_variant_new_boolean(it->second.trusted)));
+    return true;
+}
@@ -0,0 +1,104 @@
+#ifndef _BENCH_MOCK_H_
+#define _BENCH_MOCK_H_
+
+#include <gio/gio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bluez {
+namespace mock {
+
+// A private dbus-daemon listening on a temporary unix socket. The daemon is
+// killed when the object goes out of scope.
+class PrivateBus {
+  private:
+    int pid;
+    std::string config_path;
+    std::string address_;
+
+  public:
+    explicit PrivateBus();
+    ~PrivateBus();
+    const char *address() const noexcept { return address_.c_str(); }
+};
+
+struct MockDevice {
+    std::string path;
+    std::string adapter;
+    std::string name;
+    std::string address;
+    bool paired;
+    bool trusted;
+    bool connected;
+    bool services_resolved;
+    gint16 rssi;
+    guint32 klass;
+    guint registration;
+    int failures;
+    std::string failure;
+};
+
+// In-process stand-in for bluetoothd. It owns 'org.bluez' on the given bus
+// and serves ObjectManager, AgentManager1, Adapter1 and Device1 from its own
+// loop thread.
+class MockBluez {
+  private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+    GMainContext *context;
+    GMainLoop *loop;
+    GDBusConnection *conn;
+    GDBusNodeInfo *introspection;
+    std::string bus_address;
+    std::map<std::string, MockDevice> devices;
+    std::map<std::string, guint> adapters;
+    // registered Agent1 object per bus name
+    std::map<std::string, std::string> agents;
+    std::atomic<int> reply_delay_ms;
+    bool discovering;
+    bool ready;
+    void run();
+    void invoke(std::function<void()> fn);
+    void register_device(MockDevice &device);
+    void emit_changed(const char *path, const char *iface, GVariant *changed, const char *invalidated = nullptr);
+    GVariant *device_properties(const MockDevice &device);
+    GVariant *adapter_properties(const char *path);
+    void method_call(const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, GDBusMethodInvocation *);
+    void confirm_pairing(const char *sender, const char *agent, const char *object_path, GDBusMethodInvocation *invocation);
+    static void method_call_cb(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, GDBusMethodInvocation *, gpointer);
+    static GVariant *get_property_cb(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GError **, gpointer);
+    static gboolean set_property_cb(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, GError **, gpointer);
+
+  public:
+    explicit MockBluez(const char *bus_address, int adapters = 1);
+    ~MockBluez();
+    // Adds a device under /org/bluez/hci<adapter> and announces it.
+    std::string AddDevice(int adapter, const char *name, const char *address, bool paired = false);
+    void RemoveDevice(const std::string &path);
+    // Releases or takes back 'org.bluez', as if bluetoothd stopped or started.
+    void SetRunning(bool running);
+    size_t AgentCount();
+    void SetConnected(const std::string &path, bool connected);
+    void SetPaired(const std::string &path, bool paired);
+    void SetRssi(const std::string &path, gint16 rssi);
+    // changes Name and Alias together
+    void SetName(const std::string &path, const char *name);
+    // Fails the next 'count' method calls on the device with a BlueZ error.
+    void FailNext(const std::string &path, int count, const char *error);
+    // Delays every method reply by 'ms'.
+    void SetReplyDelay(int ms) noexcept { reply_delay_ms = ms; }
+    std::vector<std::string> DevicePaths();
+};
+
+} // namespace mock
+} // namespace bluez
+
+#endif
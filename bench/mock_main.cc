@@ -0,0 +1,79 @@
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+#include "mock.h"
+
+using namespace std;
+using namespace bluez::mock;
+
+static void usage(const char *name) {
+    cerr << "usage: " << name << " [options]\n"
+         << "  --address ADDR   serve on this bus (default: start a private dbus-daemon)\n"
+         << "  --adapters N     adapters to export (default 1)\n"
+         << "  --devices N      devices to export (default 8)\n"
+         << "  --delay MS       delay every method reply\n"
+         << "  --storm HZ       RSSI updates per second, spread over all devices\n"
+         << "  --churn HZ       connect/disconnect flips per second\n"
+         << "  --duration S     exit after S seconds (default: run forever)\n";
+}
+
+int main(int argc, char **argv) {
+    const char *address = nullptr;
+    int adapters = 1, devices = 8, delay = 0, storm = 0, churn = 0, duration = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (arg == "--address") address = argv[++i];
+        else if (arg == "--adapters") adapters = atoi(argv[++i]);
+        else if (arg == "--devices") devices = atoi(argv[++i]);
+        else if (arg == "--delay") delay = atoi(argv[++i]);
+        else if (arg == "--storm") storm = atoi(argv[++i]);
+        else if (arg == "--churn") churn = atoi(argv[++i]);
+        else if (arg == "--duration") duration = atoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    unique_ptr<PrivateBus> bus;
+    if (!address) {
+        bus.reset(new PrivateBus());
+        address = bus->address();
+    }
+    // other processes reach us through DBUS_SYSTEM_BUS_ADDRESS
+    cout << address << endl;
+
+    MockBluez mock(address, adapters);
+    mock.SetReplyDelay(delay);
+    vector<string> paths;
+    for (int i = 0; i < devices; i++) {
+        char addr[18], name[32];
+        snprintf(addr, sizeof(addr), "00:00:00:00:%02X:%02X", (i >> 8) & 0xff, i & 0xff);
+        snprintf(name, sizeof(name), i % 3 == 0 ? "Joy-Con (L)" : i % 3 == 1 ? "Joy-Con (R)" : "Pro Controller");
+        paths.push_back(mock.AddDevice(i % adapters, name, addr, i % 2 == 0));
+    }
+
+    // one tick per millisecond, each tick catches up on the configured rates
+    auto start = g_get_monotonic_time();
+    gint64 storms = 0, churns = 0;
+    while (duration == 0 || g_get_monotonic_time() - start < duration * G_GINT64_CONSTANT(1000000)) {
+        usleep(1000);
+        if (paths.empty()) continue;
+        auto elapsed = g_get_monotonic_time() - start;
+        for (; storms < elapsed * storm / 1000000; storms++) {
+            mock.SetRssi(paths[storms % paths.size()], -40 - (gint16)(storms % 50));
+        }
+        for (; churns < elapsed * churn / 1000000; churns++) {
+            mock.SetConnected(paths[churns % paths.size()], (churns / paths.size()) % 2 == 0);
+        }
+    }
+    return EXIT_SUCCESS;
+}
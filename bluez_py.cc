@@ -0,0 +1,602 @@
+// Python extension module '_bluez' over BluezUtil, see script/bluez.py.
+// Every call into the library runs with the GIL released, and events reach
+// Python through a queue the interpreter drains on its own thread, so no
+// library thread ever takes the GIL.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "gutil.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define QUEUE_CAPACITY 1024
+// how often a blocked iterator checks for KeyboardInterrupt
+#define SIGNAL_CHECK_MS 100
+
+using namespace bluez;
+
+namespace {
+
+struct Event {
+    int event;
+    gint64 timestamp_us;
+    std::string object_path;
+    std::string name;
+    std::string address;
+    bool paired;
+    bool connected;
+    bool trusted;
+    gint16 rssi;
+    guint32 device_class;
+};
+
+// Filled by the listener thread, drained by Python. The eventfd is set while
+// entries are queued or once the queue is closed.
+class EventQueue {
+  private:
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<Event> queue;
+    size_t capacity;
+    guint64 dropped_;
+    bool closed_;
+    int fd_;
+    void signal() noexcept {
+        guint64 one = 1;
+        if (write(fd_, &one, sizeof(one)) < 0) g_warning("[BluezUtil] eventfd write failed: %s", strerror(errno));
+    }
+
+  public:
+    explicit EventQueue(size_t capacity) noexcept
+        : capacity(std::max<size_t>(capacity, 1)), dropped_(0), closed_(false), fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+    ~EventQueue() {
+        if (fd_ >= 0) close(fd_);
+    }
+    int fd() const noexcept { return fd_; }
+    void Push(Event &&event) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        if (closed_) return;
+        if (queue.size() >= capacity) {
+            queue.pop_front();
+            dropped_++;
+        }
+        queue.push_back(std::move(event));
+        queued.notify_one();
+        if (queue.size() == 1) signal();
+    }
+    // Waits up to timeout_ms, < 0 forever, false on timeout or once closed
+    // and empty.
+    bool Pop(Event &event, int timeout_ms) noexcept {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto ready = [this]() { return !queue.empty() || closed_; };
+        if (timeout_ms < 0) queued.wait(lock, ready);
+        else queued.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        if (queue.empty()) return false;
+        event = std::move(queue.front());
+        queue.pop_front();
+        reset();
+        return true;
+    }
+    std::deque<Event> Drain() noexcept {
+        std::deque<Event> events;
+        std::lock_guard<std::mutex> _1(mutex);
+        events.swap(queue);
+        reset();
+        return events;
+    }
+    // mutex must be held
+    void reset() noexcept {
+        if (!queue.empty() || closed_) return;
+        guint64 count;
+        if (read(fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) g_warning("[BluezUtil] eventfd read failed: %s", strerror(errno));
+    }
+    void Close() noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        if (closed_) return;
+        closed_ = true;
+        queued.notify_all();
+        signal();
+    }
+    bool closed() noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        return closed_;
+    }
+    guint64 dropped() noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        return dropped_;
+    }
+};
+
+struct Util {
+    PyObject_HEAD
+    // calls in flight keep their own reference, so close() never pulls the
+    // instance from under them
+    std::shared_ptr<BluezUtil> util;
+    std::shared_ptr<EventQueue> events;
+};
+
+PyObject *error_type;
+PyTypeObject device_type;
+PyTypeObject event_type;
+
+PyStructSequence_Field device_fields[] = {
+    {(char *)"object_path", nullptr},
+    {(char *)"name", nullptr},
+    {(char *)"address", nullptr},
+    {(char *)"paired", nullptr},
+    {(char *)"connected", nullptr},
+    {(char *)"trusted", nullptr},
+    {(char *)"rssi", nullptr},
+    {(char *)"device_class", nullptr},
+    {(char *)"cached", nullptr},
+    {nullptr, nullptr},
+};
+
+PyStructSequence_Desc device_desc = {
+    (char *)"_bluez.Device",
+    (char *)"One device of Util.devices(), see BluetoothDeviceInfo.",
+    device_fields,
+    9,
+};
+
+PyStructSequence_Field event_fields[] = {
+    {(char *)"event", (char *)"BluetoothEvent value, see the EV_ constants"},
+    {(char *)"timestamp_us", (char *)"monotonic time the event was queued"},
+    {(char *)"object_path", (char *)"empty for adapter events"},
+    {(char *)"name", nullptr},
+    {(char *)"address", nullptr},
+    {(char *)"paired", nullptr},
+    {(char *)"connected", nullptr},
+    {(char *)"trusted", nullptr},
+    {(char *)"rssi", nullptr},
+    {(char *)"device_class", nullptr},
+    {nullptr, nullptr},
+};
+
+PyStructSequence_Desc event_desc = {
+    (char *)"_bluez.Event",
+    (char *)"One BluetoothEvent and the state of its device.",
+    event_fields,
+    10,
+};
+
+void set_error(const BluezError &e) {
+    auto exc = PyObject_CallFunction(error_type, "s", e.message.c_str());
+    if (!exc) return;
+    auto code = PyLong_FromLong(e.code);
+    auto name = PyUnicode_FromString(e.name.c_str());
+    if (code && name) {
+        PyObject_SetAttrString(exc, "code", code);
+        PyObject_SetAttrString(exc, "name", name);
+    }
+    Py_XDECREF(code);
+    Py_XDECREF(name);
+    PyErr_SetObject(error_type, exc);
+    Py_DECREF(exc);
+}
+
+// Runs fn without the GIL. A BluezError becomes a _bluez.Error, other C++
+// exceptions a MemoryError or RuntimeError, none reaches the interpreter.
+template <typename F>
+bool run(F fn) {
+    std::exception_ptr error;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        fn();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    Py_END_ALLOW_THREADS
+    if (!error) return true;
+    try {
+        std::rethrow_exception(error);
+    } catch (const BluezError &e) {
+        set_error(e);
+    } catch (const std::bad_alloc &) {
+        PyErr_NoMemory();
+    } catch (const std::exception &e) {
+        PyErr_SetString(PyExc_RuntimeError, e.what());
+    } catch (...) {
+        PyErr_SetString(PyExc_RuntimeError, "unknown C++ exception");
+    }
+    return false;
+}
+
+std::shared_ptr<BluezUtil> get(Util *self) {
+    if (!self->util) PyErr_SetString(PyExc_ValueError, "Util is closed");
+    return self->util;
+}
+
+PyObject *new_event(const Event &e) {
+    auto event = PyStructSequence_New(&event_type);
+    if (!event) return nullptr;
+    PyStructSequence_SET_ITEM(event, 0, PyLong_FromLong(e.event));
+    PyStructSequence_SET_ITEM(event, 1, PyLong_FromLongLong(e.timestamp_us));
+    PyStructSequence_SET_ITEM(event, 2, PyUnicode_FromString(e.object_path.c_str()));
+    PyStructSequence_SET_ITEM(event, 3, PyUnicode_DecodeUTF8(e.name.data(), e.name.size(), "replace"));
+    PyStructSequence_SET_ITEM(event, 4, PyUnicode_FromString(e.address.c_str()));
+    PyStructSequence_SET_ITEM(event, 5, PyBool_FromLong(e.paired));
+    PyStructSequence_SET_ITEM(event, 6, PyBool_FromLong(e.connected));
+    PyStructSequence_SET_ITEM(event, 7, PyBool_FromLong(e.trusted));
+    PyStructSequence_SET_ITEM(event, 8, PyLong_FromLong(e.rssi));
+    PyStructSequence_SET_ITEM(event, 9, PyLong_FromUnsignedLong(e.device_class));
+    for (int i = 0; i < event_desc.n_in_sequence; i++) {
+        if (PyStructSequence_GET_ITEM(event, i)) continue;
+        Py_DECREF(event);
+        return nullptr;
+    }
+    return event;
+}
+
+int Util_init(Util *self, PyObject *args, PyObject *kwargs) {
+    static const char *keywords[] = {"lazy_start", "cache_path", "event_mask", "queue_capacity", "transport", nullptr};
+    int lazy_start = 0;
+    const char *cache_path = nullptr, *transport = "gdbus";
+    unsigned long long mask = EV_MASK_ALL;
+    Py_ssize_t capacity = QUEUE_CAPACITY;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pzKns", const_cast<char **>(keywords), &lazy_start, &cache_path, &mask, &capacity,
+                                     &transport))
+        return -1;
+    BluezOptions options;
+    options.lazy_start = lazy_start;
+    if (cache_path) options.cache.path = cache_path;
+    if (strcmp(transport, "sdbus") == 0) {
+        options.transport = BluezTransportType::SDBUS;
+    } else if (strcmp(transport, "gdbus") != 0) {
+        PyErr_Format(PyExc_ValueError, "unknown transport '%s'", transport);
+        return -1;
+    }
+    if (self->util) {
+        PyErr_SetString(PyExc_RuntimeError, "Util is initialized already");
+        return -1;
+    }
+    auto events = std::make_shared<EventQueue>(capacity > 0 ? capacity : QUEUE_CAPACITY);
+    if (events->fd() < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    std::shared_ptr<BluezUtil> util;
+    if (!run([&]() { util = std::make_shared<BluezUtil>(options); })) return -1;
+    util->Subscribe([events](BluetoothEvent ev, const BluetoothDevice *device) {
+        Event event = {};
+        event.event = BluetoothEventValue(ev);
+        event.timestamp_us = g_get_monotonic_time();
+        if (device) {
+            event.object_path = device->object_path();
+            event.name = device->name();
+            event.address = device->address();
+            event.paired = device->paired();
+            event.connected = device->connected();
+            event.trusted = device->trusted();
+            event.rssi = device->rssi();
+            event.device_class = device->device_class();
+        }
+        events->Push(std::move(event));
+    }, mask);
+    self->util = util;
+    self->events = events;
+    return 0;
+}
+
+PyObject *Util_close(Util *self, PyObject *) {
+    auto util = std::move(self->util);
+    if (self->events) self->events->Close();
+    // stops the loop and joins the listener threads
+    run([&]() { util.reset(); });
+    Py_RETURN_NONE;
+}
+
+void Util_dealloc(Util *self) {
+    Util_close(self, nullptr);
+    self->util.~shared_ptr<BluezUtil>();
+    self->events.~shared_ptr<EventQueue>();
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+PyObject *Util_new(PyTypeObject *type, PyObject *, PyObject *) {
+    auto self = reinterpret_cast<Util *>(type->tp_alloc(type, 0));
+    if (!self) return nullptr;
+    new (&self->util) std::shared_ptr<BluezUtil>();
+    new (&self->events) std::shared_ptr<EventQueue>();
+    return reinterpret_cast<PyObject *>(self);
+}
+
+PyObject *Util_ready(Util *self, PyObject *args) {
+    double timeout = -1;
+    if (!PyArg_ParseTuple(args, "|d", &timeout)) return nullptr;
+    auto util = get(self);
+    if (!util) return nullptr;
+    bool done = false;
+    if (!run([&]() {
+            auto ready = util->Ready();
+            done = timeout < 0 ? (ready.wait(), true)
+                               : ready.wait_for(std::chrono::microseconds((gint64)(timeout * 1e6))) == std::future_status::ready;
+            if (done) ready.get();
+        }))
+        return nullptr;
+    return PyBool_FromLong(done);
+}
+
+// The snapshot is taken without the GIL, only the matching devices become
+// Python objects.
+PyObject *Util_devices(Util *self, PyObject *args) {
+    PyObject *names = Py_None;
+    if (!PyArg_ParseTuple(args, "|O", &names)) return nullptr;
+    auto util = get(self);
+    if (!util) return nullptr;
+    std::set<std::string> wanted;
+    if (names != Py_None) {
+        auto iter = PyObject_GetIter(names);
+        if (!iter) return nullptr;
+        while (auto item = PyIter_Next(iter)) {
+            auto name = PyUnicode_AsUTF8(item);
+            if (name) wanted.insert(name);
+            Py_DECREF(item);
+            if (!name) break;
+        }
+        Py_DECREF(iter);
+        if (PyErr_Occurred()) return nullptr;
+    }
+    BluetoothDeviceSnapshot snapshot;
+    if (!run([&]() { snapshot = util->GetDeviceSnapshot(); })) return nullptr;
+    auto list = PyList_New(0);
+    if (!list) return nullptr;
+    for (auto &d : snapshot) {
+        if (names != Py_None && !wanted.count(d.name)) continue;
+        auto device = PyStructSequence_New(&device_type);
+        if (!device) break;
+        PyStructSequence_SET_ITEM(device, 0, PyUnicode_FromString(d.object_path));
+        PyStructSequence_SET_ITEM(device, 1, PyUnicode_DecodeUTF8(d.name, strlen(d.name), "replace"));
+        PyStructSequence_SET_ITEM(device, 2, PyUnicode_FromString(d.address));
+        PyStructSequence_SET_ITEM(device, 3, PyBool_FromLong(d.paired));
+        PyStructSequence_SET_ITEM(device, 4, PyBool_FromLong(d.connected));
+        PyStructSequence_SET_ITEM(device, 5, PyBool_FromLong(d.trusted));
+        PyStructSequence_SET_ITEM(device, 6, PyLong_FromLong(d.rssi));
+        PyStructSequence_SET_ITEM(device, 7, PyLong_FromUnsignedLong(d.device_class));
+        PyStructSequence_SET_ITEM(device, 8, PyBool_FromLong(d.cached));
+        bool complete = true;
+        for (int i = 0; i < device_desc.n_in_sequence; i++) complete &= PyStructSequence_GET_ITEM(device, i) != nullptr;
+        if (!complete || PyList_Append(list, device) < 0) {
+            Py_DECREF(device);
+            break;
+        }
+        Py_DECREF(device);
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(list);
+        return nullptr;
+    }
+    return list;
+}
+
+// device and adapter methods, blocking without the GIL
+template <void (BluezUtil::*method)(const char *)>
+PyObject *Util_call(Util *self, PyObject *args) {
+    const char *object_path;
+    if (!PyArg_ParseTuple(args, "s", &object_path)) return nullptr;
+    auto util = get(self);
+    if (!util || !run([&]() { (util.get()->*method)(object_path); })) return nullptr;
+    Py_RETURN_NONE;
+}
+
+template <void (BluezUtil::*on_all)(), void (BluezUtil::*on_one)(const char *)>
+PyObject *Util_discovery(Util *self, PyObject *args) {
+    const char *adapter_path = nullptr;
+    if (!PyArg_ParseTuple(args, "|z", &adapter_path)) return nullptr;
+    auto util = get(self);
+    if (!util || !run([&]() {
+            if (adapter_path) (util.get()->*on_one)(adapter_path);
+            else (util.get()->*on_all)();
+        }))
+        return nullptr;
+    Py_RETURN_NONE;
+}
+
+PyObject *Util_fileno(Util *self, PyObject *) {
+    if (!self->events) return PyErr_Format(PyExc_ValueError, "Util is not initialized");
+    return PyLong_FromLong(self->events->fd());
+}
+
+PyObject *Util_drain(Util *self, PyObject *) {
+    if (!self->events) return PyList_New(0);
+    auto events = self->events->Drain();
+    auto list = PyList_New(events.size());
+    if (!list) return nullptr;
+    for (size_t i = 0; i < events.size(); i++) {
+        auto event = new_event(events[i]);
+        if (!event) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        PyList_SET_ITEM(list, i, event);
+    }
+    return list;
+}
+
+// Waits for the next event in slices, so Ctrl-C gets through. nullptr
+// without an exception means the timeout passed or the queue was closed.
+PyObject *next_event(Util *self, double timeout) {
+    auto events = self->events;
+    if (!events) return nullptr;
+    auto deadline = timeout < 0 ? G_MAXINT64 : g_get_monotonic_time() + (gint64)(timeout * 1e6);
+    Event event;
+    while (true) {
+        auto left_ms = (deadline - g_get_monotonic_time()) / 1000;
+        int wait_ms = (int)std::max<gint64>(0, std::min<gint64>(left_ms, SIGNAL_CHECK_MS));
+        bool popped;
+        Py_BEGIN_ALLOW_THREADS
+        popped = events->Pop(event, wait_ms);
+        Py_END_ALLOW_THREADS
+        if (popped) return new_event(event);
+        if (events->closed() || left_ms <= 0 || PyErr_CheckSignals() < 0) return nullptr;
+    }
+}
+
+PyObject *Util_next_event(Util *self, PyObject *args) {
+    double timeout = -1;
+    if (!PyArg_ParseTuple(args, "|d", &timeout)) return nullptr;
+    auto event = next_event(self, timeout);
+    if (event || PyErr_Occurred()) return event;
+    Py_RETURN_NONE;
+}
+
+PyObject *Util_iternext(Util *self) {
+    // returning nullptr without an exception ends the iteration
+    return next_event(self, -1);
+}
+
+PyObject *Util_enter(Util *self, PyObject *) {
+    Py_INCREF(self);
+    return reinterpret_cast<PyObject *>(self);
+}
+
+PyObject *Util_exit(Util *self, PyObject *) {
+    return Util_close(self, nullptr);
+}
+
+PyObject *Util_get_dropped(Util *self, void *) {
+    return PyLong_FromUnsignedLongLong(self->events ? self->events->dropped() : 0);
+}
+
+PyObject *Util_get_closed(Util *self, void *) {
+    return PyBool_FromLong(!self->util);
+}
+
+PyMethodDef util_methods[] = {
+    {"ready", (PyCFunction)Util_ready, METH_VARARGS,
+     "ready(timeout=None) -> bool\n\nWaits for BluezUtil::Ready(), raises Error if the bus is unreachable."},
+    {"devices", (PyCFunction)Util_devices, METH_VARARGS,
+     "devices(names=None) -> list of Device\n\nThe registry, including cached devices. With names only devices with one of these names."},
+    {"connect", (PyCFunction)Util_call<&BluezUtil::Connect>, METH_VARARGS, "connect(object_path)"},
+    {"disconnect", (PyCFunction)Util_call<&BluezUtil::Disconnect>, METH_VARARGS, "disconnect(object_path)"},
+    {"pair", (PyCFunction)Util_call<&BluezUtil::Pair>, METH_VARARGS, "pair(object_path)"},
+    {"start_discovery", (PyCFunction)Util_discovery<&BluezUtil::StartDiscovery, &BluezUtil::StartDiscovery>, METH_VARARGS,
+     "start_discovery(adapter_path=None)\n\nWithout a path on every powered adapter."},
+    {"stop_discovery", (PyCFunction)Util_discovery<&BluezUtil::StopDiscovery, &BluezUtil::StopDiscovery>, METH_VARARGS,
+     "stop_discovery(adapter_path=None)"},
+    {"fileno", (PyCFunction)Util_fileno, METH_NOARGS, "Readable while events are queued or once closed, for select() and asyncio."},
+    {"drain", (PyCFunction)Util_drain, METH_NOARGS, "drain() -> list of Event\n\nThe queued events, without waiting."},
+    {"next_event", (PyCFunction)Util_next_event, METH_VARARGS, "next_event(timeout=None) -> Event or None"},
+    {"close", (PyCFunction)Util_close, METH_NOARGS, "Disconnects and ends the iteration over events."},
+    {"__enter__", (PyCFunction)Util_enter, METH_NOARGS, nullptr},
+    {"__exit__", (PyCFunction)Util_exit, METH_VARARGS, nullptr},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyGetSetDef util_getset[] = {
+    {(char *)"dropped", (getter)Util_get_dropped, nullptr, (char *)"events dropped because the queue was full", nullptr},
+    {(char *)"closed", (getter)Util_get_closed, nullptr, nullptr, nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr},
+};
+
+PyTypeObject util_type = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    "_bluez",
+    "BluezUtil for Python. Iterating over a Util yields its events until it is closed.",
+    -1,
+    nullptr,
+};
+
+const struct {
+    const char *name;
+    BluetoothEvent event;
+} EVENTS[] = {
+    {"EV_ADAPTER_OFF", BluetoothEvent::EV_ADAPTER_OFF},
+    {"EV_ADAPTER_ON", BluetoothEvent::EV_ADAPTER_ON},
+    {"EV_ADAPTER_DISCOVERY_OFF", BluetoothEvent::EV_ADAPTER_DISCOVERY_OFF},
+    {"EV_ADAPTER_DISCOVERY_ON", BluetoothEvent::EV_ADAPTER_DISCOVERY_ON},
+    {"EV_ADAPTER_ADDED", BluetoothEvent::EV_ADAPTER_ADDED},
+    {"EV_ADAPTER_REMOVED", BluetoothEvent::EV_ADAPTER_REMOVED},
+    {"EV_ADAPTER_PAIRABLE_ON", BluetoothEvent::EV_ADAPTER_PAIRABLE_ON},
+    {"EV_ADAPTER_PAIRABLE_OFF", BluetoothEvent::EV_ADAPTER_PAIRABLE_OFF},
+    {"EV_ADAPTER_DISCOVERABLE_ON", BluetoothEvent::EV_ADAPTER_DISCOVERABLE_ON},
+    {"EV_ADAPTER_DISCOVERABLE_OFF", BluetoothEvent::EV_ADAPTER_DISCOVERABLE_OFF},
+    {"EV_ADAPTER_NAME", BluetoothEvent::EV_ADAPTER_NAME},
+    {"EV_DEVICE_FOUND", BluetoothEvent::EV_DEVICE_FOUND},
+    {"EV_DEVICE_REMOVE", BluetoothEvent::EV_DEVICE_REMOVE},
+    {"EV_DEVICE_UNPAIRED", BluetoothEvent::EV_DEVICE_UNPAIRED},
+    {"EV_DEVICE_UNPAIRING", BluetoothEvent::EV_DEVICE_UNPAIRING},
+    {"EV_DEVICE_PAIRING", BluetoothEvent::EV_DEVICE_PAIRING},
+    {"EV_DEVICE_PAIRED", BluetoothEvent::EV_DEVICE_PAIRED},
+    {"EV_DEVICE_DISCONNECTED", BluetoothEvent::EV_DEVICE_DISCONNECTED},
+    {"EV_DEVICE_DISCONNECTING", BluetoothEvent::EV_DEVICE_DISCONNECTING},
+    {"EV_DEVICE_CONNECTING", BluetoothEvent::EV_DEVICE_CONNECTING},
+    {"EV_DEVICE_CONNECTED", BluetoothEvent::EV_DEVICE_CONNECTED},
+    {"EV_DEVICE_RSSI", BluetoothEvent::EV_DEVICE_RSSI},
+    {"EV_DEVICE_TRUSTED", BluetoothEvent::EV_DEVICE_TRUSTED},
+    {"EV_DEVICE_UNTRUSTED", BluetoothEvent::EV_DEVICE_UNTRUSTED},
+    {"EV_DEVICE_SERVICES_RESOLVED", BluetoothEvent::EV_DEVICE_SERVICES_RESOLVED},
+    {"EV_DEVICE_SERVICES_UNRESOLVED", BluetoothEvent::EV_DEVICE_SERVICES_UNRESOLVED},
+    {"EV_DEVICE_NAME", BluetoothEvent::EV_DEVICE_NAME},
+    {"EV_DEVICE_UUIDS", BluetoothEvent::EV_DEVICE_UUIDS},
+};
+
+} // namespace
+
+PyMODINIT_FUNC PyInit__bluez(void) {
+    util_type.tp_name = "_bluez.Util";
+    util_type.tp_basicsize = sizeof(Util);
+    util_type.tp_flags = Py_TPFLAGS_DEFAULT;
+    util_type.tp_doc = "Util(lazy_start=False, cache_path=None, event_mask=EV_MASK_ALL, queue_capacity=1024, transport='gdbus')\n\n"
+                       "A BluezUtil, see BluezOptions. Events matching event_mask are queued from construction on.";
+    util_type.tp_new = Util_new;
+    util_type.tp_init = (initproc)Util_init;
+    util_type.tp_dealloc = (destructor)Util_dealloc;
+    util_type.tp_iter = PyObject_SelfIter;
+    util_type.tp_iternext = (iternextfunc)Util_iternext;
+    util_type.tp_methods = util_methods;
+    util_type.tp_getset = util_getset;
+    if (PyType_Ready(&util_type) < 0) return nullptr;
+    if (!device_type.tp_name && PyStructSequence_InitType2(&device_type, &device_desc) < 0) return nullptr;
+    if (!event_type.tp_name && PyStructSequence_InitType2(&event_type, &event_desc) < 0) return nullptr;
+
+    auto module = PyModule_Create(&module_def);
+    if (!module) return nullptr;
+    error_type = PyErr_NewExceptionWithDoc("_bluez.Error", "A BluezError, with its code and D-Bus error name as attributes.", nullptr, nullptr);
+    // the module gets references of its own, set_error() keeps using these
+    Py_XINCREF(error_type);
+    Py_INCREF(&util_type);
+    Py_INCREF(&device_type);
+    Py_INCREF(&event_type);
+    // the default name filter of StartScan()
+    auto names = BluezDiscoveryFilter().names;
+    auto controllers = PyTuple_New(names.size());
+    for (size_t i = 0; controllers && i < names.size(); i++) PyTuple_SET_ITEM(controllers, i, PyUnicode_FromString(names[i].c_str()));
+    if (!error_type || !controllers || PyModule_AddObject(module, "Error", error_type) < 0 ||
+        PyModule_AddObject(module, "Util", reinterpret_cast<PyObject *>(&util_type)) < 0 ||
+        PyModule_AddObject(module, "Device", reinterpret_cast<PyObject *>(&device_type)) < 0 ||
+        PyModule_AddObject(module, "Event", reinterpret_cast<PyObject *>(&event_type)) < 0 ||
+        PyModule_AddObject(module, "CONTROLLER_NAMES", controllers) < 0) {
+        Py_DECREF(module);
+        return nullptr;
+    }
+    for (auto &event : EVENTS) {
+        if (PyModule_AddIntConstant(module, event.name, BluetoothEventValue(event.event)) < 0) {
+            Py_DECREF(module);
+            return nullptr;
+        }
+    }
+    if (PyModule_AddObject(module, "EV_MASK_DEVICE", PyLong_FromUnsignedLongLong(EV_MASK_DEVICE)) < 0 ||
+        PyModule_AddObject(module, "EV_MASK_ADAPTER", PyLong_FromUnsignedLongLong(EV_MASK_ADAPTER)) < 0 ||
+        PyModule_AddObject(module, "EV_MASK_ALL", PyLong_FromUnsignedLongLong(EV_MASK_ALL)) < 0) {
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
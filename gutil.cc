@@ -1,296 +1,3635 @@
 #include "gutil.h"
+#include "transport.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #define BLUEZ "org.bluez"
 #define BLUEZ_MANAGER_IFACE "org.freedesktop.DBus.ObjectManager"
 #define BLUEZ_PROPERTY_IFACE "org.freedesktop.DBus.Properties"
 #define BLUEZ_ADAPTER_IFACE "org.bluez.Adapter1"
 #define BLUEZ_DEVICE_IFACE "org.bluez.Device1"
-#define BLUEZ_ADAPTER_OBJ "/org/bluez/hci0"
+#define BLUEZ_AGENT_MANAGER_IFACE "org.bluez.AgentManager1"
+#define BLUEZ_AGENT_IFACE "org.bluez.Agent1"
+#define BLUEZ_AGENT_MANAGER_OBJ "/org/bluez"
+
+// a loop taking longer to exit is reported, then still waited for
+#define LOOP_STOP_TIMEOUT_MS 2000
+// a caller waiting for work posted to the loop checks this often that it runs
+#define LOOP_CHECK_MS 50
+// calls made while shutting down, bluetoothd may be wedged
+#define SHUTDOWN_CALL_TIMEOUT_MS 1000
+// polling for the hidraw node of a device that just connected
+#define STREAM_RETRY_MS 20
+
+#define log(fmt, ...) g_message("[BluezUtil]" fmt "", __VA_ARGS__)
+
+using namespace bluez;
+
+// Makes a context the thread-default one for the current scope, so that
+// proxies and signal subscriptions created in it dispatch on its loop.
+class ContextScope {
+  private:
+    GMainContext *context;
+
+  public:
+    explicit ContextScope(GMainContext *context) noexcept : context(context) {
+        g_main_context_push_thread_default(context);
+    }
+    ~ContextScope() {
+        g_main_context_pop_thread_default(context);
+    }
+};
+
+#define HISTOGRAM_BUCKETS 24
+
+// Idle time of a loop thread, the poll in progress counts as well.
+struct LoopClock {
+    std::atomic<gint64> started_us;
+    std::atomic<gint64> idle_us;
+    std::atomic<gint64> poll_start_us;
+};
+
+// index of the power of two microsecond bucket holding us
+static inline int histogram_bucket(gint64 us) noexcept {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && us >= (1ll << bucket))
+        bucket++;
+    return bucket;
+}
+
+// same buckets as Histogram, for a value owned by one thread
+static void histogram_record(BluezHistogram &h, gint64 us) noexcept {
+    if (us < 0) us = 0;
+    if (h.buckets.empty()) h.buckets.resize(HISTOGRAM_BUCKETS);
+    h.buckets[histogram_bucket(us)]++;
+    h.count++;
+    h.total_us += us;
+    h.max_us = std::max(h.max_us, us);
+}
+
+#ifdef BLUEZ_STATS
+// Power of two microsecond buckets, recorded lock-free from any thread.
+class Histogram {
+  private:
+    std::atomic<guint64> count;
+    std::atomic<gint64> total_us;
+    std::atomic<gint64> max_us;
+    std::atomic<guint64> buckets[HISTOGRAM_BUCKETS];
+
+  public:
+    explicit Histogram() noexcept : count(0), total_us(0), max_us(0) {
+        for (auto &bucket : buckets)
+            bucket.store(0, std::memory_order_relaxed);
+    }
+    void Record(gint64 us) noexcept {
+        if (us < 0) us = 0;
+        buckets[histogram_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        total_us.fetch_add(us, std::memory_order_relaxed);
+        auto max = max_us.load(std::memory_order_relaxed);
+        while (us > max && !max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+        }
+    }
+    BluezHistogram Snapshot() const noexcept {
+        BluezHistogram h{count.load(std::memory_order_relaxed), total_us.load(std::memory_order_relaxed), max_us.load(std::memory_order_relaxed), {}};
+        for (auto &bucket : buckets)
+            h.buckets.push_back(bucket.load(std::memory_order_relaxed));
+        return h;
+    }
+};
+
+struct CStrLess {
+    bool operator()(const char *a, const char *b) const noexcept {
+        return strcmp(a, b) < 0;
+    }
+};
+
+// Process-wide counters behind BluezUtil::Stats(). Keys are string literals,
+// histograms are never freed so their pointers can be cached.
+class Instrumentation {
+  private:
+    std::mutex mutex;
+    std::map<const char *, std::unique_ptr<Histogram>, CStrLess> calls;
+    std::map<const char *, std::pair<std::unique_ptr<Histogram>, std::unique_ptr<Histogram>>, CStrLess> signals;
+    std::map<int, guint64> errors;
+    std::map<std::string, guint64> remote_errors;
+
+  public:
+    static Instrumentation &get() noexcept {
+        static Instrumentation instance;
+        return instance;
+    }
+    Histogram *call(const char *method) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        auto &h = calls[method];
+        if (!h) h.reset(new Histogram());
+        return h.get();
+    }
+    std::pair<Histogram *, Histogram *> signal(const char *name) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        auto &h = signals[name];
+        if (!h.first) {
+            h.first.reset(new Histogram());
+            h.second.reset(new Histogram());
+        }
+        return {h.first.get(), h.second.get()};
+    }
+    void error(const BluezError &e) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        errors[e.code]++;
+        if (!e.name.empty()) remote_errors[e.name]++;
+    }
+    void Snapshot(BluezStats &stats) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        for (auto &call : calls)
+            stats.calls.push_back(BluezCallStats{call.first, call.second->Snapshot()});
+        for (auto &signal : signals)
+            stats.signals.push_back(BluezSignalStats{signal.first, signal.second.first->Snapshot(), signal.second.second->Snapshot()});
+        stats.errors = errors;
+        stats.remote_errors = remote_errors;
+    }
+};
+
+// Records the latency of a D-Bus call when it goes out of scope.
+class CallTimer {
+  private:
+    Histogram *histogram;
+    gint64 start;
+
+  public:
+    explicit CallTimer(const char *method) noexcept : histogram(Instrumentation::get().call(method)), start(g_get_monotonic_time()) {}
+    ~CallTimer() {
+        histogram->Record(g_get_monotonic_time() - start);
+    }
+    void failed(const BluezError &e) noexcept {
+        Instrumentation::get().error(e);
+    }
+};
+
+// Splits a signal callback into parsing, up to parsed(), and dispatch.
+class SignalTimer {
+  private:
+    std::pair<Histogram *, Histogram *> histograms;
+    gint64 start;
+
+  public:
+    explicit SignalTimer(const char *signal) noexcept : histograms(Instrumentation::get().signal(signal)), start(g_get_monotonic_time()) {}
+    ~SignalTimer() {
+        histograms.second->Record(g_get_monotonic_time() - start);
+    }
+    void parsed() noexcept {
+        auto now = g_get_monotonic_time();
+        histograms.first->Record(now - start);
+        start = now;
+    }
+};
+
+// the clock of the loop running on this thread, for timed_poll()
+static thread_local LoopClock *loop_clock = nullptr;
+
+static gint timed_poll(GPollFD *fds, guint nfds, gint timeout) {
+    if (!loop_clock) return g_poll(fds, nfds, timeout);
+    auto start = g_get_monotonic_time();
+    loop_clock->poll_start_us.store(start);
+    auto ret = g_poll(fds, nfds, timeout);
+    loop_clock->poll_start_us.store(0);
+    loop_clock->idle_us.fetch_add(g_get_monotonic_time() - start);
+    return ret;
+}
+#else
+class CallTimer {
+  public:
+    explicit CallTimer(const char *) noexcept {}
+    void failed(const BluezError &) noexcept {}
+};
+
+class SignalTimer {
+  public:
+    explicit SignalTimer(const char *) noexcept {}
+    void parsed() noexcept {}
+};
+#endif
+
+static inline GVariant *connection_call(GDBusConnection *conn, const char *object_path, const char *iface, const char *name)  {
+    GError *err = nullptr;
+    if (!conn) throw BluezError(-1, "Not connected", "org.bluez.Error.NotReady");
+    CallTimer timer(name);
+    auto value = g_dbus_connection_call_sync(conn, BLUEZ, object_path, iface, name, nullptr, nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, &err);
+    if (!value) {
+        log("Call '%s' on '%s' error: %s", name, object_path, err->message);
+        auto e = BluezError(err);
+        g_error_free(err);
+        timer.failed(e);
+        throw e;
+    }
+    return value;
+}
+
+static std::string adapter_of(const std::string &object_path) noexcept {
+    auto pos = object_path.find("/dev_");
+    return pos == std::string::npos ? object_path : object_path.substr(0, pos);
+}
+
+// streams are keyed by the address as BlueZ reports it
+static std::string upper_address(const char *address) noexcept {
+    auto upper = g_ascii_strup(address, -1);
+    std::string result(upper);
+    g_free(upper);
+    return result;
+}
+
+bool bluez::operator==(const BluetoothEvent &p1, int p2) noexcept {
+    return (static_cast<BluetoothEventType>(p1) & p2) == p2;
+}
+
+int bluez::BluetoothEventValue(const BluetoothEvent &event) noexcept {
+    return static_cast<BluetoothEventType>(event);
+}
+
+// device events live in the low, adapter events in the high 32 bits
+BluetoothEventMask bluez::BluetoothEventBit(const BluetoothEvent &event) noexcept {
+    auto value = BluetoothEventValue(event);
+    if (value == 0) return 0;
+    auto bit = (value & 0x0f) + ((value & EV_MORE) ? 16 : 0) + ((value & EV_ADAPTER) ? 32 : 0);
+    return 1ull << bit;
+}
+
+BluezError::BluezError(int code, const char *msg, const char *name) noexcept
+    : code(code), message(std::string(msg)), name(name ? name : "") {}
+
+BluezError::BluezError(const GError *error) noexcept : BluezError{error->code, error->message} {
+    auto remote = g_dbus_error_get_remote_error(error);
+    if (remote) {
+        const_cast<std::string &>(name) = remote;
+        g_free(remote);
+    }
+}
+
+struct EventLoop::State {
+    std::mutex mutex;
+    std::condition_variable cond;
+    // from Start() until Stop() begins
+    std::atomic<bool> running;
+    bool exited;
+    LoopClock clock;
+};
+
+EventLoop::EventLoop() noexcept
+    : context_(g_main_context_new()), loop(g_main_loop_new(context_, false)), state(std::make_shared<State>()) {}
+
+EventLoop::~EventLoop() {
+    Stop(LOOP_STOP_TIMEOUT_MS);
+    g_main_loop_unref(loop);
+    g_main_context_unref(context_);
+}
+
+GMainContext *EventLoop::context() const noexcept {
+    return context_;
+}
+
+bool EventLoop::IsLoopThread() const noexcept {
+    return g_main_context_is_owner(context_);
+}
+
+bool EventLoop::Running() const noexcept {
+    return state->running.load();
+}
+
+void EventLoop::Start() noexcept {
+    std::lock_guard<std::mutex> _1(mutex);
+    if (thread.joinable()) return;
+    state->running = true;
+    state->exited = false;
+    state->clock.started_us = g_get_monotonic_time();
+    state->clock.idle_us = 0;
+    state->clock.poll_start_us = 0;
+    // the worker holds its own references to the loop and the state
+    thread = std::thread([](GMainLoop *loop, std::shared_ptr<State> state) {
+        auto context = g_main_loop_get_context(loop);
+        g_main_context_push_thread_default(context);
+#ifdef BLUEZ_STATS
+        loop_clock = &state->clock;
+        g_main_context_set_poll_func(context, timed_poll);
+#endif
+        log("%s", "g_main_loop running");
+        g_main_loop_run(loop);
+        log("%s", "g_main_loop exit");
+        g_main_context_pop_thread_default(context);
+        g_main_loop_unref(loop);
+        {
+            std::lock_guard<std::mutex> _1(state->mutex);
+            state->exited = true;
+        }
+        state->cond.notify_all();
+    }, g_main_loop_ref(loop), state);
+}
+
+bool EventLoop::Stop(int timeout_ms) noexcept {
+    std::lock_guard<std::mutex> _1(mutex);
+    if (!thread.joinable()) return true;
+    // callers waiting for posted work give up, it may never run
+    state->running = false;
+    // the owner frees what the pending sources point to once this returns,
+    // a worker still running would use it after the free
+    if (IsLoopThread()) g_error("[BluezUtil] event loop stopped from its own thread");
+    // quitting from inside the loop also covers a worker that has not
+    // reached g_main_loop_run yet
+    auto loop = this->loop;
+    Post([loop]() { g_main_loop_quit(loop); });
+    bool exited;
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        exited = state->cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() { return state->exited; });
+    }
+    if (!exited) log("g_main_loop did not exit in %d ms, still waiting", timeout_ms);
+    thread.join();
+    return exited;
+}
+
+guint EventLoop::Post(std::function<void()> fn, int delay_ms) noexcept {
+    auto source = delay_ms > 0 ? g_timeout_source_new(delay_ms) : g_idle_source_new();
+    g_source_set_priority(source, G_PRIORITY_DEFAULT);
+    g_source_set_callback(source, [](gpointer data) -> gboolean {
+        (*reinterpret_cast<std::function<void()> *>(data))();
+        return G_SOURCE_REMOVE;
+    }, new std::function<void()>(std::move(fn)), [](gpointer data) { delete reinterpret_cast<std::function<void()> *>(data); });
+    auto id = g_source_attach(source, context_);
+    g_source_unref(source);
+    return id;
+}
+
+void EventLoop::Cancel(guint id) noexcept {
+    auto source = g_main_context_find_source_by_id(context_, id);
+    if (source) g_source_destroy(source);
+}
+
+void EventLoop::Usage(gint64 &busy_us, gint64 &uptime_us) const noexcept {
+    busy_us = uptime_us = 0;
+#ifdef BLUEZ_STATS
+    auto started = state->clock.started_us.load();
+    if (!started) return;
+    auto now = g_get_monotonic_time();
+    auto polling = state->clock.poll_start_us.load();
+    uptime_us = now - started;
+    busy_us = std::max<gint64>(0, uptime_us - state->clock.idle_us.load() - (polling ? now - polling : 0));
+#endif
+}
+
+// Compact copy of an event and the device state it refers to, so listener
+// threads never touch the registry.
+struct bluez::BluetoothEventRecord {
+    BluetoothEvent event;
+    gint64 timestamp_us;
+    bool paired;
+    bool connected;
+    bool trusted;
+    bool services_resolved;
+    gint16 rssi;
+    // BluetoothDevice::transition_, fits the padding
+    guint8 transition;
+    guint32 device_class;
+    char object_path[64];
+    char address[18];
+    char name[249];
+};
+
+static inline void copy_field(char *dst, size_t size, const char *src) noexcept {
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = 0;
+}
+
+// Events that supersede each other when coalescing share a key.
+static inline int coalesce_key(BluetoothEvent event) noexcept {
+    switch (event) {
+    case BluetoothEvent::EV_ADAPTER_ON:
+    case BluetoothEvent::EV_ADAPTER_OFF:
+        return 1;
+    case BluetoothEvent::EV_ADAPTER_DISCOVERY_ON:
+    case BluetoothEvent::EV_ADAPTER_DISCOVERY_OFF:
+        return 2;
+    case BluetoothEvent::EV_ADAPTER_ADDED:
+    case BluetoothEvent::EV_ADAPTER_REMOVED:
+        return 6;
+    case BluetoothEvent::EV_DEVICE_FOUND:
+    case BluetoothEvent::EV_DEVICE_REMOVE:
+        return 3;
+    case BluetoothEvent::EV_DEVICE_PAIRED:
+    case BluetoothEvent::EV_DEVICE_UNPAIRED:
+    case BluetoothEvent::EV_DEVICE_PAIRING:
+    case BluetoothEvent::EV_DEVICE_UNPAIRING:
+        return 4;
+    case BluetoothEvent::EV_DEVICE_CONNECTED:
+    case BluetoothEvent::EV_DEVICE_DISCONNECTED:
+    case BluetoothEvent::EV_DEVICE_CONNECTING:
+    case BluetoothEvent::EV_DEVICE_DISCONNECTING:
+        return 5;
+    case BluetoothEvent::EV_DEVICE_TRUSTED:
+    case BluetoothEvent::EV_DEVICE_UNTRUSTED:
+        return 7;
+    case BluetoothEvent::EV_DEVICE_SERVICES_RESOLVED:
+    case BluetoothEvent::EV_DEVICE_SERVICES_UNRESOLVED:
+        return 8;
+    case BluetoothEvent::EV_ADAPTER_PAIRABLE_ON:
+    case BluetoothEvent::EV_ADAPTER_PAIRABLE_OFF:
+        return 9;
+    case BluetoothEvent::EV_ADAPTER_DISCOVERABLE_ON:
+    case BluetoothEvent::EV_ADAPTER_DISCOVERABLE_OFF:
+        return 10;
+    default:
+        return BluetoothEventValue(event);
+    }
+}
+
+// Bounded lock-free ring (Vyukov), safe for any number of producers and
+// consumers. The producer also pops from it to drop the oldest event.
+class EventRing {
+  private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        BluetoothEventRecord record;
+    };
+    std::unique_ptr<Slot[]> slots;
+    const size_t mask;
+    // producer and consumer indices on separate cache lines
+    std::atomic<size_t> head;
+    char pad[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+
+    static size_t round_up(size_t capacity) noexcept {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        return size;
+    }
+
+  public:
+    explicit EventRing(size_t capacity) noexcept
+        : slots(new Slot[round_up(capacity)]), mask(round_up(capacity) - 1), head(0), tail(0) {
+        for (size_t i = 0; i <= mask; i++) slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const noexcept { return mask + 1; }
+
+    size_t size() const noexcept {
+        auto t = tail.load(std::memory_order_acquire);
+        auto h = head.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    bool push(const BluetoothEventRecord &record) noexcept {
+        auto pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto &slot = slots[pos & mask];
+            auto seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.record = record;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(BluetoothEventRecord &record) noexcept {
+        auto pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            auto &slot = slots[pos & mask];
+            auto seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    record = slot.record;
+                    slot.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Hands event records from the loop thread to listener threads. Push and
+// Flush must only be called from the single producer (the loop thread).
+class bluez::EventDispatcher {
+  private:
+    struct Worker {
+        EventRing ring;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::atomic<bool> waiting;
+        explicit Worker(size_t capacity) noexcept : ring(capacity), waiting(false) {}
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    const EventOverflow overflow;
+    std::function<void(const BluetoothEventRecord &)> deliver;
+    std::atomic<bool> running;
+    std::atomic<guint64> pushed;
+    std::atomic<guint64> delivered;
+    std::atomic<guint64> dropped;
+    std::atomic<guint64> coalesced;
+    std::atomic<size_t> high_water;
+    // records waiting for room when coalescing, producer only
+    std::vector<BluetoothEventRecord> pending;
+
+    Worker &worker_for(const char *object_path) noexcept {
+        return *workers[g_str_hash(object_path) % workers.size()];
+    }
+
+    void wake(Worker &worker) noexcept {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (worker.waiting.load()) {
+            std::lock_guard<std::mutex> _1(worker.mutex);
+            worker.cond.notify_one();
+        }
+    }
+
+    bool enqueue(Worker &worker, const BluetoothEventRecord &record) noexcept {
+        if (!worker.ring.push(record)) return false;
+        pushed++;
+        auto depth = worker.ring.size();
+        auto high = high_water.load(std::memory_order_relaxed);
+        while (depth > high && !high_water.compare_exchange_weak(high, depth, std::memory_order_relaxed)) {}
+        wake(worker);
+        return true;
+    }
+
+    void run(Worker &worker) noexcept {
+        BluetoothEventRecord record;
+        while (true) {
+            if (worker.ring.pop(record)) {
+                deliver(record);
+                delivered++;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.waiting = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            worker.cond.wait(lock, [&]() { return !running || worker.ring.size() > 0; });
+            worker.waiting = false;
+            if (!running && worker.ring.size() == 0) break;
+        }
+    }
+
+  public:
+    explicit EventDispatcher(size_t capacity, int threads, EventOverflow overflow, std::function<void(const BluetoothEventRecord &)> deliver) noexcept
+        : overflow(overflow), deliver(deliver), running(true), pushed(0), delivered(0), dropped(0), coalesced(0), high_water(0) {
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back(new Worker(capacity));
+        }
+        for (auto &worker : workers) {
+            auto w = worker.get();
+            worker->thread = std::thread([this, w]() { run(*w); });
+        }
+    }
+
+    ~EventDispatcher() {
+        Stop();
+    }
+
+    // delivers what is already queued, then joins the listener threads
+    void Stop() noexcept {
+        if (!running.exchange(false)) return;
+        for (auto &worker : workers) {
+            {
+                std::lock_guard<std::mutex> _1(worker->mutex);
+                worker->cond.notify_all();
+            }
+            worker->thread.join();
+        }
+    }
+
+    void Push(const BluetoothEventRecord &record) noexcept {
+        auto &worker = worker_for(record.object_path);
+        switch (overflow) {
+        case EventOverflow::DROP_OLDEST:
+            while (!enqueue(worker, record)) {
+                BluetoothEventRecord oldest;
+                if (worker.ring.pop(oldest)) dropped++;
+            }
+            break;
+        case EventOverflow::BLOCK:
+            while (!enqueue(worker, record) && running) {
+                wake(worker);
+                std::this_thread::yield();
+            }
+            break;
+        case EventOverflow::COALESCE:
+            // keep the order: nothing overtakes what is already pending
+            if (Flush() && enqueue(worker, record)) break;
+            for (auto &p : pending) {
+                if (coalesce_key(p.event) == coalesce_key(record.event) && strcmp(p.object_path, record.object_path) == 0) {
+                    p = record;
+                    coalesced++;
+                    return;
+                }
+            }
+            pending.push_back(record);
+            break;
+        }
+    }
+
+    // moves coalesced records into the rings, true if none are left
+    bool Flush() noexcept {
+        size_t n = 0;
+        while (n < pending.size() && enqueue(worker_for(pending[n].object_path), pending[n])) n++;
+        pending.erase(pending.begin(), pending.begin() + n);
+        return pending.empty();
+    }
+
+    EventQueueStats Stats() const noexcept {
+        EventQueueStats stats{};
+        for (auto &worker : workers) {
+            stats.capacity += worker->ring.capacity();
+            stats.depth += worker->ring.size();
+        }
+        stats.high_water = high_water;
+        stats.pushed = pushed;
+        stats.delivered = delivered;
+        stats.dropped = dropped;
+        stats.coalesced = coalesced;
+        return stats;
+    }
+};
+
+struct Listener {
+    ListenerToken token;
+    BluetoothEventCallback callback;
+    BluetoothEventMask mask;
+    BluetoothDeviceMatch match;
+};
+
+// Copy-on-write listener list. Readers never block: they announce
+// themselves in one of two counters and read the current list. Writers
+// publish a new list, then wait for both counters to drain before freeing
+// the old one.
+class bluez::ListenerSet {
+  private:
+    using List = std::vector<Listener>;
+    std::mutex mutex;
+    std::atomic<List *> current;
+    std::atomic<unsigned> epoch;
+    std::atomic<int> readers[2];
+    std::atomic<BluetoothEventMask> interest_;
+    std::vector<List *> retired;
+    ListenerToken next_token;
+    // > 0 while this thread runs listeners
+    static thread_local int dispatching;
+
+    // mutex must be held
+    void publish(List *list) noexcept {
+        BluetoothEventMask mask = 0;
+        for (auto &l : *list) mask |= l.mask;
+        interest_ = mask;
+        retired.push_back(current.exchange(list));
+        // a listener changing the set must not wait for itself,
+        // its list is freed by the next writer or the destructor
+        if (dispatching > 0) return;
+        for (int phase = 0; phase < 2; phase++) {
+            auto e = epoch.fetch_add(1);
+            while (readers[e & 1].load() != 0) std::this_thread::yield();
+        }
+        for (auto old : retired) delete old;
+        retired.clear();
+    }
+
+  public:
+    explicit ListenerSet() noexcept : current(new List()), epoch(0), interest_(0), next_token(0) {
+        readers[0] = 0;
+        readers[1] = 0;
+    }
+
+    ~ListenerSet() {
+        for (auto old : retired) delete old;
+        delete current.load();
+    }
+
+    BluetoothEventMask interest() const noexcept {
+        return interest_.load(std::memory_order_relaxed);
+    }
+
+    ListenerToken Add(BluetoothEventCallback callback, BluetoothEventMask mask, const BluetoothDeviceMatch &match) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        auto list = new List(*current.load());
+        auto token = ++next_token;
+        list->push_back(Listener{token, callback, mask, match});
+        publish(list);
+        return token;
+    }
+
+    void Remove(ListenerToken token) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        auto list = new List();
+        for (auto &l : *current.load()) {
+            if (l.token != token) list->push_back(l);
+        }
+        publish(list);
+    }
+
+    template <typename F>
+    void ForEach(F fn) noexcept {
+        auto e = epoch.load();
+        readers[e & 1]++;
+        dispatching++;
+        for (auto &l : *current.load()) fn(l);
+        dispatching--;
+        readers[e & 1]--;
+    }
+};
+
+thread_local int ListenerSet::dispatching = 0;
+
+static bool device_matches(const BluetoothDeviceMatch &match, const BluetoothEventRecord &record) noexcept {
+    if (!match.address.empty() && g_ascii_strcasecmp(match.address.c_str(), record.address) != 0) return false;
+    if (!match.name_prefix.empty() && strncmp(match.name_prefix.c_str(), record.name, match.name_prefix.size()) != 0) return false;
+    return true;
+}
+
+// Bounded LRU of proxies keyed by object path and interface. The pool holds
+// one reference per entry, callers get their own.
+class bluez::ProxyPool {
+  private:
+    struct Entry {
+        std::string key;
+        std::string object_path;
+        GDBusProxy *proxy;
+    };
+    std::mutex mutex;
+    size_t capacity;
+    // most recently used first
+    std::list<Entry> lru;
+    std::map<std::string, std::list<Entry>::iterator> index;
+
+  public:
+    explicit ProxyPool(size_t capacity) noexcept : capacity(capacity) {}
+    ~ProxyPool() {
+        for (auto &entry : lru)
+            g_object_unref(entry.proxy);
+    }
+    // a new reference, or nullptr
+    GDBusProxy *Get(const std::string &key) noexcept {
+        std::lock_guard<std::mutex> _1(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return G_DBUS_PROXY(g_object_ref(it->second->proxy));
+    }
+    void Put(const std::string &key, const char *object_path, GDBusProxy *proxy) noexcept {
+        if (capacity == 0) return;
+        GDBusProxy *evicted = nullptr;
+        {
+            std::lock_guard<std::mutex> _1(mutex);
+            // lost a race with another thread creating the same proxy
+            if (index.count(key)) return;
+            lru.push_front(Entry{key, object_path, G_DBUS_PROXY(g_object_ref(proxy))});
+            index[key] = lru.begin();
+            if (lru.size() > capacity) {
+                evicted = lru.back().proxy;
+                index.erase(lru.back().key);
+                lru.pop_back();
+            }
+        }
+        if (evicted) g_object_unref(evicted);
+    }
+    // forget the proxies of a removed object
+    void Drop(const char *object_path) noexcept {
+        std::vector<GDBusProxy *> dropped;
+        {
+            std::lock_guard<std::mutex> _1(mutex);
+            for (auto it = lru.begin(); it != lru.end();) {
+                if (it->object_path != object_path) {
+                    ++it;
+                    continue;
+                }
+                dropped.push_back(it->proxy);
+                index.erase(it->key);
+                it = lru.erase(it);
+            }
+        }
+        for (auto proxy : dropped)
+            g_object_unref(proxy);
+    }
+};
+
+#define SIGNAL_LOG_MAGIC "BZSIGLOG"
+#define SIGNAL_LOG_VERSION 1
+
+// Fixed part of a signal log record, in host byte order. The object path,
+// interface and member follow without terminators, then the serialized
+// parameters. The file starts with the magic and a 32 bit version.
+struct SignalLogRecord {
+    // since the recording started
+    gint64 timestamp_us;
+    guint32 size;
+    guint8 kind;
+    guint8 path_length;
+    guint8 iface_length;
+    guint8 member_length;
+};
+
+static_assert(sizeof(SignalLogRecord) == 16, "SignalLogRecord is written as is");
+
+// Appends signals to a log with buffered writes, callers serialize.
+class bluez::SignalRecorder {
+  private:
+    FILE *file;
+    gint64 started_us;
+
+  public:
+    explicit SignalRecorder(FILE *file) noexcept : file(file), started_us(g_get_monotonic_time()) {
+        guint32 version = SIGNAL_LOG_VERSION;
+        fwrite(SIGNAL_LOG_MAGIC, 1, 8, file);
+        fwrite(&version, sizeof(version), 1, file);
+    }
+    ~SignalRecorder() {
+        fclose(file);
+    }
+    void Write(SignalKind kind, const char *path, GVariant *parameters) noexcept {
+        static const char *MEMBERS[] = {"PropertiesChanged", "PropertiesChanged", "InterfacesAdded", "InterfacesRemoved", "GetManagedObjects"};
+        SignalLogRecord record;
+        auto iface = kind == SignalKind::ADAPTER_CHANGED || kind == SignalKind::DEVICE_CHANGED ? BLUEZ_PROPERTY_IFACE : BLUEZ_MANAGER_IFACE;
+        auto member = MEMBERS[(int)kind];
+        auto path_length = strlen(path), iface_length = strlen(iface), member_length = strlen(member);
+        if (path_length > G_MAXUINT8 || iface_length > G_MAXUINT8 || member_length > G_MAXUINT8) return;
+        record.timestamp_us = g_get_monotonic_time() - started_us;
+        record.size = g_variant_get_size(parameters);
+        record.kind = (guint8)kind;
+        record.path_length = path_length;
+        record.iface_length = iface_length;
+        record.member_length = member_length;
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(path, 1, path_length, file);
+        fwrite(iface, 1, iface_length, file);
+        fwrite(member, 1, member_length, file);
+        fwrite(g_variant_get_data(parameters), 1, record.size, file);
+    }
+};
+
+// RSSI history of one device. Both rings are allocated up front, so adding
+// a sample never allocates.
+class LinkRing {
+  private:
+    struct Window {
+        gint64 start_us;
+        gint32 sum;
+        guint32 count;
+        gint16 min;
+        gint16 max;
+    };
+    std::unique_ptr<BluezLinkSample[]> samples;
+    std::unique_ptr<Window[]> windows;
+    size_t sample_mask;
+    size_t window_count;
+    // written so far, the slot is the count modulo the capacity
+    guint64 sample_count;
+    guint64 windows_started;
+
+  public:
+    LinkRing(size_t sample_capacity, size_t window_capacity) noexcept
+        : samples(new BluezLinkSample[sample_capacity]), windows(new Window[window_capacity]), sample_mask(sample_capacity - 1),
+          window_count(window_capacity), sample_count(0), windows_started(0) {}
+    void Add(const BluezLinkSample &sample, gint64 window_us) noexcept {
+        samples[sample_count++ & sample_mask] = sample;
+        auto start = sample.timestamp_us - sample.timestamp_us % window_us;
+        auto w = windows_started ? &windows[(windows_started - 1) % window_count] : nullptr;
+        if (!w || w->start_us != start) {
+            w = &windows[windows_started++ % window_count];
+            *w = Window{start, 0, 0, sample.rssi, sample.rssi};
+        }
+        w->sum += sample.rssi;
+        w->count++;
+        w->min = std::min(w->min, sample.rssi);
+        w->max = std::max(w->max, sample.rssi);
+    }
+    void Fill(BluezLinkStats &stats, gint64 now_us, gint64 window_us, bool history) const noexcept {
+        stats.last = samples[(sample_count - 1) & sample_mask];
+        // windows that ended before the span are stale, even if still in the ring
+        auto since = now_us - window_us * (gint64)window_count;
+        gint64 sum = 0;
+        guint32 count = 0;
+        gint16 min = G_MAXINT16, max = G_MININT16;
+        auto n = std::min<guint64>(windows_started, window_count);
+        for (auto i = windows_started - n; i < windows_started; i++) {
+            auto &w = windows[i % window_count];
+            if (w.start_us + window_us <= since) continue;
+            sum += w.sum;
+            count += w.count;
+            min = std::min(min, w.min);
+            max = std::max(max, w.max);
+            if (history) stats.windows.push_back(BluezLinkWindow{w.start_us, w.count, w.min, w.max, (float)w.sum / w.count});
+        }
+        stats.samples = count;
+        stats.min_rssi = count ? min : 0;
+        stats.max_rssi = count ? max : 0;
+        stats.avg_rssi = count ? (float)sum / count : 0;
+        if (!history) return;
+        n = std::min<guint64>(sample_count, sample_mask + 1);
+        for (auto i = sample_count - n; i < sample_count; i++) {
+            stats.recent.push_back(samples[i & sample_mask]);
+        }
+    }
+};
+
+// Per device RSSI rings by object path, callers hold devices_mutex. Lookups
+// take the path as is, so recording a known device does not allocate.
+class bluez::LinkTelemetry {
+  private:
+    std::map<std::string, std::unique_ptr<LinkRing>, std::less<>> rings;
+    size_t sample_capacity;
+    size_t window_capacity;
+    gint64 window_us;
+
+  public:
+    explicit LinkTelemetry(const BluezTelemetryOptions &options) noexcept
+        : sample_capacity(1), window_capacity(std::max<size_t>(options.windows, 1)), window_us(std::max(options.window_ms, 1) * 1000ll) {
+        while (sample_capacity < options.samples) sample_capacity <<= 1;
+    }
+    void Record(const char *object_path, gint16 rssi, gint16 tx_power) noexcept {
+        auto it = rings.find(object_path);
+        if (it == rings.end()) it = rings.emplace(object_path, std::unique_ptr<LinkRing>(new LinkRing(sample_capacity, window_capacity))).first;
+        it->second->Add(BluezLinkSample{g_get_monotonic_time(), rssi, tx_power}, window_us);
+    }
+    void Drop(const char *object_path) noexcept {
+        auto it = rings.find(object_path);
+        if (it != rings.end()) rings.erase(it);
+    }
+    bool Get(const char *object_path, BluezLinkStats &stats, bool history) const noexcept {
+        auto it = rings.find(object_path);
+        if (it == rings.end()) return false;
+        stats.object_path = it->first;
+        stats.windows.clear();
+        stats.recent.clear();
+        it->second->Fill(stats, g_get_monotonic_time(), window_us, history);
+        return true;
+    }
+    std::vector<BluezLinkStats> GetAll(bool history) const noexcept {
+        std::vector<BluezLinkStats> list(rings.size());
+        auto now = g_get_monotonic_time();
+        size_t i = 0;
+        for (auto &ring : rings) {
+            list[i].object_path = ring.first;
+            ring.second->Fill(list[i++], now, window_us, history);
+        }
+        return list;
+    }
+};
+
+#define DEVICE_CACHE_MAGIC "BZDEVCAC"
+#define DEVICE_CACHE_VERSION 1
+#define DEVICE_CACHE_HEADER 16
+
+// One device in the cache file, in host byte order. The file starts with
+// the magic, a 32 bit version and a 32 bit entry count. The entries follow,
+// then the NUL terminated strings they point to.
+struct DeviceCacheRecord {
+    gint64 last_seen_us;
+    gint64 last_connected_us;
+    // offsets into the strings
+    guint32 path;
+    guint32 address;
+    guint32 name;
+    guint32 alias;
+    guint32 device_class;
+    guint8 paired;
+    guint8 trusted;
+    guint8 reserved[2];
+};
+
+static_assert(sizeof(DeviceCacheRecord) == 40, "DeviceCacheRecord is written as is");
+
+BluezCall::BluezCall(BluezCallCallback callback, const char *method) noexcept
+    : cancellable(g_cancellable_new()), callback(callback), method(method), start_us(g_get_monotonic_time()),
+      future_(promise.get_future().share()) {}
+
+BluezCall::~BluezCall() {
+    g_object_unref(cancellable);
+}
+
+void BluezCall::Cancel() noexcept {
+    g_cancellable_cancel(cancellable);
+}
+
+bool BluezCall::cancelled() const noexcept {
+    return g_cancellable_is_cancelled(cancellable);
+}
+
+std::shared_future<void> BluezCall::future() const noexcept {
+    return future_;
+}
+
+void BluezCall::complete(const BluezError *error) noexcept {
+#ifdef BLUEZ_STATS
+    // from the request, including the hop onto the loop thread
+    Instrumentation::get().call(method)->Record(g_get_monotonic_time() - start_us);
+    if (error) Instrumentation::get().error(*error);
+#endif
+    if (error) {
+        promise.set_exception(std::make_exception_ptr(*error));
+    } else {
+        promise.set_value();
+    }
+    if (callback) callback(error);
+}
+
+BluetoothDevice::BluetoothDevice(GDBusConnection *conn, const char *object_path) noexcept
+    : conn(conn ? G_DBUS_CONNECTION(g_object_ref(conn)) : nullptr), path_(object_path), paired_(false), connected_(false),
+      trusted_(false), services_resolved_(false), rssi_(0), class_(0), tx_power_(127), cached_(false), last_seen_(0), last_connected_(0),
+      transition_(BluetoothEvent::EV_NONE), connect_calls_(0), replied_(0), phases_() {
+    // conn is nullptr for replayed devices of an offline instance
+    g_assert(object_path);
+}
+
+BluetoothDevice::BluetoothDevice(const BluetoothDevice &other) noexcept
+    : conn(other.conn ? G_DBUS_CONNECTION(g_object_ref(other.conn)) : nullptr), path_(other.path_), name_(other.name_), alias_(other.alias_),
+      address_(other.address_), paired_(other.paired_), connected_(other.connected_), trusted_(other.trusted_),
+      services_resolved_(other.services_resolved_), rssi_(other.rssi_), class_(other.class_), tx_power_(other.tx_power_), uuids_(other.uuids_), cached_(other.cached_),
+      last_seen_(other.last_seen_), last_connected_(other.last_connected_), transition_(other.transition_.load()), connect_calls_(other.connect_calls_),
+      replied_(other.replied_), phases_(other.phases_) {}
+
+BluetoothDevice::~BluetoothDevice() {
+    if (conn) g_object_unref(conn);
+};
+
+// replied_ bits, the property a reply set that no signal has repeated yet
+#define REPLIED_CONNECTED 0x01
+#define REPLIED_PAIRED 0x02
+
+template <typename T, typename V>
+static inline bool assign(T &field, const V &value) noexcept {
+    if (field == value) return false;
+    field = value;
+    return true;
+}
+
+bool BluetoothDevice::apply(const PropertyDelta &delta) noexcept {
+    switch (delta.property) {
+    case Property::NAME:
+        return assign(name_, delta.s);
+    case Property::ALIAS:
+        return assign(alias_, delta.s);
+    case Property::ADDRESS:
+        return assign(address_, delta.s);
+    case Property::PAIRED:
+        if (!assign(paired_, delta.b)) return false;
+        replied_ &= ~REPLIED_PAIRED;
+        return true;
+    case Property::CONNECTED:
+        if (!assign(connected_, delta.b)) return false;
+        replied_ &= ~REPLIED_CONNECTED;
+        if (connected_) last_connected_ = g_get_real_time();
+        return true;
+    case Property::TRUSTED:
+        return assign(trusted_, delta.b);
+    case Property::SERVICES_RESOLVED:
+        return assign(services_resolved_, delta.b);
+    case Property::RSSI:
+        return assign(rssi_, delta.n);
+    case Property::CLASS:
+        return assign(class_, delta.u);
+    case Property::TX_POWER:
+        return assign(tx_power_, delta.invalidated ? 127 : delta.n);
+    case Property::UUIDS:
+        return assign(uuids_, delta.strv ? *delta.strv : std::vector<std::string>());
+    default:
+        return false;
+    }
+}
+
+void BluetoothDevice::update(MessageReader &reader) noexcept {
+    PropertyDelta delta;
+    while (reader.NextProperty(delta)) apply(delta);
+}
+
+BluetoothEvent BluetoothDevice::requested(const char *method, gint64 now_us) noexcept {
+    if (strcmp(method, "Connect") == 0) {
+        connect_calls_++;
+        if (connected_ || transition_ == BluetoothEvent::EV_DEVICE_CONNECTING) return BluetoothEvent::EV_NONE;
+        // our Pair that has not brought the link up yet
+        auto continues = phases_.requested_us && phases_.paired_us && !phases_.link_up_us && !phases_.failed_us;
+        if (!continues) {
+            phases_ = BluezConnectPhases();
+            phases_.requested_us = now_us;
+        }
+        transition_ = BluetoothEvent::EV_DEVICE_CONNECTING;
+    } else if (strcmp(method, "Pair") == 0) {
+        if (paired_ || transition_ == BluetoothEvent::EV_DEVICE_PAIRING) return BluetoothEvent::EV_NONE;
+        phases_ = BluezConnectPhases();
+        phases_.requested_us = now_us;
+        transition_ = BluetoothEvent::EV_DEVICE_PAIRING;
+    } else if (strcmp(method, "Disconnect") == 0) {
+        if (!connected_ || transition_ == BluetoothEvent::EV_DEVICE_DISCONNECTING) return BluetoothEvent::EV_NONE;
+        transition_ = BluetoothEvent::EV_DEVICE_DISCONNECTING;
+    } else {
+        return BluetoothEvent::EV_NONE;
+    }
+    return transition_;
+}
+
+void BluetoothDevice::answered(const char *method, bool failed, gint64 now_us) noexcept {
+    auto transition = BluetoothEvent::EV_NONE;
+    PropertyDelta delta = {};
+    if (strcmp(method, "Connect") == 0) {
+        if (connect_calls_) connect_calls_--;
+        if (connect_calls_ && failed) return;
+        transition = BluetoothEvent::EV_DEVICE_CONNECTING;
+        delta.property = Property::CONNECTED;
+        delta.b = true;
+    } else if (strcmp(method, "Pair") == 0) {
+        transition = BluetoothEvent::EV_DEVICE_PAIRING;
+        delta.property = Property::PAIRED;
+        delta.b = true;
+    } else if (strcmp(method, "Disconnect") == 0) {
+        transition = BluetoothEvent::EV_DEVICE_DISCONNECTING;
+        delta.property = Property::CONNECTED;
+        delta.b = false;
+    }
+    // a signal that ended the transition first is newer than the reply
+    if (transition_ == transition && transition != BluetoothEvent::EV_NONE) {
+        if (failed) {
+            transition_ = BluetoothEvent::EV_NONE;
+            if (transition != BluetoothEvent::EV_DEVICE_DISCONNECTING) phases_.failed_us = now_us;
+        } else {
+            // The reply means the call took effect, the signal saying so may
+            // still be queued or come over another connection. It is
+            // announced when it arrives, see confirms().
+            if (apply(delta)) {
+                replied_ |= delta.property == Property::PAIRED ? REPLIED_PAIRED : REPLIED_CONNECTED;
+                changed(delta.property, now_us);
+            }
+            transition_ = BluetoothEvent::EV_NONE;
+        }
+    }
+    check_ready(now_us);
+}
+
+bool BluetoothDevice::confirms(const PropertyDelta &delta) noexcept {
+    auto bit = delta.property == Property::CONNECTED ? REPLIED_CONNECTED : delta.property == Property::PAIRED ? REPLIED_PAIRED : 0;
+    if (!(replied_ & bit)) return false;
+    replied_ &= ~bit;
+    return true;
+}
+
+void BluetoothDevice::changed(Property property, gint64 now_us) noexcept {
+    switch (property) {
+    case Property::CONNECTED:
+        if (!connected_) {
+            if (transition_ == BluetoothEvent::EV_DEVICE_DISCONNECTING) transition_ = BluetoothEvent::EV_NONE;
+            return;
+        }
+        // brought up by the device or another client, a new attempt, unless
+        // the reply to our call overtook the signal
+        if (transition_ == BluetoothEvent::EV_NONE && !connect_calls_ && !(phases_.requested_us && !phases_.link_up_us && !phases_.failed_us))
+            phases_ = BluezConnectPhases();
+        // Pair brings the link up as well, its transition lasts until Paired
+        if (transition_ == BluetoothEvent::EV_DEVICE_CONNECTING) transition_ = BluetoothEvent::EV_NONE;
+        phases_.link_up_us = now_us;
+        break;
+    case Property::PAIRED:
+        if (!paired_) return;
+        if (transition_ == BluetoothEvent::EV_DEVICE_PAIRING) transition_ = BluetoothEvent::EV_NONE;
+        phases_.paired_us = now_us;
+        break;
+    case Property::SERVICES_RESOLVED:
+        if (!services_resolved_) return;
+        phases_.resolved_us = now_us;
+        break;
+    default:
+        return;
+    }
+    check_ready(now_us);
+}
+
+void BluetoothDevice::check_ready(gint64 now_us) noexcept {
+    if (phases_.ready_us || !phases_.link_up_us || !connected_ || !services_resolved_) return;
+    if (connect_calls_ || transition_ != BluetoothEvent::EV_NONE) return;
+    phases_.ready_us = now_us;
+}
+
+const char *BluetoothDevice::object_path() const noexcept {
+    return path_.c_str();
+}
+
+std::string BluetoothDevice::adapter() const noexcept {
+    return adapter_of(path_);
+}
+
+const char *BluetoothDevice::name() const noexcept {
+    return name_.c_str();
+}
+
+const char *BluetoothDevice::alias() const noexcept {
+    return alias_.c_str();
+}
+
+const char *BluetoothDevice::address() const noexcept {
+    return address_.c_str();
+}
+
+const bool BluetoothDevice::paired() const  {
+    return paired_;
+}
+
+const bool BluetoothDevice::connected() const  {
+    return connected_;
+}
+
+bool BluetoothDevice::trusted() const noexcept {
+    return trusted_;
+}
+
+gint16 BluetoothDevice::rssi() const noexcept {
+    return rssi_;
+}
+
+guint32 BluetoothDevice::device_class() const noexcept {
+    return class_;
+}
+
+gint16 BluetoothDevice::tx_power() const noexcept {
+    return tx_power_;
+}
+
+bool BluetoothDevice::services_resolved() const noexcept {
+    return services_resolved_;
+}
+
+const std::vector<std::string> &BluetoothDevice::uuids() const noexcept {
+    return uuids_;
+}
+
+BluetoothEvent BluetoothDevice::state() const noexcept {
+    BluetoothEvent transition = transition_;
+    if (transition != BluetoothEvent::EV_NONE) return transition;
+    return connected_ ? BluetoothEvent::EV_DEVICE_CONNECTED : paired_ ? BluetoothEvent::EV_DEVICE_PAIRED : BluetoothEvent::EV_NONE;
+}
+
+const BluezConnectPhases &BluetoothDevice::phases() const noexcept {
+    return phases_;
+}
+
+bool BluetoothDevice::cached() const noexcept {
+    return cached_;
+}
+
+gint64 BluetoothDevice::last_seen() const noexcept {
+    return last_seen_;
+}
+
+gint64 BluetoothDevice::last_connected() const noexcept {
+    return last_connected_;
+}
+
+void BluetoothDevice::Connect()  {
+    auto value = connection_call(conn, path_.c_str(), BLUEZ_DEVICE_IFACE, "Connect");
+    g_variant_unref(value);
+}
+
+void BluetoothDevice::Disconnect()  {
+    auto value = connection_call(conn, path_.c_str(), BLUEZ_DEVICE_IFACE, "Disconnect");
+    g_variant_unref(value);
+}
+
+void BluetoothDevice::Pair()  {
+    auto value = connection_call(conn, path_.c_str(), BLUEZ_DEVICE_IFACE, "Pair");
+    g_variant_unref(value);
+}
+
+std::string BluetoothDevice::to_string()  {
+    std::ostringstream ostr;
+    ostr << "Name\t\t: " << name() << "\nAddress\t\t: " << address()
+         << "\nPath\t\t: " << object_path()
+         << "\nPaired\t\t: " << std::boolalpha << paired()
+         << "\nConnected\t: " << std::boolalpha << connected() << std::endl;
+    return ostr.str();
+}
+
+HidStream::HidStream(const char *address, int fd, size_t reports, size_t max_report_size) noexcept
+    : address_(address), fd(fd), notify_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), max_size(std::max<size_t>(max_report_size, 1)),
+      head(0), tail(0), held(G_MAXUINT64), overwriting(G_MAXUINT64), dropped_(0), closed_(false), sequence(0) {
+    size_t capacity = 1;
+    while (capacity < reports) capacity <<= 1;
+    mask = capacity - 1;
+    // headers stay 8 byte aligned
+    stride = (sizeof(HidReport) + max_size + 7) & ~size_t(7);
+    ring.reset(new guint8[capacity * stride]);
+    overflow.reset(new guint8[max_size]);
+}
+
+HidStream::~HidStream() {
+    shutdown();
+    if (notify_fd_ >= 0) close(notify_fd_);
+}
+
+HidReport *HidStream::slot(guint64 index) const noexcept {
+    return reinterpret_cast<HidReport *>(ring.get() + (index & mask) * stride);
+}
+
+guint64 HidStream::oldest(guint64 last) const noexcept {
+    return std::max<guint64>(tail.load(std::memory_order_acquire), last > mask ? last - mask - 1 : 0);
+}
+
+bool HidStream::fill(bool all) noexcept {
+    auto first = head.load(std::memory_order_relaxed);
+    auto next = first;
+    bool open = true;
+    // at most one ring worth per wakeup, so one busy device cannot starve
+    // the others
+    for (size_t i = 0; all || i <= mask; i++) {
+        auto reused = next - mask - 1;
+        // the slot still holds an unread report
+        bool full = next - tail.load(std::memory_order_acquire) > mask;
+        bool room = true;
+        if (full) {
+            // announced before held is read, Peek() does the reverse, so
+            // either this sees the batch or the batch skips the slot
+            overwriting.store(reused);
+            room = held.load() > reused;
+        }
+        auto report = slot(next);
+        auto buffer = room ? const_cast<guint8 *>(report->data()) : overflow.get();
+        auto n = read(fd, buffer, max_size);
+        int error = errno;
+        if (n > 0) {
+            sequence++;
+            // an overwritten report is counted once the consumer skips it
+            if (!room) dropped_.fetch_add(1, std::memory_order_relaxed);
+            if (room) {
+                report->timestamp_us = g_get_monotonic_time();
+                report->sequence = sequence;
+                report->length = n;
+                head.store(++next, std::memory_order_release);
+            }
+        }
+        // only once head moved past the slot
+        if (full) overwriting.store(G_MAXUINT64);
+        if (n > 0 || (n < 0 && error == EINTR)) continue;
+        if (n < 0 && (error == EAGAIN || error == EWOULDBLOCK)) break;
+        // end of file, or ENODEV once the controller disconnected
+        open = false;
+        break;
+    }
+    if (next != first) notify();
+    return open;
+}
+
+void HidStream::notify() noexcept {
+    guint64 one = 1;
+    if (write(notify_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) log("eventfd write failed: %s", strerror(errno));
+}
+
+void HidStream::shutdown() noexcept {
+    if (fd >= 0) close(fd);
+    fd = -1;
+    closed_.store(true, std::memory_order_release);
+    notify();
+}
+
+HidReportBatch HidStream::Peek() const noexcept {
+    auto last = head.load(std::memory_order_acquire);
+    auto first = oldest(last);
+    while (true) {
+        // stored before overwriting is read, see fill()
+        held.store(first);
+        auto skip = overwriting.load();
+        auto start = skip != G_MAXUINT64 && skip >= first ? skip + 1 : first;
+        // reports that arrived meanwhile may have overwritten more
+        auto now = head.load(std::memory_order_acquire);
+        start = std::max(start, oldest(now));
+        if (start == first && now == last) break;
+        first = start;
+        last = now;
+    }
+    HidReportBatch batch;
+    batch.base = reinterpret_cast<const guint8 *>(slot(first));
+    batch.stride = stride;
+    batch.count = std::min<size_t>(last - first, mask + 1 - (first & mask));
+    return batch;
+}
+
+void HidStream::Release(size_t count) noexcept {
+    auto last = head.load(std::memory_order_acquire);
+    auto first = held.load(std::memory_order_relaxed);
+    if (first == G_MAXUINT64) first = oldest(last);
+    count = std::min<size_t>(count, last - first);
+    // overwritten before the consumer got to them
+    auto skipped = first - tail.load(std::memory_order_relaxed);
+    if (skipped > 0) dropped_.fetch_add(skipped, std::memory_order_relaxed);
+    tail.store(first + count, std::memory_order_release);
+    // after tail, the streamer may overwrite the slots again
+    held.store(G_MAXUINT64);
+}
+
+guint64 HidStream::dropped() const noexcept {
+    // before tail, Release() moves the skipped reports over in that order
+    auto counted = dropped_.load(std::memory_order_relaxed);
+    auto first = tail.load(std::memory_order_acquire);
+    auto last = head.load(std::memory_order_acquire);
+    return counted + (last - first > mask + 1 ? last - first - mask - 1 : 0);
+}
+
+bool HidStream::Wait(int timeout_ms) noexcept {
+    auto deadline = timeout_ms < 0 ? G_MAXINT64 : g_get_monotonic_time() + timeout_ms * 1000ll;
+    while (true) {
+        // the counter is read before the ring is checked, so a report pushed
+        // in between leaves it set
+        guint64 count;
+        if (read(notify_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) return false;
+        if (head.load(std::memory_order_acquire) > tail.load(std::memory_order_relaxed) || closed()) return true;
+        auto now = g_get_monotonic_time();
+        if (now >= deadline) return false;
+        struct pollfd pfd = {notify_fd_, POLLIN, 0};
+        int wait_ms = timeout_ms < 0 ? -1 : (int)std::max<gint64>(1, (deadline - now + 999) / 1000);
+        if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) return false;
+    }
+}
+
+HidStreamer::HidStreamer(const BluezStreamOptions &options)
+    : options(options), epoll_fd(epoll_create1(EPOLL_CLOEXEC)), wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), next_id(1) {
+    if (epoll_fd < 0 || wake_fd < 0) {
+        int error = errno;
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (wake_fd >= 0) close(wake_fd);
+        throw BluezError(error, strerror(error));
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+    thread = std::thread([this]() { run(); });
+}
+
+HidStreamer::~HidStreamer() {
+    guint64 one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) log("eventfd write failed: %s", strerror(errno));
+    thread.join();
+    {
+        std::lock_guard<std::mutex> _1(mutex);
+        // consumers may still hold their streams, they see them closed
+        for (auto &entry : polled) entry.second->shutdown();
+        polled.clear();
+        streams.clear();
+    }
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void HidStreamer::run() noexcept {
+    struct epoll_event events[16];
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, G_N_ELEMENTS(events), -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            log("epoll_wait failed: %s", strerror(errno));
+            return;
+        }
+        std::lock_guard<std::mutex> _1(mutex);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 == 0) return;
+            // closed while epoll_wait returned
+            auto it = polled.find(events[i].data.u64);
+            if (it == polled.end()) continue;
+            auto stream = it->second;
+            bool hangup = events[i].events & (EPOLLHUP | EPOLLERR);
+            // a hung up node is read to the end, so its last reports are
+            // published before the stream is marked closed
+            if (stream->fill(hangup) && !hangup) continue;
+            log("stream of %s closed", stream->address().c_str());
+            remove(stream->address());
+        }
+    }
+}
+
+void HidStreamer::remove(const std::string &address) noexcept {
+    auto it = streams.find(address);
+    if (it == streams.end()) return;
+    auto stream = it->second;
+    streams.erase(it);
+    for (auto entry = polled.begin(); entry != polled.end(); ++entry) {
+        if (entry->second != stream) continue;
+        polled.erase(entry);
+        break;
+    }
+    // closing drops the descriptor from the epoll set
+    stream->shutdown();
+}
+
+std::shared_ptr<HidStream> HidStreamer::Attach(const char *address, int fd)  {
+    auto key = upper_address(address);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        int error = errno;
+        close(fd);
+        throw BluezError(error, strerror(error));
+    }
+    auto stream = std::make_shared<HidStream>(key.c_str(), fd, options.ring_reports, options.max_report_size);
+    {
+        std::lock_guard<std::mutex> _1(mutex);
+        remove(key);
+        auto id = next_id++;
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = id;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            int error = errno;
+            stream->shutdown();
+            throw BluezError(error, strerror(error));
+        }
+        streams[key] = stream;
+        polled[id] = stream;
+    }
+    attached.notify_all();
+    return stream;
+}
+
+std::shared_ptr<HidStream> HidStreamer::Open(const char *address)  {
+    auto node = FindNode(address);
+    if (node.empty()) return nullptr;
+    int fd = open(node.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        int error = errno;
+        throw BluezError(error, (node + ": " + strerror(error)).c_str());
+    }
+    log("streaming %s from %s", address, node.c_str());
+    return Attach(address, fd);
+}
+
+void HidStreamer::Close(const char *address) noexcept {
+    std::lock_guard<std::mutex> _1(mutex);
+    remove(upper_address(address));
+}
+
+std::shared_ptr<HidStream> HidStreamer::Get(const char *address, int timeout_ms) noexcept {
+    auto key = upper_address(address);
+    std::unique_lock<std::mutex> lock(mutex);
+    attached.wait_for(lock, std::chrono::milliseconds(std::max(timeout_ms, 0)), [&]() { return streams.count(key) > 0; });
+    auto it = streams.find(key);
+    return it == streams.end() ? nullptr : it->second;
+}
+
+// The HID core exports the Bluetooth address as HID_UNIQ in the uevent of
+// the hidraw node's parent.
+std::string HidStreamer::FindNode(const char *address) const noexcept {
+    std::string found;
+    auto dir = g_dir_open(options.sysfs_dir.c_str(), 0, nullptr);
+    if (!dir) return found;
+    while (auto name = g_dir_read_name(dir)) {
+        if (!g_str_has_prefix(name, "hidraw")) continue;
+        auto uevent = g_build_filename(options.sysfs_dir.c_str(), name, "device", "uevent", nullptr);
+        gchar *contents = nullptr;
+        if (g_file_get_contents(uevent, &contents, nullptr, nullptr)) {
+            auto uniq = strstr(contents, "HID_UNIQ=");
+            if (uniq && g_ascii_strncasecmp(uniq + 9, address, strlen(address)) == 0) found = options.dev_dir + "/" + name;
+        }
+        g_free(contents);
+        g_free(uevent);
+        if (!found.empty()) break;
+    }
+    g_dir_close(dir);
+    return found;
+}
+
+// State of the StartScan() session, only touched on the loop thread.
+struct BluezUtil::Scan : std::enable_shared_from_this<BluezUtil::Scan> {
+    BluezUtil *util;
+    BluezScanOptions options;
+    std::vector<std::string> adapters;
+    BluezScanResult result;
+    std::set<std::string> matched;
+    std::promise<BluezScanResult> promise;
+    gint64 start_us;
+    // inside a scan window, and whether discovery is actually on
+    bool in_window;
+    bool scanning;
+    gint64 scanning_since_us;
+    guint window_source;
+    guint deadline_source;
+    bool done;
+
+    GVariant *filter_dict(bool clear) const noexcept;
+    bool wanted(const BluetoothDevice &device) const noexcept;
+    bool admits(const BluetoothDevice &device) const noexcept;
+    void begin() noexcept;
+    void open_window() noexcept;
+    void close_window() noexcept;
+    void update() noexcept;
+    void seen(const char *object_path, const BluetoothDevice &device) noexcept;
+    void finish(const char *reason) noexcept;
+};
+
+// Reconnects supervised devices. Written on the loop thread only, mutex
+// guards the state for GetReconnectStats().
+struct BluezUtil::Supervisor {
+    struct Wanted {
+        BluezReconnectStats stats;
+        // when the current outage began, 0 while connected
+        gint64 down_since_us;
+        guint retry_source;
+        bool in_flight;
+    };
+    BluezUtil *util;
+    BluezReconnectOptions options;
+    std::mutex mutex;
+    std::map<std::string, Wanted> wanted;
+    // devices waiting for a free attempt slot
+    std::deque<std::string> queue;
+    int running;
+
+    explicit Supervisor(BluezUtil *util, const BluezReconnectOptions &options) noexcept
+        : util(util), options(options), running(0) {
+        if (this->options.concurrency < 1) this->options.concurrency = 1;
+    }
+    void add(const std::string &object_path, bool connected) noexcept;
+    void remove(const std::string &object_path) noexcept;
+    void connected(const std::string &object_path, bool connected) noexcept;
+    void request(const std::string &object_path) noexcept;
+    void attempt(const std::string &object_path) noexcept;
+    void completed(const std::string &object_path, const BluezError *e) noexcept;
+    void pump() noexcept;
+    // bluetoothd went away, and its objects were loaded again
+    void suspend() noexcept;
+    void resume() noexcept;
+    // mutex must be held
+    void recovered(Wanted &w) noexcept;
+};
+
+BluezUtil::BluezUtil(const BluezOptions &options)
+    : telemetry(options.telemetry.enabled ? new LinkTelemetry(options.telemetry) : nullptr), conn(nullptr), transport_type(options.transport), proxies(new ProxyPool(options.proxy_pool_size)), recording(false), name_watch(0), objects_loaded(false),
+      bluez_running(false), connected_(connected_promise.get_future().share()), ready_done(false),
+      ready_(ready_promise.get_future().share()), listeners(new ListenerSet()), legacy_listener(0), flush_source(0),
+      connecting(0), supervisor(new Supervisor(this, options.reconnect)),
+      streamer(options.stream.enabled ? new HidStreamer(options.stream) : nullptr), stream_timeout_ms(options.stream.open_timeout_ms),
+      cache_path(options.offline ? "" : options.cache.path), cache_save_delay_ms(options.cache.save_delay_ms), save_source(0),
+      agent_options(options.agent), agent_registration(0) {
+#ifndef BLUEZ_SDBUS
+    if (options.transport == BluezTransportType::SDBUS) throw BluezError(-1, "Built without sd-bus support");
+#endif
+    if (options.event_threads > 0) {
+        dispatcher.reset(new EventDispatcher(options.event_queue_capacity, options.event_threads, options.event_overflow,
+                                             [this](const BluetoothEventRecord &record) { deliver(record); }));
+    }
+    load_cache();
+    if (options.offline) {
+        connected_promise.set_value();
+        objects_loaded = true;
+        bluez_running = true;
+        mark_ready();
+        loop.Start();
+        return;
+    }
+    if (options.lazy_start) {
+        // everything, including the bus connection, happens on the loop thread
+        loop.Start();
+        loop.Post([this]() {
+            try {
+                setup();
+            } catch (...) {
+                // anything escaping would terminate inside the GLib dispatch
+                auto error = std::current_exception();
+                connected_promise.set_exception(error);
+                ready_done = true;
+                ready_promise.set_exception(error);
+            }
+        });
+        return;
+    }
+    {
+        // proxies and subscriptions dispatch on the thread-default context they
+        // were created in, which has to be our private one
+        ContextScope _1(loop.context());
+        setup();
+        register_agent();
+    }
+    // subscribe first so nothing between the dump and the loop start is lost
+    try {
+        load_objects();
+    } catch (const BluezError &) {
+        disconnect();
+        throw;
+    }
+    objects_loaded = true;
+    bluez_running = true;
+    mark_ready();
+    loop.Start();
+}
+
+BluezUtil::~BluezUtil() {
+    log("%s", "~BluezUtil");
+    // nothing is dispatched any more, so the members below can go
+    loop.Stop(LOOP_STOP_TIMEOUT_MS);
+    // keeps the last seen times, also when nothing else changed
+    if (objects_loaded) save_cache();
+    if (scan) {
+        // the loop is gone, so discovery is turned off and the filter reset
+        // right here
+        for (auto &adapter : scan->adapters) {
+            if (!transport) break;
+            try {
+                if (scan->scanning) transport->Call(adapter.c_str(), BLUEZ_ADAPTER_IFACE, "StopDiscovery", nullptr, SHUTDOWN_CALL_TIMEOUT_MS, nullptr);
+                transport->Call(adapter.c_str(), BLUEZ_ADAPTER_IFACE, "SetDiscoveryFilter", scan->filter_dict(true), SHUTDOWN_CALL_TIMEOUT_MS, nullptr);
+            } catch (const BluezError &) {
+            }
+        }
+        scan->scanning = false;
+        // leaves finish() nothing to queue on the stopped loop
+        scan->adapters.clear();
+        scan->finish("stopped");
+    }
+    // nothing produces events any more, drain what is queued
+    dispatcher.reset();
+    proxies.reset();
+    disconnect();
+}
+
+// Connects to the system bus and subscribes. Runs inside the loop context,
+// either before the loop starts or on the loop thread.
+void BluezUtil::setup()  {
+    GError *err = nullptr;
+    auto bus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, nullptr, &err);
+    if (!bus) {
+        log("Get system bus error: %s", err->message);
+        auto e = BluezError(err);
+        g_error_free(err);
+        throw e;
+    }
+    try {
+#ifdef BLUEZ_SDBUS
+        if (transport_type == BluezTransportType::SDBUS) {
+            transport.reset(new_sdbus_transport());
+            agent_transport.reset(new_gdbus_transport(bus));
+        }
+#endif
+        if (!transport) transport.reset(new_gdbus_transport(bus));
+        transport->Open(loop.context(), [this](SignalKind kind, const char *object_path, MessageReader &reader, GVariant *parameters) {
+            on_signal(kind, object_path, reader, parameters);
+        });
+    } catch (const BluezError &e) {
+        log("Open transport error: %s", e.message.c_str());
+        transport.reset();
+        agent_transport.reset();
+        g_object_unref(bus);
+        throw;
+    }
+    conn = bus;
+    std::atomic_store(&listener_conn, std::shared_ptr<GDBusConnection>(G_DBUS_CONNECTION(g_object_ref(bus)), g_object_unref));
+    export_agent();
+    // reports the current owner right away, later restarts of bluetoothd too
+    name_watch = g_bus_watch_name_on_connection(conn, BLUEZ, G_BUS_NAME_WATCHER_FLAGS_NONE, name_appeared, name_vanished, this, nullptr);
+    connected_promise.set_value();
+}
+
+// undoes setup(), the loop must not be running
+void BluezUtil::disconnect() noexcept {
+    if (!conn) return;
+    transport->Close();
+    transport.reset();
+    agent_transport.reset();
+    g_bus_unwatch_name(name_watch);
+    unregister_agent();
+    // a listener still holding it keeps it alive
+    std::atomic_store(&listener_conn, std::shared_ptr<GDBusConnection>());
+    g_object_unref(conn);
+    conn = nullptr;
+}
+
+GDBusConnection *BluezUtil::connection()  {
+    // the loop thread cannot wait for itself, setup() is done or failed there
+    if (!loop.IsLoopThread()) {
+        try {
+            connected_.get();
+        } catch (const BluezError &) {
+            throw;
+        } catch (const std::exception &e) {
+            // the calls throw nothing else
+            throw BluezError(-1, e.what(), "org.bluez.Error.NotReady");
+        } catch (...) {
+            throw BluezError(-1, "Setup failed", "org.bluez.Error.NotReady");
+        }
+    }
+    if (!conn) throw BluezError(-1, "Not connected", "org.bluez.Error.NotReady");
+    return conn;
+}
+
+void BluezUtil::mark_ready() noexcept {
+    if (ready_done) return;
+    ready_done = true;
+    ready_promise.set_value();
+}
+
+std::shared_future<void> BluezUtil::Ready() const noexcept {
+    return ready_;
+}
+
+bool BluezUtil::IsBluezRunning()  {
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    return bluez_running;
+}
+
+void BluezUtil::name_appeared(GDBusConnection *connection, const gchar *name, const gchar *name_owner, gpointer user_data) noexcept {
+    auto util = reinterpret_cast<BluezUtil *>(user_data);
+    log("%s appeared as %s", name, name_owner);
+    {
+        std::lock_guard<std::mutex> _1(util->devices_mutex);
+        util->bluez_running = true;
+    }
+    // the synchronous constructor loaded everything already
+    if (util->objects_loaded) return;
+    util->register_agent();
+    util->load_objects_async();
+}
+
+void BluezUtil::name_vanished(GDBusConnection *connection, const gchar *name, gpointer user_data) noexcept {
+    auto util = reinterpret_cast<BluezUtil *>(user_data);
+    log("%s vanished", name);
+    {
+        std::lock_guard<std::mutex> _1(util->devices_mutex);
+        util->bluez_running = false;
+    }
+    util->objects_loaded = false;
+    util->forget_objects();
+    util->supervisor->suspend();
+    // started without bluetoothd, there is nothing to wait for
+    util->mark_ready();
+}
+
+EventLoop &BluezUtil::event_loop() noexcept {
+    return loop;
+}
+
+BluetoothEvent BluezUtil::GetAdapterState()  {
+    return GetAdapterState(default_adapter().c_str());
+}
+
+BluetoothEvent BluezUtil::GetAdapterState(const char *adapter_path)  {
+    g_assert(adapter_path);
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    auto it = adapters.find(adapter_path);
+    if (it == adapters.end()) return BluetoothEvent::EV_NONE;
+    auto &adapter = it->second;
+    return adapter.discovering ? BluetoothEvent::EV_ADAPTER_DISCOVERY_ON : adapter.powered ? BluetoothEvent::EV_ADAPTER_ON : BluetoothEvent::EV_NONE;
+}
+
+std::vector<BluetoothAdapterInfo> BluezUtil::GetAdapters()  {
+    std::vector<BluetoothAdapterInfo> list;
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    for (auto &adapter : adapters) {
+        list.push_back(adapter.second);
+        list.back().devices = 0;
+        list.back().connections = 0;
+    }
+    for (auto &device : devices) {
+        auto adapter = device.second->adapter();
+        for (auto &info : list) {
+            if (info.object_path != adapter) continue;
+            info.devices++;
+            if (device.second->connected_) info.connections++;
+        }
+    }
+    return list;
+}
+
+std::string BluezUtil::default_adapter()  {
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    if (adapters.empty()) throw BluezError(-1, "No adapter", "org.bluez.Error.NotReady");
+    return adapters.begin()->first;
+}
+
+std::vector<std::string> BluezUtil::powered_adapters() noexcept {
+    std::vector<std::string> paths;
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    for (auto &adapter : adapters) {
+        if (adapter.second.powered) paths.push_back(adapter.first);
+    }
+    return paths;
+}
+
+// connections per powered adapter, devices_mutex must be held
+std::map<std::string, int> BluezUtil::adapter_loads() noexcept {
+    std::map<std::string, int> loads;
+    for (auto &adapter : adapters) {
+        if (adapter.second.powered) loads[adapter.first] = 0;
+    }
+    for (auto &device : devices) {
+        if (!device.second->connected_) continue;
+        auto it = loads.find(device.second->adapter());
+        if (it != loads.end()) it->second++;
+    }
+    return loads;
+}
+
+static bool apply_adapter(BluetoothAdapterInfo &adapter, const PropertyDelta &delta) noexcept {
+    switch (delta.property) {
+    case Property::ADDRESS:
+        return assign(adapter.address, delta.s);
+    case Property::NAME:
+        return assign(adapter.name, delta.s);
+    case Property::ALIAS:
+        return assign(adapter.alias, delta.s);
+    case Property::POWERED:
+        return assign(adapter.powered, delta.b);
+    case Property::DISCOVERING:
+        return assign(adapter.discovering, delta.b);
+    case Property::PAIRABLE:
+        return assign(adapter.pairable, delta.b);
+    case Property::DISCOVERABLE:
+        return assign(adapter.discoverable, delta.b);
+    default:
+        return false;
+    }
+}
+
+void BluezUtil::update_adapter(const char *object_path, MessageReader &reader) noexcept {
+    auto &adapter = adapters[object_path];
+    adapter.object_path = object_path;
+    PropertyDelta delta;
+    while (reader.NextProperty(delta)) apply_adapter(adapter, delta);
+}
+
+void BluezUtil::load_objects()  {
+    call_sync("/", BLUEZ_MANAGER_IFACE, "GetManagedObjects", [this](MessageReader &reader) { apply_objects(reader, false); });
+}
+
+// loop thread only, the objects show up as EV_ADAPTER_ADDED / EV_DEVICE_FOUND
+void BluezUtil::load_objects_async() noexcept {
+    transport->CallAsync("/", BLUEZ_MANAGER_IFACE, "GetManagedObjects", nullptr, -1, nullptr, [this](MessageReader *reply, const BluezError *e) {
+        if (!reply) {
+            // bluetoothd went away again, name_vanished() follows
+            log("Load objects error: %s", e->message.c_str());
+            return;
+        }
+        apply_objects(*reply, true);
+        objects_loaded = true;
+        supervisor->resume();
+        mark_ready();
+    });
+}
+
+// What a cached device turned out to be, as the events a live change would
+// have produced.
+static void reconcile(const BluetoothDevice &before, const BluetoothDevice &after, std::vector<std::pair<BluetoothEvent, std::string>> &events) noexcept {
+    auto path = after.object_path();
+    if (before.paired() != after.paired()) events.emplace_back(after.paired() ? BluetoothEvent::EV_DEVICE_PAIRED : BluetoothEvent::EV_DEVICE_UNPAIRED, path);
+    if (before.trusted() != after.trusted()) events.emplace_back(after.trusted() ? BluetoothEvent::EV_DEVICE_TRUSTED : BluetoothEvent::EV_DEVICE_UNTRUSTED, path);
+    if (strcmp(before.name(), after.name()) != 0 || strcmp(before.alias(), after.alias()) != 0) events.emplace_back(BluetoothEvent::EV_DEVICE_NAME, path);
+    // cached devices start out disconnected
+    if (after.connected()) events.emplace_back(BluetoothEvent::EV_DEVICE_CONNECTED, path);
+}
+
+// Merges a GetManagedObjects() reply into the registries, with announce the
+// objects that were not known yet are emitted from the loop thread.
+void BluezUtil::apply_objects(MessageReader &reader, bool announce) noexcept {
+    const gchar *object_path, *iface;
+    std::vector<std::pair<BluetoothEvent, std::string>> events;
+    std::vector<BluetoothDeviceRef> stale;
+    auto now = g_get_real_time();
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        while (reader.NextObject(object_path)) {
+            while (reader.NextInterface(iface)) {
+                if (strcmp(iface, BLUEZ_ADAPTER_IFACE) == 0) {
+                    if (announce && !adapters.count(object_path)) events.emplace_back(BluetoothEvent::EV_ADAPTER_ADDED, object_path);
+                    update_adapter(object_path, reader);
+                } else if (strcmp(iface, BLUEZ_DEVICE_IFACE) == 0) {
+                    auto device = find_device(object_path, false);
+                    if (device && device->cached_) {
+                        BluetoothDevice before(*device);
+                        device->update(reader);
+                        device->cached_ = false;
+                        if (!device->conn && conn) device->conn = G_DBUS_CONNECTION(g_object_ref(conn));
+                        reconcile(before, *device, events);
+                    } else {
+                        if (announce && !device) events.emplace_back(BluetoothEvent::EV_DEVICE_FOUND, object_path);
+                        device = find_device(object_path, true);
+                        device->update(reader);
+                    }
+                    device->last_seen_ = now;
+                }
+            }
+        }
+        // cached devices this bluetoothd does not know
+        for (auto it = devices.begin(); it != devices.end();) {
+            if (!it->second->cached_) {
+                ++it;
+                continue;
+            }
+            proxies->Drop(it->first.c_str());
+            if (telemetry) telemetry->Drop(it->first.c_str());
+            stale.push_back(std::move(it->second));
+            it = devices.erase(it);
+        }
+    }
+    for (auto &device : stale) {
+        emit(BluetoothEvent::EV_DEVICE_REMOVE, device->object_path(), device.get());
+    }
+    for (auto &object : events) {
+        // registry entries are only modified on this thread
+        emit(object.first, object.second.c_str(), object.first == BluetoothEvent::EV_ADAPTER_ADDED ? nullptr : find_device(object.second.c_str(), false));
+    }
+    if (!streamer) return;
+    // devices that were connected before we started
+    auto deadline = g_get_monotonic_time() + stream_timeout_ms * 1000ll;
+    for (auto &device : devices) {
+        if (!device.second->connected()) continue;
+        std::string object_path = device.first;
+        loop.Post([this, object_path, deadline]() { open_stream(object_path, deadline); });
+    }
+}
+
+// Opens the hidraw node of a connected device, which the kernel creates a
+// little after Connected=true. Loop thread only.
+void BluezUtil::open_stream(const std::string &object_path, gint64 deadline_us) noexcept {
+    std::string address;
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        auto device = find_device(object_path.c_str(), false);
+        if (!device || !device->connected()) return;
+        address = device->address();
+    }
+    try {
+        if (streamer->Get(address.c_str()) || streamer->Open(address.c_str())) return;
+    } catch (const BluezError &e) {
+        log("cannot stream %s: %s", address.c_str(), e.message.c_str());
+        return;
+    }
+    if (g_get_monotonic_time() >= deadline_us) {
+        log("no hidraw node for %s", address.c_str());
+        return;
+    }
+    loop.Post([this, object_path, deadline_us]() { open_stream(object_path, deadline_us); }, STREAM_RETRY_MS);
+}
+
+std::shared_ptr<HidStream> BluezUtil::GetStream(const char *object_path, int timeout_ms)  {
+    if (!streamer) return nullptr;
+    std::string address;
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        auto device = find_device(object_path, false);
+        if (!device) return nullptr;
+        address = device->address();
+    }
+    return streamer->Get(address.c_str(), timeout_ms);
+}
+
+// Seeds the registry from the cache file before the bus is touched. A
+// missing or damaged file is left alone, it is replaced by the next save.
+void BluezUtil::load_cache() noexcept {
+    if (cache_path.empty()) return;
+    GError *err = nullptr;
+    auto file = g_mapped_file_new(cache_path.c_str(), false, &err);
+    if (!file) {
+        log("No device cache: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+    auto data = g_mapped_file_get_contents(file);
+    size_t length = g_mapped_file_get_length(file);
+    guint32 version = 0, count = 0;
+    if (length >= DEVICE_CACHE_HEADER) {
+        memcpy(&version, data + 8, sizeof(version));
+        memcpy(&count, data + 12, sizeof(count));
+    }
+    auto strings = DEVICE_CACHE_HEADER + (size_t)count * sizeof(DeviceCacheRecord);
+    if (length < DEVICE_CACHE_HEADER || memcmp(data, DEVICE_CACHE_MAGIC, 8) != 0 || version != DEVICE_CACHE_VERSION || strings > length) {
+        log("%s: not a device cache", cache_path.c_str());
+        g_mapped_file_unref(file);
+        return;
+    }
+    // nullptr unless the string ends inside the file
+    auto string_at = [&](guint32 offset) -> const char * {
+        if (offset >= length - strings) return nullptr;
+        auto str = data + strings + offset;
+        return memchr(str, 0, length - strings - offset) ? str : nullptr;
+    };
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    for (guint32 i = 0; i < count; i++) {
+        DeviceCacheRecord record;
+        memcpy(&record, data + DEVICE_CACHE_HEADER + i * sizeof(record), sizeof(record));
+        auto path = string_at(record.path), address = string_at(record.address);
+        auto name = string_at(record.name), alias = string_at(record.alias);
+        if (!path || !address || !name || !alias || !g_variant_is_object_path(path) || find_device(path, false)) continue;
+        auto device = find_device(path, true);
+        device->address_ = address;
+        device->name_ = name;
+        device->alias_ = alias;
+        device->class_ = record.device_class;
+        device->paired_ = record.paired;
+        device->trusted_ = record.trusted;
+        device->last_seen_ = record.last_seen_us;
+        device->last_connected_ = record.last_connected_us;
+        device->cached_ = true;
+    }
+    g_mapped_file_unref(file);
+    log("%zu devices from %s", devices.size(), cache_path.c_str());
+}
+
+// Replaces the cache file with the registry in one rename.
+void BluezUtil::save_cache() noexcept {
+    if (cache_path.empty()) return;
+    std::vector<DeviceCacheRecord> records;
+    std::string strings;
+    auto add = [&](const std::string &str) {
+        auto offset = (guint32)strings.size();
+        strings.append(str.c_str(), str.size() + 1);
+        return offset;
+    };
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        records.reserve(devices.size());
+        for (auto &device : devices) {
+            auto &d = *device.second;
+            DeviceCacheRecord record = {};
+            record.last_seen_us = d.last_seen_;
+            record.last_connected_us = d.last_connected_;
+            record.path = add(d.path_);
+            record.address = add(d.address_);
+            record.name = add(d.name_);
+            record.alias = add(d.alias_);
+            record.device_class = d.class_;
+            record.paired = d.paired_;
+            record.trusted = d.trusted_;
+            records.push_back(record);
+        }
+    }
+    guint32 header[] = {DEVICE_CACHE_VERSION, (guint32)records.size()};
+    std::string contents(DEVICE_CACHE_MAGIC, 8);
+    contents.append(reinterpret_cast<const char *>(header), sizeof(header));
+    contents.append(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(DeviceCacheRecord));
+    contents += strings;
+    GError *err = nullptr;
+    if (!g_file_set_contents(cache_path.c_str(), contents.data(), contents.size(), &err)) {
+        log("Write device cache error: %s", err->message);
+        g_error_free(err);
+    }
+}
+
+// one write per burst of changes, loop thread only
+void BluezUtil::schedule_save() noexcept {
+    if (cache_path.empty() || save_source) return;
+    save_source = loop.Post([this]() {
+        save_source = 0;
+        // while bluetoothd is away the registry only holds what is left of it
+        if (objects_loaded) save_cache();
+    }, cache_save_delay_ms);
+}
+
+// Drops every adapter and device of a vanished bluetoothd, loop thread only.
+void BluezUtil::forget_objects() noexcept {
+    std::map<std::string, BluetoothDeviceRef> gone_devices;
+    std::map<std::string, BluetoothAdapterInfo> gone_adapters;
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        gone_devices.swap(devices);
+        gone_adapters.swap(adapters);
+        rejected.clear();
+        // cached devices stay until a bluetoothd confirms or drops them
+        for (auto it = gone_devices.begin(); it != gone_devices.end();) {
+            if (!it->second->cached_) {
+                ++it;
+                continue;
+            }
+            devices.insert(std::move(*it));
+            it = gone_devices.erase(it);
+        }
+        for (auto &device : gone_devices) {
+            proxies->Drop(device.first.c_str());
+            if (telemetry) telemetry->Drop(device.first.c_str());
+        }
+        for (auto &adapter : gone_adapters) proxies->Drop(adapter.first.c_str());
+    }
+    for (auto &device : gone_devices) {
+        emit(BluetoothEvent::EV_DEVICE_REMOVE, device.first.c_str(), device.second.get());
+    }
+    for (auto &adapter : gone_adapters) {
+        emit(BluetoothEvent::EV_ADAPTER_REMOVED, adapter.first.c_str(), nullptr);
+    }
+}
+
+// devices_mutex must be held
+BluetoothDevice *BluezUtil::find_device(const char *object_path, bool create) noexcept {
+    auto it = devices.find(object_path);
+    if (it != devices.end()) return it->second.get();
+    if (!create) return nullptr;
+    // bluetoothd announced it again
+    rejected.erase(object_path);
+    auto device = new BluetoothDevice(conn, object_path);
+    devices.emplace(object_path, BluetoothDeviceRef(device));
+    return device;
+}
+
+std::list<BluetoothDeviceRef> BluezUtil::GetDevices()  {
+    std::list<BluetoothDeviceRef> list;
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    for (auto &device : devices) {
+        list.emplace_back(new BluetoothDevice(*device.second));
+    }
+    return list;
+}
+
+// the arena is sized up front, so it never moves while it is filled
+const char *BluetoothDeviceSnapshot::store(const std::string &str) noexcept {
+    auto offset = arena.size();
+    arena.insert(arena.end(), str.c_str(), str.c_str() + str.size() + 1);
+    return arena.data() + offset;
+}
+
+BluetoothDeviceSnapshot BluezUtil::GetDeviceSnapshot()  {
+    BluetoothDeviceSnapshot snapshot;
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    size_t bytes = 0;
+    for (auto &device : devices) {
+        auto &d = *device.second;
+        bytes += d.path_.size() + d.name_.size() + d.address_.size() + 3;
+    }
+    snapshot.arena.reserve(bytes);
+    snapshot.devices.reserve(devices.size());
+    for (auto &device : devices) {
+        auto &d = *device.second;
+        snapshot.devices.push_back(BluetoothDeviceInfo{snapshot.store(d.path_), snapshot.store(d.name_), snapshot.store(d.address_),
+                                                       d.paired_, d.connected_, d.trusted_, d.rssi_, d.class_, d.cached_});
+    }
+    return snapshot;
+}
+
+std::string BluezUtil::SelectDevice(const char *address)  {
+    g_assert(address);
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    auto loads = adapter_loads();
+    std::string best;
+    int best_load = 0;
+    // -G_MAXFLOAT for an adapter that has not heard the device lately
+    float best_rssi = 0;
+    BluezLinkStats stats;
+    for (auto &device : devices) {
+        if (g_ascii_strcasecmp(device.second->address(), address) != 0) continue;
+        auto it = loads.find(device.second->adapter());
+        if (it == loads.end()) continue;
+        auto rssi = -G_MAXFLOAT;
+        if (telemetry && telemetry->Get(device.first.c_str(), stats, false) && stats.samples) rssi = stats.avg_rssi;
+        if (best.empty() || it->second < best_load || (it->second == best_load && rssi > best_rssi)) {
+            best = device.first;
+            best_load = it->second;
+            best_rssi = rssi;
+        }
+    }
+    return best;
+}
+
+void BluezUtil::StartDiscovery()  {
+    for (auto &adapter : powered_adapters()) {
+        StartDiscovery(adapter.c_str());
+    }
+}
+
+void BluezUtil::StopDiscovery()  {
+    for (auto &adapter : powered_adapters()) {
+        StopDiscovery(adapter.c_str());
+    }
+}
+
+void BluezUtil::StartDiscovery(const char *adapter_path)  {
+    g_assert(adapter_path);
+    call_sync(adapter_path, BLUEZ_ADAPTER_IFACE, "StartDiscovery");
+}
+
+void BluezUtil::StopDiscovery(const char *adapter_path)  {
+    g_assert(adapter_path);
+    call_sync(adapter_path, BLUEZ_ADAPTER_IFACE, "StopDiscovery");
+}
+
+void BluezUtil::RegisterListener(BluetoothEventCallback callback) noexcept {
+    std::lock_guard<std::mutex> _1(listener_mutex);
+    if (legacy_listener) Unsubscribe(legacy_listener);
+    legacy_listener = callback ? Subscribe(callback, EV_MASK_ALL) : 0;
+}
+
+ListenerToken BluezUtil::Subscribe(BluetoothEventCallback callback, BluetoothEventMask mask, const BluetoothDeviceMatch &match) noexcept {
+    g_assert(callback);
+    return listeners->Add(callback, mask, match);
+}
+
+void BluezUtil::Unsubscribe(ListenerToken token) noexcept {
+    listeners->Remove(token);
+}
+
+EventQueueStats BluezUtil::GetEventQueueStats() const noexcept {
+    return dispatcher ? dispatcher->Stats() : EventQueueStats{};
+}
+
+BluezStats BluezUtil::Stats() const  {
+    BluezStats stats{};
+#ifdef BLUEZ_STATS
+    stats.enabled = true;
+    Instrumentation::get().Snapshot(stats);
+#endif
+    loop.Usage(stats.loop_busy_us, stats.loop_uptime_us);
+    return stats;
+}
+
+gint64 BluezHistogram::Percentile(double p) const noexcept {
+    if (count == 0) return 0;
+    auto rank = (guint64)(p * (count - 1)) + 1;
+    guint64 seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) return i + 1 < buckets.size() ? std::min<gint64>(1ll << i, max_us) : max_us;
+    }
+    return max_us;
+}
+
+static void histogram_text(std::ostringstream &ostr, const BluezHistogram &h) {
+    ostr << "n " << h.count << "  avg " << (h.count ? h.total_us / (gint64)h.count : 0) << " us  p50 " << h.Percentile(0.5)
+         << " us  p99 " << h.Percentile(0.99) << " us  max " << h.max_us << " us";
+}
+
+std::string BluezStats::ToText() const {
+    std::ostringstream ostr;
+    if (!enabled) return "stats compiled out\n";
+    ostr << "calls\n";
+    for (auto &call : calls) {
+        ostr << "  " << call.method << "\t: ";
+        histogram_text(ostr, call.latency);
+        ostr << "\n";
+    }
+    ostr << "signals\n";
+    for (auto &signal : signals) {
+        ostr << "  " << signal.signal << "\n    parse\t: ";
+        histogram_text(ostr, signal.parse);
+        ostr << "\n    dispatch\t: ";
+        histogram_text(ostr, signal.dispatch);
+        ostr << "\n";
+    }
+    ostr << "errors\n";
+    for (auto &error : errors)
+        ostr << "  code " << error.first << "\t: " << error.second << "\n";
+    for (auto &error : remote_errors)
+        ostr << "  " << error.first << "\t: " << error.second << "\n";
+    ostr << "loop busy " << loop_busy_us << " us of " << loop_uptime_us << " us\n";
+    return ostr.str();
+}
+
+static void json_string(std::ostringstream &ostr, const std::string &str) {
+    ostr << '"';
+    for (auto c : str) {
+        if (c == '"' || c == '\\') {
+            ostr << '\\' << c;
+        } else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            ostr << buf;
+        } else {
+            ostr << c;
+        }
+    }
+    ostr << '"';
+}
+
+static void histogram_json(std::ostringstream &ostr, const BluezHistogram &h) {
+    ostr << "{\"count\":" << h.count << ",\"total_us\":" << h.total_us << ",\"max_us\":" << h.max_us << ",\"p50_us\":" << h.Percentile(0.5)
+         << ",\"p99_us\":" << h.Percentile(0.99) << ",\"buckets\":[";
+    for (size_t i = 0; i < h.buckets.size(); i++)
+        ostr << (i ? "," : "") << h.buckets[i];
+    ostr << "]}";
+}
+
+std::string BluezStats::ToJson() const {
+    std::ostringstream ostr;
+    ostr << "{\"enabled\":" << std::boolalpha << enabled << ",\"calls\":{";
+    for (size_t i = 0; i < calls.size(); i++) {
+        ostr << (i ? "," : "");
+        json_string(ostr, calls[i].method);
+        ostr << ":";
+        histogram_json(ostr, calls[i].latency);
+    }
+    ostr << "},\"signals\":{";
+    for (size_t i = 0; i < signals.size(); i++) {
+        ostr << (i ? "," : "");
+        json_string(ostr, signals[i].signal);
+        ostr << ":{\"parse\":";
+        histogram_json(ostr, signals[i].parse);
+        ostr << ",\"dispatch\":";
+        histogram_json(ostr, signals[i].dispatch);
+        ostr << "}";
+    }
+    ostr << "},\"errors\":{";
+    bool first = true;
+    for (auto &error : errors) {
+        ostr << (first ? "" : ",") << "\"" << error.first << "\":" << error.second;
+        first = false;
+    }
+    ostr << "},\"remote_errors\":{";
+    first = true;
+    for (auto &error : remote_errors) {
+        ostr << (first ? "" : ",");
+        json_string(ostr, error.first);
+        ostr << ":" << error.second;
+        first = false;
+    }
+    ostr << "},\"loop_busy_us\":" << loop_busy_us << ",\"loop_uptime_us\":" << loop_uptime_us << "}";
+    return ostr.str();
+}
+
+// the events that change what the device cache holds
+static const BluetoothEventMask CACHE_EVENTS =
+    BluetoothEventBit(BluetoothEvent::EV_DEVICE_FOUND) | BluetoothEventBit(BluetoothEvent::EV_DEVICE_REMOVE) |
+    BluetoothEventBit(BluetoothEvent::EV_DEVICE_PAIRED) | BluetoothEventBit(BluetoothEvent::EV_DEVICE_UNPAIRED) |
+    BluetoothEventBit(BluetoothEvent::EV_DEVICE_TRUSTED) | BluetoothEventBit(BluetoothEvent::EV_DEVICE_UNTRUSTED) |
+    BluetoothEventBit(BluetoothEvent::EV_DEVICE_NAME) | BluetoothEventBit(BluetoothEvent::EV_DEVICE_CONNECTED);
+
+// loop thread only
+void BluezUtil::emit(BluetoothEvent event, const char *object_path, const BluetoothDevice *device) noexcept {
+    if (BluetoothEventBit(event) & CACHE_EVENTS) schedule_save();
+    if (!(listeners->interest() & BluetoothEventBit(event))) return;
+    BluetoothEventRecord record;
+    record.event = event;
+    record.timestamp_us = g_get_monotonic_time();
+    copy_field(record.object_path, sizeof(record.object_path), object_path);
+    record.paired = device && device->paired_;
+    record.connected = device && device->connected_;
+    record.trusted = device && device->trusted_;
+    record.services_resolved = device && device->services_resolved_;
+    record.rssi = device ? device->rssi_ : 0;
+    record.transition = device ? BluetoothEventValue(device->transition_) : 0;
+    record.device_class = device ? device->class_ : 0;
+    copy_field(record.address, sizeof(record.address), device ? device->address_.c_str() : "");
+    copy_field(record.name, sizeof(record.name), device ? device->name_.c_str() : "");
+    if (!dispatcher) {
+        deliver(record);
+        return;
+    }
+    dispatcher->Push(record);
+    schedule_flush();
+}
+
+// retries coalesced events once the listeners made room, loop thread only
+void BluezUtil::schedule_flush() noexcept {
+    if (flush_source || dispatcher->Flush()) return;
+    flush_source = loop.Post([this]() {
+        flush_source = 0;
+        schedule_flush();
+    }, 1);
+}
+
+// runs on a listener thread, or on the loop thread without dispatcher
+void BluezUtil::deliver(const BluetoothEventRecord &record) noexcept {
+    auto bit = BluetoothEventBit(record.event);
+    if (record.event == EV_ADAPTER) {
+        listeners->ForEach([&](const Listener &l) {
+            if (l.mask & bit) l.callback(record.event, nullptr);
+        });
+        return;
+    }
+    auto bus = std::atomic_load(&listener_conn);
+    BluetoothDevice device(bus.get(), record.object_path);
+    device.name_ = record.name;
+    device.address_ = record.address;
+    device.paired_ = record.paired;
+    device.connected_ = record.connected;
+    device.trusted_ = record.trusted;
+    device.services_resolved_ = record.services_resolved;
+    device.rssi_ = record.rssi;
+    device.class_ = record.device_class;
+    device.transition_ = static_cast<BluetoothEvent>(record.transition);
+    if (record.event == BluetoothEvent::EV_DEVICE_NAME || record.event == BluetoothEvent::EV_DEVICE_UUIDS) {
+        // too big for every record, rare enough to read the current value
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        auto current = find_device(record.object_path, false);
+        if (current) {
+            device.alias_ = current->alias_;
+            device.uuids_ = current->uuids_;
+        }
+    }
+    listeners->ForEach([&](const Listener &l) {
+        if ((l.mask & bit) && device_matches(l.match, record)) l.callback(record.event, &device);
+    });
+}
+
+GDBusProxy *BluezUtil::AcquireProxy(const char *object_path, const char *iface, bool load_properties)  {
+    g_assert(object_path && iface);
+    auto key = std::string(object_path) + (load_properties ? " +" : " ") + iface;
+    auto proxy = proxies->Get(key);
+    if (proxy) return proxy;
+    std::string path(object_path), interface(iface);
+    auto conn = connection();
+    auto create = [conn, path, interface, load_properties]() {
+        GError *err = nullptr;
+        auto flags = load_properties ? G_DBUS_PROXY_FLAGS_NONE : (GDBusProxyFlags)(G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS);
+        CallTimer timer("new GDBusProxy");
+        auto proxy = g_dbus_proxy_new_sync(conn, flags, nullptr, BLUEZ, path.c_str(), interface.c_str(), nullptr, &err);
+        if (!proxy) {
+            log("Create proxy for '%s' error: %s", path.c_str(), err->message);
+            auto e = BluezError(err);
+            timer.failed(e);
+            g_error_free(err);
+            throw e;
+        }
+        return proxy;
+    };
+    if (!load_properties || loop.IsLoopThread()) {
+        proxy = create();
+    } else {
+        // property updates are dispatched on the context the proxy is created
+        // in, so it has to be made on the loop thread
+        if (!loop.Running()) throw BluezError(-1, "Event loop not running", "org.bluez.Error.NotReady");
+        auto task = std::make_shared<std::packaged_task<GDBusProxy *()>>(create);
+        auto result = task->get_future();
+        // dropped once Stop() began, nobody waits for it any more
+        loop.Post([this, task]() {
+            if (loop.Running()) (*task)();
+        });
+        while (result.wait_for(std::chrono::milliseconds(LOOP_CHECK_MS)) != std::future_status::ready) {
+            if (!loop.Running()) throw BluezError(-1, "Event loop stopped", "org.bluez.Error.NotReady");
+        }
+        proxy = result.get();
+    }
+    proxies->Put(key, object_path, proxy);
+    return proxy;
+}
+
+void BluezUtil::Connect(const char *object_path)  {
+    g_assert(object_path);
+    call_sync(object_path, BLUEZ_DEVICE_IFACE, "Connect");
+}
+
+void BluezUtil::Disconnect(const char *object_path)  {
+    g_assert(object_path);
+    call_sync(object_path, BLUEZ_DEVICE_IFACE, "Disconnect");
+}
+
+void BluezUtil::Pair(const char *object_path)  {
+    g_assert(object_path);
+    call_sync(object_path, BLUEZ_DEVICE_IFACE, "Pair");
+}
+
+// BlueZ asks the agent of the connection Pair came from, which is the GDBus one.
+Transport *BluezUtil::transport_for(const char *method) noexcept {
+    return agent_transport && strcmp(method, "Pair") == 0 ? agent_transport.get() : transport.get();
+}
+
+static bool lifecycle_call(const char *iface, const char *method) noexcept {
+    return strcmp(iface, BLUEZ_DEVICE_IFACE) == 0 &&
+           (strcmp(method, "Connect") == 0 || strcmp(method, "Pair") == 0 || strcmp(method, "Disconnect") == 0);
+}
+
+void BluezUtil::call_started(const char *object_path, const char *method) noexcept {
+    BluetoothDevice *device;
+    BluetoothEvent event;
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        device = find_device(object_path, false);
+        if (!device) return;
+        event = device->requested(method, g_get_monotonic_time());
+    }
+    if (event == BluetoothEvent::EV_NONE) return;
+    // the registry entry is only modified on the loop thread
+    if (loop.IsLoopThread()) {
+        emit(event, object_path, device);
+        return;
+    }
+    std::string path(object_path);
+    loop.Post([this, path, event]() {
+        BluetoothDevice *device;
+        {
+            std::lock_guard<std::mutex> _1(devices_mutex);
+            device = find_device(path.c_str(), false);
+            // the signals ended it already, don't announce it after the fact
+            if (device && device->transition_ != event) device = nullptr;
+        }
+        if (device) emit(event, path.c_str(), device);
+    });
+}
+
+void BluezUtil::call_answered(const char *object_path, const char *method, const BluezError *error) noexcept {
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    auto device = find_device(object_path, false);
+    if (device) device->answered(method, error != nullptr, g_get_monotonic_time());
+}
+
+// Blocking call through the transport, the reply is only read by read.
+void BluezUtil::call_sync(const char *object_path, const char *iface, const char *method, const std::function<void(MessageReader &)> &read)  {
+    // waits for a lazy start, and throws if it failed
+    connection();
+    if (!transport) throw BluezError(-1, "Not connected", "org.bluez.Error.NotReady");
+    auto tracked = lifecycle_call(iface, method);
+    if (tracked) call_started(object_path, method);
+    CallTimer timer(method);
+    try {
+        transport_for(method)->Call(object_path, iface, method, nullptr, -1, read);
+    } catch (const BluezError &e) {
+        log("Call '%s' on '%s' error: %s", method, object_path, e.message.c_str());
+        timer.failed(e);
+        if (tracked) call_answered(object_path, method, &e);
+        throw;
+    }
+    // the reply settles the state before the call returns
+    if (tracked) call_answered(object_path, method, nullptr);
+}
+
+BluezCallRef BluezUtil::call_async(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms, BluezCallCallback callback) noexcept {
+    // connection setup in flight pauses a StartScan() session
+    auto setup = strcmp(method, "Connect") == 0 || strcmp(method, "Pair") == 0;
+    if (setup) {
+        callback = [this, callback](const BluezError *e) {
+            connecting_changed(-1);
+            if (callback) callback(e);
+        };
+    }
+    auto call = BluezCallRef(new BluezCall(callback, method));
+    // issued from the loop thread so the completion is dispatched there, and
+    // after a lazy start has connected
+    std::string path(object_path);
+    if (parameters) g_variant_ref_sink(parameters);
+    loop.Post([this, call, path, iface, method, parameters, timeout_ms, setup]() {
+        if (setup) connecting_changed(1);
+        if (!transport) {
+            BluezError e(-1, "Not connected", "org.bluez.Error.NotReady");
+            call->complete(&e);
+            if (parameters) g_variant_unref(parameters);
+            return;
+        }
+        auto tracked = lifecycle_call(iface, method);
+        if (tracked) call_started(path.c_str(), method);
+        transport_for(method)->CallAsync(path.c_str(), iface, method, parameters, timeout_ms, call->cancellable, [this, call, path, method, tracked](MessageReader *, const BluezError *e) {
+            if (e) log("Async call error: %s", e->message.c_str());
+            // before the callback, which may look at the state
+            if (tracked) call_answered(path.c_str(), method, e);
+            call->complete(e);
+        });
+        if (parameters) g_variant_unref(parameters);
+    });
+    return call;
+}
+
+BluezCallRef BluezUtil::StartDiscoveryAsync(int timeout_ms, BluezCallCallback callback)  {
+    return StartDiscoveryAsync(default_adapter().c_str(), timeout_ms, callback);
+}
+
+BluezCallRef BluezUtil::StopDiscoveryAsync(int timeout_ms, BluezCallCallback callback)  {
+    return StopDiscoveryAsync(default_adapter().c_str(), timeout_ms, callback);
+}
+
+BluezCallRef BluezUtil::StartDiscoveryAsync(const char *adapter_path, int timeout_ms, BluezCallCallback callback) noexcept {
+    g_assert(adapter_path);
+    return call_async(adapter_path, BLUEZ_ADAPTER_IFACE, "StartDiscovery", nullptr, timeout_ms, callback);
+}
+
+BluezCallRef BluezUtil::StopDiscoveryAsync(const char *adapter_path, int timeout_ms, BluezCallCallback callback) noexcept {
+    g_assert(adapter_path);
+    return call_async(adapter_path, BLUEZ_ADAPTER_IFACE, "StopDiscovery", nullptr, timeout_ms, callback);
+}
+
+BluezCallRef BluezUtil::ConnectAsync(const char *object_path, int timeout_ms, BluezCallCallback callback) noexcept {
+    g_assert(object_path);
+    return call_async(object_path, BLUEZ_DEVICE_IFACE, "Connect", nullptr, timeout_ms, callback);
+}
+
+BluezCallRef BluezUtil::DisconnectAsync(const char *object_path, int timeout_ms, BluezCallCallback callback) noexcept {
+    g_assert(object_path);
+    return call_async(object_path, BLUEZ_DEVICE_IFACE, "Disconnect", nullptr, timeout_ms, callback);
+}
 
-#define TARGET_PATH "/org/bluez/hci0/dev_"
-#define TARGET_DEVICE "org.bluez.Device1"
+BluezCallRef BluezUtil::PairAsync(const char *object_path, int timeout_ms, BluezCallCallback callback) noexcept {
+    g_assert(object_path);
+    return call_async(object_path, BLUEZ_DEVICE_IFACE, "Pair", nullptr, timeout_ms, callback);
+}
 
-#define log(fmt, ...) g_message("[BluezUtil]" fmt "", __VA_ARGS__)
+// State of one PairAndConnectAsync() run, only touched on the loop thread.
+struct BluezUtil::Setup : std::enable_shared_from_this<BluezUtil::Setup> {
+    BluezUtil *util;
+    int timeout_ms;
+    BluezSetupResult result;
+    gint64 step_start;
+    std::promise<BluezSetupResult> promise;
 
-using namespace bluez;
+    void pair() noexcept;
+    void trust() noexcept;
+    void connect() noexcept;
+    void finish(const char *step, const BluezError *e) noexcept;
+    // reads the registry, paired, trusted or connected
+    bool is(bool BluetoothDevice::*field) noexcept;
+};
 
-static inline GVariant *proxy_call(GDBusProxy *proxy, const char *name)  {
-    GError *err = nullptr;
-    auto value = g_dbus_proxy_call_sync(proxy, name, nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, &err);
-    if (!value) {
-        log("Call '%s' error: %s", name, err->message);
-        auto e = BluezError(err);
-        g_error_free(err);
-        throw e;
+bool BluezUtil::Setup::is(bool BluetoothDevice::*field) noexcept {
+    std::lock_guard<std::mutex> _1(util->devices_mutex);
+    auto device = util->find_device(result.object_path.c_str(), false);
+    return device && device->*field;
+}
+
+void BluezUtil::Setup::pair() noexcept {
+    if (is(&BluetoothDevice::paired_)) {
+        trust();
+        return;
     }
-    return value;
+    auto self = shared_from_this();
+    step_start = g_get_monotonic_time();
+    util->call_async(result.object_path.c_str(), BLUEZ_DEVICE_IFACE, "Pair", nullptr, timeout_ms, [self](const BluezError *e) {
+        self->result.pair_us = g_get_monotonic_time() - self->step_start;
+        // paired in the meantime, e.g. by the remote side
+        if (e && e->name != "org.bluez.Error.AlreadyExists") {
+            self->finish("Pair", e);
+            return;
+        }
+        self->trust();
+    });
 }
 
-static inline GVariant *proxy_get_property(GDBusProxy *proxy, const char *name)  {
-    auto value = g_dbus_proxy_get_cached_property(proxy, name);
-    if (!value) {
-        log("Property '%s' not exist", name);
-    };
-    return value;
+void BluezUtil::Setup::trust() noexcept {
+    // trusted devices may reconnect on their own, without an agent round trip
+    if (is(&BluetoothDevice::trusted_)) {
+        connect();
+        return;
+    }
+    auto self = shared_from_this();
+    step_start = g_get_monotonic_time();
+    auto parameters = g_variant_new("(ssv)", BLUEZ_DEVICE_IFACE, "Trusted", g_variant_new_boolean(true));
+    util->call_async(result.object_path.c_str(), BLUEZ_PROPERTY_IFACE, "Set", parameters, timeout_ms, [self](const BluezError *e) {
+        self->result.trust_us = g_get_monotonic_time() - self->step_start;
+        if (e) {
+            self->finish("Trust", e);
+            return;
+        }
+        self->connect();
+    });
 }
 
-bool bluez::operator==(const BluetoothEvent &p1, int p2) noexcept {
-    return (static_cast<BluetoothEventType>(p1) & p2) == p2;
+void BluezUtil::Setup::connect() noexcept {
+    if (is(&BluetoothDevice::connected_)) {
+        finish(nullptr, nullptr);
+        return;
+    }
+    auto self = shared_from_this();
+    step_start = g_get_monotonic_time();
+    util->call_async(result.object_path.c_str(), BLUEZ_DEVICE_IFACE, "Connect", nullptr, timeout_ms, [self](const BluezError *e) {
+        self->result.connect_us = g_get_monotonic_time() - self->step_start;
+        self->finish(e ? "Connect" : nullptr, e);
+    });
 }
 
-int bluez::BluetoothEventValue(const BluetoothEvent &event) noexcept {
-    return static_cast<BluetoothEventType>(event);
+void BluezUtil::Setup::finish(const char *step, const BluezError *e) noexcept {
+    result.ok = e == nullptr;
+    result.step = step ? step : "";
+    result.code = e ? e->code : 0;
+    result.error = e ? e->message : "";
+    // total_us holds the start time until here
+    result.total_us = g_get_monotonic_time() - result.total_us;
+    if (e) log("Setup of %s failed at %s: %s", result.object_path.c_str(), step, e->message.c_str());
+    util->connecting_changed(-1);
+    promise.set_value(result);
 }
 
-BluezError::BluezError(int code, const char *msg) noexcept : code(code), message(std::string(msg)) {}
+BluezSetupFuture BluezUtil::PairAndConnectAsync(const char *object_path, int timeout_ms) noexcept {
+    g_assert(object_path);
+    auto setup = std::make_shared<Setup>();
+    setup->util = this;
+    setup->timeout_ms = timeout_ms;
+    setup->result = BluezSetupResult{object_path, false, "", 0, "", 0, 0, 0, g_get_monotonic_time()};
+    auto future = setup->promise.get_future();
+    loop.Post([setup]() {
+        // one setup for the scan scheduler, also between the steps
+        setup->util->connecting_changed(1);
+        setup->pair();
+    });
+    return future;
+}
 
-BluezError::BluezError(const GError *error) noexcept : BluezError{error->code, error->message} {}
+// State of one ConnectAll/PairAll/DisconnectAll run, only touched on the loop thread.
+struct BluezUtil::Batch : std::enable_shared_from_this<BluezUtil::Batch> {
+    BluezUtil *util;
+    const char *method;
+    BluezBatchOptions options;
+    std::vector<BluezBatchResult> results;
+    // pending indices into results and calls in flight, per adapter
+    std::map<std::string, std::deque<size_t>> pending;
+    std::map<std::string, int> running;
+    size_t remaining;
+    std::promise<std::vector<BluezBatchResult>> promise;
 
-BluetoothDevice::BluetoothDevice(GDBusConnection *conn, const char *object_path, const char *name, const char *address) 
-    : name_(const_cast<char *>(name)), address_(const_cast<char *>(address)) {
-    g_assert(conn && object_path);
-    GError *err = nullptr;
-    proxy = g_dbus_proxy_new_sync(conn, G_DBUS_PROXY_FLAGS_NONE, nullptr, BLUEZ, object_path, BLUEZ_DEVICE_IFACE, nullptr, &err);
-    if (!proxy) {
-        log("BluetoothDevice create error: %s", err->message);
-        auto e = BluezError(err);
-        g_error_free(err);
-        throw e;
-    }
+    void pump(const std::string &adapter) noexcept;
+    void attempt(const std::string &adapter, size_t index) noexcept;
 };
 
-BluetoothDevice::BluetoothDevice(GDBusConnection *conn, const char *object_path) 
-    : BluetoothDevice{conn, object_path, nullptr, nullptr} {};
-
-BluetoothDevice::~BluetoothDevice() {
-    g_object_unref(proxy);
-    free(name_);
-    free(address_);
-};
+static bool is_transient(const BluezError *e) noexcept {
+    return e->name == "org.bluez.Error.InProgress" || e->name == "org.bluez.Error.Failed";
+}
 
-const char *BluetoothDevice::object_path() const noexcept {
-    return g_dbus_proxy_get_object_path(proxy);
+void BluezUtil::Batch::pump(const std::string &adapter) noexcept {
+    auto &queue = pending[adapter];
+    while (running[adapter] < options.concurrency && !queue.empty()) {
+        auto index = queue.front();
+        queue.pop_front();
+        attempt(adapter, index);
+    }
 }
 
-const char *BluetoothDevice::name() const noexcept {
-    if (!name_) {
-        try {
-            auto value = proxy_get_property(proxy, "Name");
-            g_variant_get(value, "s", &name_);
-            g_variant_unref(value);
-        } catch (BluezError e) {
-            return "";
+void BluezUtil::Batch::attempt(const std::string &adapter, size_t index) noexcept {
+    auto &result = results[index];
+    auto now = g_get_monotonic_time();
+    if (result.attempts++ == 0) {
+        // queued_us holds the batch start time until the first attempt
+        result.queued_us = now - result.queued_us;
+        result.elapsed_us = now;
+    }
+    running[adapter]++;
+    // the completion keeps the batch alive through the shared_ptr in the callback
+    auto self = shared_from_this();
+    util->call_async(result.object_path.c_str(), BLUEZ_DEVICE_IFACE, method, nullptr, options.timeout_ms, [self, adapter, index](const BluezError *e) {
+        auto &result = self->results[index];
+        self->running[adapter]--;
+        if (e && is_transient(e) && result.attempts <= self->options.retries) {
+            auto shift = std::min(result.attempts - 1, 16);
+            auto delay = (int)std::min<gint64>((gint64)self->options.backoff_ms << shift, self->options.max_backoff_ms);
+            log("%s %s failed (%s), retry in %d ms", self->method, result.object_path.c_str(), e->name.c_str(), delay);
+            self->util->loop.Post([self, adapter, index]() {
+                self->pending[adapter].push_front(index);
+                self->pump(adapter);
+            }, delay);
+            self->pump(adapter);
+            return;
         }
+        result.ok = e == nullptr;
+        result.code = e ? e->code : 0;
+        result.error = e ? e->message : "";
+        result.elapsed_us = g_get_monotonic_time() - result.elapsed_us;
+        if (--self->remaining == 0) {
+            self->promise.set_value(self->results);
+            return;
+        }
+        self->pump(adapter);
+    });
+}
+
+BluezBatchFuture BluezUtil::run_batch(const char *method, const std::vector<std::string> &object_paths, const BluezBatchOptions &options) noexcept {
+    auto batch = std::make_shared<Batch>();
+    batch->util = this;
+    batch->method = method;
+    batch->options = options;
+    if (batch->options.concurrency < 1) batch->options.concurrency = 1;
+    batch->remaining = object_paths.size();
+    auto start = g_get_monotonic_time();
+    for (size_t i = 0; i < object_paths.size(); i++) {
+        batch->results.push_back(BluezBatchResult{object_paths[i], false, 0, 0, "", start, 0});
+        batch->pending[adapter_of(object_paths[i])].push_back(i);
+    }
+    auto future = batch->promise.get_future();
+    if (object_paths.empty()) {
+        batch->promise.set_value({});
+        return future;
     }
-    return name_;
+    // the batch state is owned by the loop thread from here on
+    loop.Post([batch]() {
+        for (auto &queue : batch->pending) {
+            batch->pump(queue.first);
+        }
+    });
+    return future;
 }
 
-const char *BluetoothDevice::address() const noexcept {
-    if (!address_) {
-        try {
-            auto value = proxy_get_property(proxy, "Address");
-            g_variant_get(value, "s", &address_);
-            g_variant_unref(value);
-        } catch (BluezError e) {
-            return "";
+// one object path per matching address, spread over the least loaded adapters
+std::vector<std::string> BluezUtil::filter_devices(BluetoothDeviceFilter filter)  {
+    std::vector<std::string> object_paths;
+    std::map<std::string, std::vector<const BluetoothDevice *>> by_address;
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    for (auto &device : devices) {
+        if (filter(*device.second)) by_address[device.second->address_].push_back(device.second.get());
+    }
+    auto loads = adapter_loads();
+    for (auto &candidates : by_address) {
+        const BluetoothDevice *best = nullptr;
+        for (auto device : candidates.second) {
+            // a device already connected somewhere stays there
+            if (device->connected_) {
+                best = device;
+                break;
+            }
+            auto it = loads.find(device->adapter());
+            auto best_it = best ? loads.find(best->adapter()) : loads.end();
+            if (!best || (it != loads.end() && (best_it == loads.end() || it->second < best_it->second))) best = device;
         }
+        auto it = loads.find(best->adapter());
+        if (it != loads.end()) it->second++;
+        object_paths.push_back(best->path_);
     }
-    return address_;
+    return object_paths;
 }
 
-const bool BluetoothDevice::paired() const  {
-    auto value = proxy_get_property(proxy, "Paired");
-    auto paired = g_variant_get_boolean(value);
-    g_variant_unref(value);
-    return paired;
+BluezBatchFuture BluezUtil::ConnectAll(const std::vector<std::string> &object_paths, const BluezBatchOptions &options) noexcept {
+    return run_batch("Connect", object_paths, options);
 }
 
-const bool BluetoothDevice::connected() const  {
-    auto value = proxy_get_property(proxy, "Connected");
-    auto connected = g_variant_get_boolean(value);
-    g_variant_unref(value);
-    return connected;
+BluezBatchFuture BluezUtil::ConnectAll(BluetoothDeviceFilter filter, const BluezBatchOptions &options)  {
+    return run_batch("Connect", filter_devices(filter), options);
 }
 
-BluetoothEvent BluetoothDevice::state() const  {
-    return connected() ? BluetoothEvent::EV_DEVICE_CONNECTED : paired() ? BluetoothEvent::EV_DEVICE_PAIRED : BluetoothEvent::EV_NONE;
+BluezBatchFuture BluezUtil::DisconnectAll(const std::vector<std::string> &object_paths, const BluezBatchOptions &options) noexcept {
+    return run_batch("Disconnect", object_paths, options);
 }
 
-void BluetoothDevice::Connect()  {
-    auto value = proxy_call(proxy, "Connect");
-    g_variant_unref(value);
+BluezBatchFuture BluezUtil::DisconnectAll(BluetoothDeviceFilter filter, const BluezBatchOptions &options)  {
+    return run_batch("Disconnect", filter_devices(filter), options);
 }
 
-void BluetoothDevice::Disconnect()  {
-    auto value = proxy_call(proxy, "Disconnect");
-    g_variant_unref(value);
+BluezBatchFuture BluezUtil::PairAll(const std::vector<std::string> &object_paths, const BluezBatchOptions &options) noexcept {
+    return run_batch("Pair", object_paths, options);
 }
 
-void BluetoothDevice::Pair()  {
-    auto value = proxy_call(proxy, "Pair");
-    g_variant_unref(value);
+BluezBatchFuture BluezUtil::PairAll(BluetoothDeviceFilter filter, const BluezBatchOptions &options)  {
+    return run_batch("Pair", filter_devices(filter), options);
 }
 
-std::string BluetoothDevice::to_string()  {
-    std::ostringstream ostr;
-    ostr << "Name\t\t: " << name() << "\nAddress\t\t: " << address()
-         << "\nPath\t\t: " << object_path()
-         << "\nPaired\t\t: " << std::boolalpha << paired()
-         << "\nConnected\t: " << std::boolalpha << connected() << std::endl;
-    return ostr.str();
+GVariant *BluezUtil::Scan::filter_dict(bool clear) const noexcept {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    auto &filter = options.filter;
+    if (!clear) {
+        if (!filter.transport.empty()) g_variant_builder_add(&builder, "{sv}", "Transport", g_variant_new_string(filter.transport.c_str()));
+        if (filter.rssi) g_variant_builder_add(&builder, "{sv}", "RSSI", g_variant_new_int16(filter.rssi));
+        if (!filter.uuids.empty()) {
+            std::vector<const gchar *> uuids;
+            for (auto &uuid : filter.uuids) uuids.push_back(uuid.c_str());
+            g_variant_builder_add(&builder, "{sv}", "UUIDs", g_variant_new_strv(uuids.data(), uuids.size()));
+        }
+        if (!filter.pattern.empty()) g_variant_builder_add(&builder, "{sv}", "Pattern", g_variant_new_string(filter.pattern.c_str()));
+    }
+    return g_variant_new("(@a{sv})", g_variant_builder_end(&builder));
 }
 
-BluezUtil::BluezUtil()  {
-    GError *err = nullptr;
-    conn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, nullptr, &err);
-    if (!conn) {
-        log("Get system bus error: %s", err->message);
-        auto e = BluezError(err);
-        g_error_free(err);
-        throw e;
+bool BluezUtil::Scan::wanted(const BluetoothDevice &device) const noexcept {
+    auto &names = options.filter.names;
+    return names.empty() || std::find(names.begin(), names.end(), device.name_) != names.end();
+}
+
+// a device without a name yet may resolve to a wanted one
+bool BluezUtil::Scan::admits(const BluetoothDevice &device) const noexcept {
+    return device.name_.empty() || wanted(device);
+}
+
+void BluezUtil::Scan::begin() noexcept {
+    for (auto &adapter : adapters) {
+        util->call_async(adapter.c_str(), BLUEZ_ADAPTER_IFACE, "SetDiscoveryFilter", filter_dict(false), -1, nullptr);
     }
-    object_manager = g_dbus_proxy_new_sync(conn, G_DBUS_PROXY_FLAGS_NONE, nullptr, BLUEZ, "/", BLUEZ_MANAGER_IFACE, nullptr, &err);
-    if (!object_manager) {
-        log("Get 'ObjectManager' error: %s", err->message);
-        auto e = BluezError(err);
-        g_error_free(err);
-        throw e;
+    auto self = shared_from_this();
+    if (options.timeout_ms > 0) {
+        deadline_source = util->loop.Post([self]() {
+            self->deadline_source = 0;
+            self->finish("deadline");
+        }, options.timeout_ms);
     }
-    adapter_proxy = g_dbus_proxy_new_sync(conn, G_DBUS_PROXY_FLAGS_NONE, nullptr, BLUEZ, BLUEZ_ADAPTER_OBJ, BLUEZ_ADAPTER_IFACE, nullptr, &err);
-    if (!adapter_proxy) {
-        log("Get 'Adapter1' error: %s", err->message);
-        auto e = BluezError(err);
-        g_error_free(err);
-        throw e;
+    open_window();
+}
+
+void BluezUtil::Scan::open_window() noexcept {
+    window_source = 0;
+    in_window = true;
+    result.windows++;
+    update();
+    if (options.window_ms <= 0 || options.window_ms >= options.interval_ms) return;
+    auto self = shared_from_this();
+    window_source = util->loop.Post([self]() { self->close_window(); }, options.window_ms);
+}
+
+void BluezUtil::Scan::close_window() noexcept {
+    in_window = false;
+    update();
+    auto self = shared_from_this();
+    window_source = util->loop.Post([self]() { self->open_window(); }, options.interval_ms - options.window_ms);
+}
+
+// turns discovery on or off to match the window and the connections in flight
+void BluezUtil::Scan::update() noexcept {
+    auto paused = options.pause_while_connecting && util->connecting > 0;
+    auto want = !done && in_window && !paused;
+    if (want == scanning) return;
+    scanning = want;
+    auto now = g_get_monotonic_time();
+    if (want) {
+        scanning_since_us = now;
+    } else {
+        result.scan_us += now - scanning_since_us;
+    }
+    for (auto &adapter : adapters) {
+        util->call_async(adapter.c_str(), BLUEZ_ADAPTER_IFACE, want ? "StartDiscovery" : "StopDiscovery", nullptr, -1, nullptr);
     }
-    adapter_handle = g_dbus_connection_signal_subscribe(conn, BLUEZ, BLUEZ_PROPERTY_IFACE, "PropertiesChanged", nullptr, BLUEZ_ADAPTER_IFACE, G_DBUS_SIGNAL_FLAGS_NONE, adapter_callback, this, nullptr);
-    device_handle = g_dbus_connection_signal_subscribe(conn, BLUEZ, BLUEZ_PROPERTY_IFACE, "PropertiesChanged", nullptr, BLUEZ_DEVICE_IFACE, G_DBUS_SIGNAL_FLAGS_NONE, device_callback, this, nullptr);
-    iface_added_handle = g_dbus_connection_signal_subscribe(conn, BLUEZ, BLUEZ_MANAGER_IFACE, "InterfacesAdded", nullptr, nullptr, G_DBUS_SIGNAL_FLAGS_NONE, iface_added_callback, this, nullptr);
-    iface_removed_handle = g_dbus_connection_signal_subscribe(conn, BLUEZ, BLUEZ_MANAGER_IFACE, "InterfacesRemoved", nullptr, nullptr, G_DBUS_SIGNAL_FLAGS_NONE, iface_removed_callback, this, nullptr);
-    loop = g_main_loop_new(nullptr, false);
-    std::thread(
-        [this]() {
-            std::unique_lock<std::mutex> _1;
-            if (loop == nullptr)
-                return;
-            log("%s", "g_main_loop running");
-            g_main_loop_run(loop);
-            log("%s", "g_main_loop exit");
-        })
-        .detach();
 }
 
-BluezUtil::~BluezUtil() {
-    log("%s", "~BluezUtil");
-    g_dbus_connection_signal_unsubscribe(conn, adapter_handle);
-    g_dbus_connection_signal_unsubscribe(conn, device_handle);
-    g_dbus_connection_signal_unsubscribe(conn, iface_added_handle);
-    g_dbus_connection_signal_unsubscribe(conn, iface_removed_handle);
+void BluezUtil::Scan::seen(const char *object_path, const BluetoothDevice &device) noexcept {
+    if (done || !scanning || !wanted(device) || !matched.insert(object_path).second) return;
+    result.matches.emplace_back(object_path);
+    if (options.max_matches > 0 && (int)result.matches.size() >= options.max_matches) finish("matches");
+}
+
+void BluezUtil::Scan::finish(const char *reason) noexcept {
+    if (done) return;
+    done = true;
+    if (window_source) util->loop.Cancel(window_source);
+    if (deadline_source) util->loop.Cancel(deadline_source);
+    window_source = deadline_source = 0;
+    update();
+    for (auto &adapter : adapters) {
+        util->call_async(adapter.c_str(), BLUEZ_ADAPTER_IFACE, "SetDiscoveryFilter", filter_dict(true), -1, nullptr);
+    }
+    result.reason = reason;
+    result.total_us = g_get_monotonic_time() - start_us;
+    promise.set_value(result);
+    // after a replacing scan took over, which filters on its own
+    auto util = this->util;
+    util->loop.Post([util]() { util->readmit(); });
+    // may drop the last reference to this
+    if (util->scan.get() == this) util->scan.reset();
+}
+
+BluezScanFuture BluezUtil::StartScan(const BluezScanOptions &options) noexcept {
+    auto scan = std::make_shared<Scan>();
+    scan->util = this;
+    scan->options = options;
+    scan->adapters = options.adapters.empty() ? powered_adapters() : options.adapters;
+    scan->result = BluezScanResult{{}, "", 0, 0, 0};
+    scan->start_us = g_get_monotonic_time();
+    scan->in_window = scan->scanning = scan->done = false;
+    scan->scanning_since_us = 0;
+    scan->window_source = scan->deadline_source = 0;
+    auto future = scan->promise.get_future();
+    loop.Post([this, scan]() {
+        if (this->scan) this->scan->finish("replaced");
+        this->scan = scan;
+        scan->begin();
+    });
+    return future;
+}
+
+void BluezUtil::StopScan() noexcept {
+    loop.Post([this]() {
+        if (scan) scan->finish("stopped");
+    });
+}
+
+BluetoothDevice *BluezUtil::recheck(const char *object_path, MessageReader &reader) noexcept {
+    auto it = rejected.find(object_path);
+    if (it == rejected.end()) return nullptr;
+    auto &device = *it->second;
+    PropertyDelta delta;
+    while (reader.NextProperty(delta)) device.apply(delta);
+    device.last_seen_ = g_get_real_time();
+    if (scan && !scan->admits(device)) return nullptr;
+    auto &entry = devices[it->first];
+    entry = std::move(it->second);
+    rejected.erase(it);
+    return entry.get();
+}
+
+void BluezUtil::readmit() noexcept {
+    std::vector<std::pair<std::string, BluetoothDevice *>> found;
     {
-        std::unique_lock<std::mutex> _1;
-        if (g_main_loop_is_running(loop)) {
-            g_main_loop_quit(loop);
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        for (auto it = rejected.begin(); it != rejected.end();) {
+            if (scan && !scan->admits(*it->second)) {
+                ++it;
+                continue;
+            }
+            auto &entry = devices[it->first];
+            entry = std::move(it->second);
+            found.emplace_back(it->first, entry.get());
+            it = rejected.erase(it);
         }
-        g_main_loop_unref(loop);
-        loop = nullptr;
     }
-    g_object_unref(conn);
-    g_object_unref(object_manager);
-    g_object_unref(adapter_proxy);
+    // the registry entries are only modified on this thread
+    for (auto &device : found) {
+        emit(BluetoothEvent::EV_DEVICE_FOUND, device.first.c_str(), device.second);
+    }
 }
 
-BluetoothEvent BluezUtil::GetAdapterState()  {
-    GVariant *value = nullptr;
-    value = proxy_get_property(adapter_proxy, "Discovering");
-    auto discovering = g_variant_get_boolean(value);
-    g_variant_unref(value);
+// loop thread only
+void BluezUtil::connecting_changed(int delta) noexcept {
+    connecting += delta;
+    if (scan) scan->update();
+}
 
-    value = proxy_get_property(adapter_proxy, "Powered");
-    auto powered = g_variant_get_boolean(value);
-    g_variant_unref(value);
-    return discovering ? BluetoothEvent::EV_ADAPTER_DISCOVERY_ON : powered ? BluetoothEvent::EV_ADAPTER_ON : BluetoothEvent::EV_NONE;
+void BluezUtil::Supervisor::add(const std::string &object_path, bool connected) noexcept {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto inserted = wanted.emplace(object_path, Wanted{BluezReconnectStats{object_path, connected, false, 0, 0, 0, {}}, 0, 0, false});
+    auto &w = inserted.first->second;
+    w.stats.connected = connected;
+    w.stats.given_up = false;
+    if (connected || w.in_flight || w.retry_source) return;
+    // not connected when it was asked for, counts as an outage
+    w.stats.failures = 0;
+    if (!w.down_since_us) w.down_since_us = g_get_monotonic_time();
+    lock.unlock();
+    request(object_path);
 }
 
-std::list<BluetoothDeviceRef> BluezUtil::GetDevices()  {
-    std::list<BluetoothDeviceRef> devices;
-    GVariant *result;
-    GVariantIter *iter;
-    GVariantIter *v_iter;
-    gchar *object_path;
-    result = proxy_call(object_manager, "GetManagedObjects");
-    g_variant_get(result, "(a{oa{sa{sv}}})", &iter);
-    while (g_variant_iter_next(iter, "{oa{sa{sv}}}", &object_path, &v_iter)) {
-        //log("path = %s", object_path);
-        if (strncmp(object_path, TARGET_PATH, strlen(TARGET_PATH)) == 0) {
-            gchar *key;
-            GVariantIter *vv_iter;
-            while (g_variant_iter_next(v_iter, "{sa{sv}}", &key, &vv_iter)) {
-                //log("-- key = %s", key);
-                auto ready = strcmp(key, TARGET_DEVICE) == 0;
-                if (ready) {
-                    gchar *attr;
-                    GVariant *value;
-                    auto device = new BluetoothDevice(conn, object_path);
-                    while (g_variant_iter_next(vv_iter, "{sv}", &attr, &value)) {
-                        //log("---- attr = %s, type = %s", attr, g_variant_get_type_string(value));
-                        if (strcmp(attr, "Name") == 0) {
-                            g_variant_get(value, "s", &device->name_);
-                        } else if (strcmp(attr, "Address") == 0) {
-                            g_variant_get(value, "s", &device->address_);
-                        }
-                        g_free(attr);
-                        g_variant_unref(value);
-                        if (device->name_ && device->address_) break;
+void BluezUtil::Supervisor::remove(const std::string &object_path) noexcept {
+    std::lock_guard<std::mutex> _1(mutex);
+    auto it = wanted.find(object_path);
+    if (it == wanted.end()) return;
+    if (it->second.retry_source) util->loop.Cancel(it->second.retry_source);
+    queue.erase(std::remove(queue.begin(), queue.end(), object_path), queue.end());
+    // an attempt in flight completes into nothing
+    wanted.erase(it);
+}
+
+void BluezUtil::Supervisor::recovered(Wanted &w) noexcept {
+    if (w.down_since_us) histogram_record(w.stats.recovery, g_get_monotonic_time() - w.down_since_us);
+    w.down_since_us = 0;
+    w.stats.failures = 0;
+    w.stats.given_up = false;
+}
+
+// Connected changed in the registry
+void BluezUtil::Supervisor::connected(const std::string &object_path, bool connected) noexcept {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = wanted.find(object_path);
+    if (it == wanted.end()) return;
+    auto &w = it->second;
+    w.stats.connected = connected;
+    if (connected) {
+        // back, through our attempt or on its own
+        recovered(w);
+        if (w.retry_source) util->loop.Cancel(w.retry_source);
+        w.retry_source = 0;
+        queue.erase(std::remove(queue.begin(), queue.end(), object_path), queue.end());
+        return;
+    }
+    if (w.down_since_us) return;
+    w.stats.drops++;
+    w.stats.failures = 0;
+    w.down_since_us = g_get_monotonic_time();
+    if (w.in_flight || w.retry_source) return;
+    lock.unlock();
+    // the fast path, no delay before the first attempt
+    request(object_path);
+}
+
+void BluezUtil::Supervisor::request(const std::string &object_path) noexcept {
+    {
+        std::lock_guard<std::mutex> _1(mutex);
+        if (std::find(queue.begin(), queue.end(), object_path) == queue.end()) queue.push_back(object_path);
+    }
+    pump();
+}
+
+void BluezUtil::Supervisor::pump() noexcept {
+    while (true) {
+        std::string object_path;
+        {
+            std::lock_guard<std::mutex> _1(mutex);
+            if (running >= options.concurrency || queue.empty()) return;
+            object_path = queue.front();
+            queue.pop_front();
+        }
+        attempt(object_path);
+    }
+}
+
+void BluezUtil::Supervisor::attempt(const std::string &object_path) noexcept {
+    {
+        std::lock_guard<std::mutex> _1(mutex);
+        auto it = wanted.find(object_path);
+        if (it == wanted.end() || it->second.in_flight || it->second.stats.connected) return;
+        it->second.in_flight = true;
+        it->second.stats.attempts++;
+        running++;
+    }
+    util->call_async(object_path.c_str(), BLUEZ_DEVICE_IFACE, "Connect", nullptr, options.timeout_ms, [this, object_path](const BluezError *e) {
+        completed(object_path, e);
+    });
+}
+
+void BluezUtil::Supervisor::completed(const std::string &object_path, const BluezError *e) noexcept {
+    {
+        std::lock_guard<std::mutex> _1(mutex);
+        running--;
+        auto it = wanted.find(object_path);
+        if (it != wanted.end()) {
+            auto &w = it->second;
+            w.in_flight = false;
+            if (!e || e->name == "org.bluez.Error.AlreadyConnected") {
+                // Connected=true may still be on its way
+                w.stats.connected = true;
+                recovered(w);
+            } else if (options.max_failures > 0 && ++w.stats.failures >= options.max_failures) {
+                w.stats.given_up = true;
+                log("Reconnect %s: given up after %d failures (%s)", object_path.c_str(), w.stats.failures, e->name.c_str());
+            } else {
+                if (options.max_failures <= 0) w.stats.failures++;
+                auto shift = std::min(w.stats.failures - 1, 16);
+                auto delay = std::min<gint64>((gint64)options.backoff_ms << shift, options.max_backoff_ms);
+                delay -= (gint64)(delay * options.jitter * g_random_double());
+                w.retry_source = util->loop.Post([this, object_path]() {
+                    {
+                        std::lock_guard<std::mutex> _1(mutex);
+                        auto it = wanted.find(object_path);
+                        if (it == wanted.end()) return;
+                        it->second.retry_source = 0;
                     }
-                    devices.emplace_back(device);
-                }
-                g_variant_iter_free(vv_iter);
-                g_free(key);
-                if (ready) break;
+                    request(object_path);
+                }, std::max<gint64>(delay, 1));
             }
         }
-        g_variant_iter_free(v_iter);
-        g_free(object_path);
     }
-    g_variant_iter_free(iter);
-    g_variant_unref(result);
-    return devices;
+    pump();
 }
 
-void BluezUtil::StartDiscovery()  {
-    auto result = proxy_call(adapter_proxy, "StartDiscovery");
-    g_variant_unref(result);
+void BluezUtil::Supervisor::suspend() noexcept {
+    std::lock_guard<std::mutex> _1(mutex);
+    auto now = g_get_monotonic_time();
+    queue.clear();
+    for (auto &it : wanted) {
+        auto &w = it.second;
+        if (w.retry_source) util->loop.Cancel(w.retry_source);
+        w.retry_source = 0;
+        if (w.stats.connected) w.stats.drops++;
+        w.stats.connected = false;
+        if (!w.down_since_us) w.down_since_us = now;
+    }
 }
 
-void BluezUtil::StopDiscovery()  {
-    auto result = proxy_call(adapter_proxy, "StopDiscovery");
-    g_variant_unref(result);
+void BluezUtil::Supervisor::resume() noexcept {
+    std::vector<std::string> down;
+    {
+        std::lock_guard<std::mutex> _1(util->devices_mutex);
+        std::lock_guard<std::mutex> _2(mutex);
+        for (auto &it : wanted) {
+            auto device = util->find_device(it.first.c_str(), false);
+            auto &w = it.second;
+            if (device && device->connected_) {
+                w.stats.connected = true;
+                recovered(w);
+            } else if (!w.in_flight && !w.retry_source && !w.stats.given_up) {
+                w.stats.failures = 0;
+                down.push_back(it.first);
+            }
+        }
+    }
+    for (auto &object_path : down) {
+        request(object_path);
+    }
 }
 
-void BluezUtil::RegisterListener(BluetoothEventCallback callback) noexcept {
-    this->callback = callback;
+void BluezUtil::Supervise(const char *object_path) noexcept {
+    g_assert(object_path);
+    std::string path(object_path);
+    loop.Post([this, path]() {
+        bool connected;
+        {
+            std::lock_guard<std::mutex> _1(devices_mutex);
+            auto device = find_device(path.c_str(), false);
+            connected = device && device->connected_;
+        }
+        supervisor->add(path, connected);
+    });
 }
 
-void BluezUtil::Connect(const char *object_path)  {
+void BluezUtil::Unsupervise(const char *object_path) noexcept {
     g_assert(object_path);
-    BluetoothDevice device(conn, object_path);
-    return device.Connect();
+    std::string path(object_path);
+    loop.Post([this, path]() { supervisor->remove(path); });
 }
 
-void BluezUtil::Disconnect(const char *object_path)  {
+std::vector<BluezReconnectStats> BluezUtil::GetReconnectStats()  {
+    std::vector<BluezReconnectStats> list;
+    std::lock_guard<std::mutex> _1(supervisor->mutex);
+    for (auto &w : supervisor->wanted) {
+        list.push_back(w.second.stats);
+        if (list.back().recovery.buckets.empty()) list.back().recovery.buckets.resize(HISTOGRAM_BUCKETS);
+    }
+    return list;
+}
+
+bool BluezUtil::GetLinkStats(const char *object_path, BluezLinkStats &stats, bool history) noexcept {
     g_assert(object_path);
-    BluetoothDevice device(conn, object_path);
-    return device.Disconnect();
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    return telemetry && telemetry->Get(object_path, stats, history);
 }
 
-void BluezUtil::Pair(const char *object_path)  {
+BluetoothEvent BluezUtil::GetDeviceState(const char *object_path, BluezConnectPhases *phases) noexcept {
     g_assert(object_path);
-    BluetoothDevice device(conn, object_path);
-    return device.Pair();
+    std::lock_guard<std::mutex> _1(devices_mutex);
+    auto device = find_device(object_path, false);
+    if (!device) return BluetoothEvent::EV_NONE;
+    if (phases) *phases = device->phases_;
+    return device->state();
+}
+
+std::vector<BluezLinkStats> BluezUtil::GetLinkStats(bool history) noexcept {
+    std::vector<BluezLinkStats> list;
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        if (telemetry) list = telemetry->GetAll(history);
+    }
+    std::sort(list.begin(), list.end(), [](const BluezLinkStats &a, const BluezLinkStats &b) { return a.last.rssi > b.last.rssi; });
+    return list;
+}
+
+static const char *AGENT_INTROSPECTION =
+    "<node>"
+    "  <interface name='org.bluez.Agent1'>"
+    "    <method name='Release'/>"
+    "    <method name='RequestPinCode'><arg type='o' direction='in'/><arg type='s' direction='out'/></method>"
+    "    <method name='DisplayPinCode'><arg type='o' direction='in'/><arg type='s' direction='in'/></method>"
+    "    <method name='RequestPasskey'><arg type='o' direction='in'/><arg type='u' direction='out'/></method>"
+    "    <method name='DisplayPasskey'><arg type='o' direction='in'/><arg type='u' direction='in'/><arg type='q' direction='in'/></method>"
+    "    <method name='RequestConfirmation'><arg type='o' direction='in'/><arg type='u' direction='in'/></method>"
+    "    <method name='RequestAuthorization'><arg type='o' direction='in'/></method>"
+    "    <method name='AuthorizeService'><arg type='o' direction='in'/><arg type='s' direction='in'/></method>"
+    "    <method name='Cancel'/>"
+    "  </interface>"
+    "</node>";
+
+static const char *agent_capability(AgentCapability capability) noexcept {
+    switch (capability) {
+    case AgentCapability::DISPLAY_ONLY:
+        return "DisplayOnly";
+    case AgentCapability::DISPLAY_YES_NO:
+        return "DisplayYesNo";
+    case AgentCapability::KEYBOARD_ONLY:
+        return "KeyboardOnly";
+    case AgentCapability::KEYBOARD_DISPLAY:
+        return "KeyboardDisplay";
+    default:
+        return "NoInputNoOutput";
+    }
+}
+
+// Exports Agent1 inside the loop context, so agent requests are dispatched
+// there. It stays exported across bluetoothd restarts.
+void BluezUtil::export_agent() noexcept {
+    static std::atomic<int> instances{0};
+    if (agent_options.capability == AgentCapability::NONE) return;
+    GError *err = nullptr;
+    auto info = g_dbus_node_info_new_for_xml(AGENT_INTROSPECTION, nullptr);
+    static const GDBusInterfaceVTable vtable = {agent_method_call, nullptr, nullptr, {}};
+    agent_path = "/bluez_util/agent" + std::to_string(instances++);
+    agent_registration = g_dbus_connection_register_object(conn, agent_path.c_str(), g_dbus_node_info_lookup_interface(info, BLUEZ_AGENT_IFACE), &vtable, this, nullptr, &err);
+    g_dbus_node_info_unref(info);
+    if (!agent_registration) {
+        log("Export agent error: %s", err->message);
+        g_error_free(err);
+    }
+}
+
+static void agent_registered(GObject *source, GAsyncResult *res, gpointer user_data) {
+    GError *err = nullptr;
+    auto result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &err);
+    if (!result) {
+        log("Register agent error: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+    g_variant_unref(result);
+}
+
+// Registers the exported agent with the current bluetoothd. Both calls are
+// queued without waiting, bluetoothd handles them in order before anything
+// sent later on this connection.
+void BluezUtil::register_agent() noexcept {
+    // without an agent Pair() still works through another process' agent
+    if (!agent_registration) return;
+    g_dbus_connection_call(conn, BLUEZ, BLUEZ_AGENT_MANAGER_OBJ, BLUEZ_AGENT_MANAGER_IFACE, "RegisterAgent",
+                           g_variant_new("(os)", agent_path.c_str(), agent_capability(agent_options.capability)),
+                           nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, agent_registered, nullptr);
+    if (!agent_options.default_agent) return;
+    g_dbus_connection_call(conn, BLUEZ, BLUEZ_AGENT_MANAGER_OBJ, BLUEZ_AGENT_MANAGER_IFACE, "RequestDefaultAgent",
+                           g_variant_new("(o)", agent_path.c_str()), nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr,
+                           agent_registered, nullptr);
+}
+
+void BluezUtil::unregister_agent() noexcept {
+    if (!agent_registration) return;
+    auto result = g_dbus_connection_call_sync(conn, BLUEZ, BLUEZ_AGENT_MANAGER_OBJ, BLUEZ_AGENT_MANAGER_IFACE, "UnregisterAgent",
+                                              g_variant_new("(o)", agent_path.c_str()), nullptr, G_DBUS_CALL_FLAGS_NONE, SHUTDOWN_CALL_TIMEOUT_MS,
+                                              nullptr, nullptr);
+    if (result) g_variant_unref(result);
+    g_dbus_connection_unregister_object(conn, agent_registration);
+    agent_registration = 0;
+}
+
+bool BluezUtil::agent_approves(const char *object_path) noexcept {
+    std::unique_ptr<BluetoothDevice> device;
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        auto current = find_device(object_path, false);
+        if (!current) return false;
+        // the policy may call back in, so it gets a copy outside the lock
+        device.reset(new BluetoothDevice(*current));
+    }
+    if (agent_options.policy) return agent_options.policy(*device);
+    return g_str_has_prefix(device->name(), "Joy-Con") || g_str_has_prefix(device->name(), "Pro Controller");
+}
+
+void BluezUtil::agent_method_call(GDBusConnection *connection, const gchar *sender, const gchar *object_path, const gchar *interface_name, const gchar *method_name, GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data) noexcept {
+    auto util = reinterpret_cast<BluezUtil *>(user_data);
+    if (strcmp(method_name, "Release") == 0 || strcmp(method_name, "Cancel") == 0) {
+        log("Agent %s", method_name);
+        g_dbus_method_invocation_return_value(invocation, nullptr);
+        return;
+    }
+    const gchar *device_path;
+    g_variant_get_child(parameters, 0, "&o", &device_path);
+    if (!util->agent_approves(device_path)) {
+        log("Agent rejected %s for %s", method_name, device_path);
+        g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.Rejected", "Rejected by policy");
+        return;
+    }
+    GVariant *reply = nullptr;
+    if (strcmp(method_name, "RequestPinCode") == 0) {
+        reply = g_variant_new("(s)", util->agent_options.pin_code.c_str());
+    } else if (strcmp(method_name, "RequestPasskey") == 0) {
+        reply = g_variant_new("(u)", util->agent_options.passkey);
+    }
+    if (g_str_has_prefix(method_name, "Request")) {
+        // the registry entry is only modified on this thread
+        BluetoothDevice *device;
+        bool ours;
+        {
+            std::lock_guard<std::mutex> _1(util->devices_mutex);
+            device = util->find_device(device_path, false);
+            // our Pair announced it already
+            ours = device && device->transition_ == BluetoothEvent::EV_DEVICE_PAIRING;
+        }
+        if (!ours) util->emit(BluetoothEvent::EV_DEVICE_PAIRING, device_path, device);
+    }
+    g_dbus_method_invocation_return_value(invocation, reply);
+}
+
+void BluezUtil::record(SignalKind kind, const char *object_path, GVariant *parameters) noexcept {
+    std::lock_guard<std::mutex> _1(recorder_mutex);
+    if (recorder) recorder->Write(kind, object_path, parameters);
+}
+
+void BluezUtil::StartRecording(const char *path)  {
+    // the log stores the GVariant form of the signals
+    if (transport_type != BluezTransportType::GDBUS) throw BluezError(-1, "Recording needs the GDBus transport");
+    auto file = fopen(path, "wb");
+    if (!file) throw BluezError(errno, (std::string(path) + ": " + strerror(errno)).c_str());
+    std::unique_ptr<SignalRecorder> started(new SignalRecorder(file));
+    // replaying starts from the same devices
+    if (!loop.IsLoopThread()) connected_.wait();
+    if (conn) {
+        auto objects = connection_call(conn, "/", BLUEZ_MANAGER_IFACE, "GetManagedObjects");
+        started->Write(SignalKind::OBJECTS, "/", objects);
+        g_variant_unref(objects);
+    }
+    std::lock_guard<std::mutex> _1(recorder_mutex);
+    recorder = std::move(started);
+    recording = true;
+}
+
+void BluezUtil::StopRecording() noexcept {
+    std::lock_guard<std::mutex> _1(recorder_mutex);
+    recording = false;
+    recorder.reset();
+}
+
+#define REPLAY_BATCH 256
+
+// A log being fed to the handlers, only touched on the loop thread.
+struct BluezUtil::Replayer : std::enable_shared_from_this<BluezUtil::Replayer> {
+    struct Signal {
+        gint64 timestamp_us;
+        SignalKind kind;
+        std::string path;
+        std::string iface;
+        std::string member;
+        GVariant *parameters;
+    };
+    BluezUtil *util;
+    BluezReplayOptions options;
+    std::vector<Signal> signals;
+    size_t next;
+    gint64 started_us;
+    std::promise<BluezReplayResult> promise;
+
+    ~Replayer() {
+        for (auto &signal : signals)
+            g_variant_unref(signal.parameters);
+    }
+    void load(const char *path) ;
+    void step() noexcept;
+    void dispatch(const Signal &signal) noexcept;
+};
+
+void BluezUtil::Replayer::load(const char *path)  {
+    gchar *contents = nullptr;
+    gsize length = 0;
+    GError *err = nullptr;
+    if (!g_file_get_contents(path, &contents, &length, &err)) {
+        auto e = BluezError(err);
+        g_error_free(err);
+        throw e;
+    }
+    guint32 version = 0;
+    if (length >= 12) memcpy(&version, contents + 8, sizeof(version));
+    if (length < 12 || memcmp(contents, SIGNAL_LOG_MAGIC, 8) != 0 || version != SIGNAL_LOG_VERSION) {
+        g_free(contents);
+        throw BluezError(-1, (std::string(path) + ": not a signal log").c_str());
+    }
+    size_t offset = 12;
+    SignalLogRecord record;
+    while (offset + sizeof(record) <= length) {
+        memcpy(&record, contents + offset, sizeof(record));
+        auto names = contents + offset + sizeof(record);
+        size_t name_bytes = record.path_length + record.iface_length + record.member_length;
+        // a log cut short by a crash ends at the last complete record
+        if (offset + sizeof(record) + name_bytes + record.size > length || record.kind > (guint8)SignalKind::OBJECTS) break;
+        auto data = g_malloc(record.size);
+        memcpy(data, names + name_bytes, record.size);
+        auto parameters = g_variant_new_from_data(G_VARIANT_TYPE(SIGNAL_TYPES[record.kind]), data, record.size, false, g_free, data);
+        signals.push_back(Signal{record.timestamp_us, (SignalKind)record.kind, std::string(names, record.path_length),
+                                 std::string(names + record.path_length, record.iface_length),
+                                 std::string(names + record.path_length + record.iface_length, record.member_length),
+                                 g_variant_ref_sink(parameters)});
+        offset += sizeof(record) + name_bytes + record.size;
+    }
+    g_free(contents);
+}
+
+// Dispatches until the next signal is due, or a batch is done so that the
+// loop gets to run other sources in between.
+void BluezUtil::Replayer::step() noexcept {
+    auto self = shared_from_this();
+    auto first_us = signals.empty() ? 0 : signals.front().timestamp_us;
+    for (int batch = 0; next < signals.size(); batch++) {
+        auto &signal = signals[next];
+        if (options.realtime) {
+            auto due = started_us + (gint64)((signal.timestamp_us - first_us) / options.speed);
+            auto wait = due - g_get_monotonic_time();
+            if (wait > 0) {
+                util->loop.Post([self]() { self->step(); }, (int)((wait + 999) / 1000));
+                return;
+            }
+        } else if (batch == REPLAY_BATCH) {
+            util->loop.Post([self]() { self->step(); });
+            return;
+        }
+        dispatch(signal);
+        next++;
+    }
+    auto recorded = signals.empty() ? 0 : signals.back().timestamp_us - first_us;
+    promise.set_value(BluezReplayResult{signals.size(), recorded, g_get_monotonic_time() - started_us});
+}
+
+void BluezUtil::Replayer::dispatch(const Signal &signal) noexcept {
+    GVariantReader reader(signal.kind, signal.parameters, signal.path.c_str());
+    util->on_signal(signal.kind, signal.path.c_str(), reader, signal.parameters);
+}
+
+void BluezUtil::on_signal(SignalKind kind, const char *object_path, MessageReader &reader, GVariant *parameters) noexcept {
+    if (recording && parameters) record(kind, object_path, parameters);
+    switch (kind) {
+    case SignalKind::ADAPTER_CHANGED:
+        adapter_changed(reader);
+        break;
+    case SignalKind::DEVICE_CHANGED:
+        device_changed(reader);
+        break;
+    case SignalKind::INTERFACES_ADDED:
+        interfaces_added(reader);
+        break;
+    case SignalKind::INTERFACES_REMOVED:
+        interfaces_removed(reader);
+        break;
+    case SignalKind::OBJECTS:
+        apply_objects(reader, true);
+        break;
+    }
+}
+
+BluezReplayFuture BluezUtil::Replay(const char *path, const BluezReplayOptions &options)  {
+    auto replayer = std::make_shared<Replayer>();
+    replayer->util = this;
+    replayer->options = options;
+    if (replayer->options.speed <= 0) replayer->options.speed = 1.0;
+    replayer->next = 0;
+    replayer->load(path);
+    auto future = replayer->promise.get_future();
+    loop.Post([replayer]() {
+        replayer->started_us = g_get_monotonic_time();
+        replayer->step();
+    });
+    return future;
 }
 
 /*
@@ -300,41 +3639,55 @@ void BluezUtil::Pair(const char *object_path)  {
 ** Message: 15:19:04.532: Discovering : type(b)
 ** Message: 15:19:04.532: Discovering : 1
 */
-void BluezUtil::adapter_callback(GDBusConnection *connection, const gchar *sender_name, const gchar *object_path, const gchar *interface_name, const gchar *signal_name, GVariant *parameters, gpointer user_data) noexcept {
-    //log("adapter_callback path = %s, interface = %s, signal = %s, %s", object_path, interface_name, signal_name, g_variant_get_type_string(parameters));
-    auto util = reinterpret_cast<BluezUtil *>(user_data);
-    if (!util->callback) return;
+void BluezUtil::adapter_changed(MessageReader &reader) noexcept {
+    SignalTimer timer("PropertiesChanged " BLUEZ_ADAPTER_IFACE);
 
-    gchar *str, *key;
-    GVariant *value;
-    GVariantIter *iter1, *iter2;
-    g_variant_get(parameters, "(sa{sv}as)", &str, &iter1, &iter2);
+    const gchar *object_path, *str;
+    BluetoothEvent events[8];
+    int n_events = 0;
+    // a dict may repeat a key, never overrun events
+    auto push = [&](BluetoothEvent event) {
+        if (n_events < (int)G_N_ELEMENTS(events)) events[n_events++] = event;
+    };
+    bool renamed = false;
+    if (!reader.NextObject(object_path) || !reader.NextInterface(str)) return;
     //log("str = %s", str);
-    while (g_variant_iter_next(iter1, "{sv}", &key, &value)) {
-        //log("%s : type(%s)", key, g_variant_get_type_string(value));
-        if (strcmp(key, "Discovering") == 0) {
-            // discovery begin
-            auto v = g_variant_get_boolean(value);
-            //log("%s : %u", key, v);
-            if (v)
-                util->callback(BluetoothEvent::EV_ADAPTER_DISCOVERY_ON, nullptr);
-            else
-                util->callback(BluetoothEvent::EV_ADAPTER_DISCOVERY_OFF, nullptr);
-        } else if (strcmp(key, "Powered") == 0) {
-            // on/off
-            auto v = g_variant_get_boolean(value);
-            //log("%s : %u", key, v);
-            if (v)
-                util->callback(BluetoothEvent::EV_ADAPTER_ON, nullptr);
-            else
-                util->callback(BluetoothEvent::EV_ADAPTER_OFF, nullptr);
-        }
-        g_free(key);
-        g_variant_unref(value);
-    }
-    g_free(str);
-    g_variant_iter_free(iter1);
-    g_variant_iter_free(iter2);
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        auto it = adapters.find(object_path);
+        auto adapter = it == adapters.end() ? nullptr : &it->second;
+        PropertyDelta delta;
+        while (reader.NextProperty(delta)) {
+            // Powered and Discovering are reported even for adapters we
+            // have not loaded yet, the rest only when they changed
+            auto changed = adapter && apply_adapter(*adapter, delta);
+            switch (delta.property) {
+            case Property::POWERED:
+                push(delta.b ? BluetoothEvent::EV_ADAPTER_ON : BluetoothEvent::EV_ADAPTER_OFF);
+                break;
+            case Property::DISCOVERING:
+                push(delta.b ? BluetoothEvent::EV_ADAPTER_DISCOVERY_ON : BluetoothEvent::EV_ADAPTER_DISCOVERY_OFF);
+                break;
+            case Property::PAIRABLE:
+                if (changed) push(delta.b ? BluetoothEvent::EV_ADAPTER_PAIRABLE_ON : BluetoothEvent::EV_ADAPTER_PAIRABLE_OFF);
+                break;
+            case Property::DISCOVERABLE:
+                if (changed) push(delta.b ? BluetoothEvent::EV_ADAPTER_DISCOVERABLE_ON : BluetoothEvent::EV_ADAPTER_DISCOVERABLE_OFF);
+                break;
+            case Property::NAME:
+            case Property::ALIAS:
+                renamed |= changed;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    if (renamed) push(BluetoothEvent::EV_ADAPTER_NAME);
+    timer.parsed();
+    for (int i = 0; i < n_events; i++) {
+        emit(events[i], object_path, nullptr);
+    }
 }
 /*
 ** Message: 15:41:06.960: device_callback path = /org/bluez/hci0/dev_46_4F_24_13_82_61, interface = org.freedesktop.DBus.Properties, signal = PropertiesChanged, (sa{sv}as)
@@ -342,45 +3695,88 @@ void BluezUtil::adapter_callback(GDBusConnection *connection, const gchar *sende
 ** Message: 15:41:06.960: -- RSSI : type(n)
 ** Message: 15:41:06.960: array size = 0
 */
-void BluezUtil::device_callback(GDBusConnection *connection, const gchar *sender_name, const gchar *object_path, const gchar *interface_name, const gchar *signal_name, GVariant *parameters, gpointer user_data) noexcept {
-    //log("device_callback path = %s, interface = %s, signal = %s, %s", object_path, interface_name, signal_name, g_variant_get_type_string(parameters));
-    auto util = reinterpret_cast<BluezUtil *>(user_data);
-    if (!util->callback) return;
+void BluezUtil::device_changed(MessageReader &reader) noexcept {
+    SignalTimer timer("PropertiesChanged " BLUEZ_DEVICE_IFACE);
 
-    gchar *str, *key;
-    GVariant *value;
-    GVariantIter *iter1, *iter2;
-    g_variant_get(parameters, "(sa{sv}as)", &str, &iter1, &iter2);
+    const gchar *object_path, *str;
+    BluetoothDevice *device;
+    BluetoothEvent events[8];
+    int n_events = 0;
+    // a dict may repeat a key, never overrun events
+    auto push = [&](BluetoothEvent event) {
+        if (n_events < (int)G_N_ELEMENTS(events)) events[n_events++] = event;
+    };
+    bool renamed = false;
+    if (!reader.NextObject(object_path) || !reader.NextInterface(str)) return;
     //log("- %s", str);
-    while (g_variant_iter_next(iter1, "{sv}", &key, &value)) {
-        //log("-- %s : type(%s)", key, g_variant_get_type_string(value));
-        if (strcmp(key, "Connected") == 0) {
-            auto v = g_variant_get_boolean(value);
-            //log("-- %s : %u", key, v);
-            try {
-                BluetoothDevice device(util->conn, object_path);
-                if (v)
-                    util->callback(BluetoothEvent::EV_DEVICE_CONNECTED, &device);
-                else
-                    util->callback(BluetoothEvent::EV_DEVICE_DISCONNECTED, &device);
-            } catch (std::runtime_error e) {}
-        } else if (strcmp(key, "Paired") == 0) {
-            auto v = g_variant_get_boolean(value);
-            //log("-- %s : %u", key, v);
-            try {
-                BluetoothDevice device(util->conn, object_path);
-                if (v)
-                    util->callback(BluetoothEvent::EV_DEVICE_PAIRED, &device);
-                else
-                    util->callback(BluetoothEvent::EV_DEVICE_UNPAIRED, &device);
-            } catch (std::runtime_error e) {}
+    bool heard = false, found = false;
+    int connected = -1;
+    {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        // a stranger a filtered scan rejected stays out unless its name
+        // resolves to a wanted one
+        device = find_device(object_path, false);
+        if (!device) {
+            device = recheck(object_path, reader);
+            if (!device) return;
+            found = true;
+        }
+        device->last_seen_ = g_get_real_time();
+        auto now_us = g_get_monotonic_time();
+        PropertyDelta delta;
+        while (reader.NextProperty(delta)) {
+            heard |= delta.property == Property::RSSI && !delta.invalidated;
+            if (device->apply(delta)) {
+                device->changed(delta.property, now_us);
+            } else if (!device->confirms(delta)) {
+                continue;
+            }
+            switch (delta.property) {
+            case Property::CONNECTED:
+                push(delta.b ? BluetoothEvent::EV_DEVICE_CONNECTED : BluetoothEvent::EV_DEVICE_DISCONNECTED);
+                connected = delta.b;
+                break;
+            case Property::PAIRED:
+                push(delta.b ? BluetoothEvent::EV_DEVICE_PAIRED : BluetoothEvent::EV_DEVICE_UNPAIRED);
+                break;
+            case Property::TRUSTED:
+                push(delta.b ? BluetoothEvent::EV_DEVICE_TRUSTED : BluetoothEvent::EV_DEVICE_UNTRUSTED);
+                break;
+            case Property::SERVICES_RESOLVED:
+                push(delta.b ? BluetoothEvent::EV_DEVICE_SERVICES_RESOLVED : BluetoothEvent::EV_DEVICE_SERVICES_UNRESOLVED);
+                break;
+            case Property::RSSI:
+                push(BluetoothEvent::EV_DEVICE_RSSI);
+                break;
+            case Property::UUIDS:
+                push(BluetoothEvent::EV_DEVICE_UUIDS);
+                break;
+            case Property::NAME:
+            case Property::ALIAS:
+                renamed = true;
+                break;
+            default:
+                break;
+            }
         }
-        g_free(key);
-        g_variant_unref(value);
+        // every report counts, also one repeating the last value
+        if (heard && telemetry) telemetry->Record(object_path, device->rssi_, device->tx_power_);
+    }
+    if (renamed) push(BluetoothEvent::EV_DEVICE_NAME);
+    timer.parsed();
+    // the registry entry is only modified on this thread, so it stays valid
+    // without the lock
+    for (int i = 0; i < n_events; i++) {
+        emit(events[i], object_path, device);
+    }
+    if (found) emit(BluetoothEvent::EV_DEVICE_FOUND, object_path, device);
+    // a known device in range reports its RSSI, or its name resolved
+    if ((heard || found || renamed) && scan) scan->seen(object_path, *device);
+    if (connected >= 0) supervisor->connected(object_path, connected);
+    if (connected >= 0 && streamer) {
+        if (connected) open_stream(object_path, g_get_monotonic_time() + stream_timeout_ms * 1000ll);
+        else streamer->Close(device->address());
     }
-    g_free(str);
-    g_variant_iter_free(iter1);
-    g_variant_iter_free(iter2);
 }
 /*
 ** Message: 15:40:28.494: iface_added_callback path = /, interface =
@@ -405,21 +3801,45 @@ void BluezUtil::device_callback(GDBusConnection *connection, const gchar *sender
 ** Message: 15:40:28.494: --- ServicesResolved : type(b)
 ** Message: 15:40:28.494: -- org.freedesktop.DBus.Properties
 */
-void BluezUtil::iface_added_callback(GDBusConnection *connection, const gchar *sender_name, const gchar *object_path, const gchar *interface_name, const gchar *signal_name, GVariant *parameters, gpointer user_data) noexcept {
-    //log("iface_added_callback path = %s, interface = %s, signal = %s, %s", object_path, interface_name, signal_name, g_variant_get_type_string(parameters));
-    auto util = reinterpret_cast<BluezUtil *>(user_data);
-    if (!util->callback) return;
+void BluezUtil::interfaces_added(MessageReader &reader) noexcept {
+    SignalTimer timer("InterfacesAdded");
 
-    gchar *path;         //, *key, *attr;
-    GVariantIter *iter1; //, *iter2;
-    g_variant_get(parameters, "(oa{sa{sv}})", &path, &iter1);
+    const gchar *path, *iface;
+    BluetoothDevice *device = nullptr;
+    bool adapter = false;
+    if (!reader.NextObject(path)) return;
     //log("- %s", path);
-    try {
-        BluetoothDevice device(util->conn, path);
-        util->callback(BluetoothEvent::EV_DEVICE_FOUND, &device);
-    } catch (std::runtime_error e) {}
-    g_free(path);
-    g_variant_iter_free(iter1);
+    while (reader.NextInterface(iface)) {
+        if (strcmp(iface, BLUEZ_ADAPTER_IFACE) == 0) {
+            // hotplugged controller
+            std::lock_guard<std::mutex> _1(devices_mutex);
+            update_adapter(path, reader);
+            adapter = true;
+        } else if (strcmp(iface, BLUEZ_DEVICE_IFACE) == 0) {
+            std::lock_guard<std::mutex> _1(devices_mutex);
+            auto known = find_device(path, false) != nullptr;
+            device = find_device(path, true);
+            device->update(reader);
+            device->last_seen_ = g_get_real_time();
+            // strangers found by a filtered scan wait outside the registry
+            if (!known && scan && !scan->admits(*device)) {
+                auto it = devices.find(path);
+                rejected[path] = std::move(it->second);
+                devices.erase(it);
+                device = nullptr;
+            } else if (device->rssi_ && telemetry) {
+                telemetry->Record(path, device->rssi_, device->tx_power_);
+            }
+        }
+    }
+    timer.parsed();
+    if (adapter) {
+        emit(BluetoothEvent::EV_ADAPTER_ADDED, path, nullptr);
+    }
+    if (device) {
+        emit(BluetoothEvent::EV_DEVICE_FOUND, path, device);
+        if (scan) scan->seen(path, *device);
+    }
 }
 /*
 ** Message: 15:40:28.412: iface_removed_callback path = /, interface =
@@ -430,19 +3850,36 @@ void BluezUtil::iface_added_callback(GDBusConnection *connection, const gchar *s
 ** Message: 15:40:28.412: - org.freedesktop.DBus.Introspectable
 ** Message: 15:40:28.412: - org.bluez.Device1
 */
-void BluezUtil::iface_removed_callback(GDBusConnection *connection, const gchar *sender_name, const gchar *object_path, const gchar *interface_name, const gchar *signal_name, GVariant *parameters, gpointer user_data) noexcept {
-    //log("iface_removed_callback path = %s, interface = %s, signal = %s, %s", object_path, interface_name, signal_name, g_variant_get_type_string(parameters));
-    auto util = reinterpret_cast<BluezUtil *>(user_data);
-    if (!util->callback) return;
+void BluezUtil::interfaces_removed(MessageReader &reader) noexcept {
+    SignalTimer timer("InterfacesRemoved");
 
-    gchar *path;
-    GVariantIter *iter;
-    g_variant_get(parameters, "(oas)", &path, &iter);
+    const gchar *path, *iface;
+    BluetoothDeviceRef device;
+    bool adapter = false;
+    if (!reader.NextObject(path)) return;
     //log("- %s", path);
-    try {
-        BluetoothDevice device(util->conn, path);
-        util->callback(BluetoothEvent::EV_DEVICE_REMOVE, &device);
-    } catch (std::runtime_error e) {}
-    g_free(path);
-    g_variant_iter_free(iter);
+    while (reader.NextInterface(iface)) {
+        std::lock_guard<std::mutex> _1(devices_mutex);
+        if (strcmp(iface, BLUEZ_ADAPTER_IFACE) == 0) {
+            // bluetoothd removes the devices of an unplugged controller one by one
+            adapter = adapters.erase(path) > 0;
+            proxies->Drop(path);
+            continue;
+        }
+        if (strcmp(iface, BLUEZ_DEVICE_IFACE) != 0) continue;
+        rejected.erase(path);
+        proxies->Drop(path);
+        if (telemetry) telemetry->Drop(path);
+        auto it = devices.find(path);
+        if (it == devices.end()) continue;
+        device = std::move(it->second);
+        devices.erase(it);
+    }
+    timer.parsed();
+    if (adapter) {
+        emit(BluetoothEvent::EV_ADAPTER_REMOVED, path, nullptr);
+    }
+    if (device) {
+        emit(BluetoothEvent::EV_DEVICE_REMOVE, path, device.get());
+    }
 }
@@ -3,47 +3,526 @@
 
 #include <gio/gio.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <future>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace bluez {
 
 class BluetoothDevice;
+class EventDispatcher;
+class ProxyPool;
+class SignalRecorder;
+class LinkTelemetry;
+class ListenerSet;
+struct BluetoothEventRecord;
+struct PropertyDelta;
+class MessageReader;
+class Transport;
+enum class SignalKind : guint8;
+enum class Property : guint8;
+class BluezCall;
+class BluezError;
 class BluezUtil;
+class HidStream;
+class HidStreamer;
 enum class BluetoothEvent : int;
 
 using BluetoothDeviceRef = std::unique_ptr<BluetoothDevice>;
 using BluetoothEventCallback = std::function<void(BluetoothEvent, const BluetoothDevice *)>;
+using BluezCallRef = std::shared_ptr<BluezCall>;
+// called on the loop thread, error is nullptr on success
+using BluezCallCallback = std::function<void(const BluezError *)>;
+using BluetoothDeviceFilter = std::function<bool(const BluetoothDevice &)>;
 using BluetoothEventType = std::underlying_type<BluetoothEvent>::type;
+// one bit per BluetoothEvent, see BluetoothEventBit()
+using BluetoothEventMask = guint64;
+using ListenerToken = guint;
 
 class BluezError {
   public:
     const int code;
     const std::string message;
-    explicit BluezError(int code, const char *msg) noexcept;
+    // D-Bus error name for remote errors, e.g. 'org.bluez.Error.InProgress'
+    const std::string name;
+    explicit BluezError(int code, const char *msg, const char *name = nullptr) noexcept;
     explicit BluezError(const GError *error) noexcept;
     ~BluezError() = default;
 };
 
+// Handle of an asynchronous D-Bus method call. The call keeps running if the
+// handle is dropped; Cancel() aborts it and completes it with an error.
+class BluezCall {
+    friend class BluezUtil;
+
+  private:
+    GCancellable *cancellable;
+    BluezCallCallback callback;
+    // for the latency instrumentation
+    const char *method;
+    gint64 start_us;
+    std::promise<void> promise;
+    std::shared_future<void> future_;
+    explicit BluezCall(BluezCallCallback callback, const char *method) noexcept;
+    // error is nullptr on success
+    void complete(const BluezError *error) noexcept;
+
+  public:
+    ~BluezCall();
+    void Cancel() noexcept;
+    bool cancelled() const noexcept;
+    // get() throws BluezError if the call failed, timed out or was cancelled
+    std::shared_future<void> future() const noexcept;
+};
+
+struct BluezBatchOptions {
+    // calls in flight per adapter
+    int concurrency = 2;
+    // extra attempts after 'org.bluez.Error.InProgress' or 'org.bluez.Error.Failed'
+    int retries = 3;
+    // delay before the first retry, doubled on every further attempt
+    int backoff_ms = 250;
+    int max_backoff_ms = 10000;
+    // per attempt, < 0 uses the D-Bus default
+    int timeout_ms = -1;
+};
+
+struct BluezBatchResult {
+    std::string object_path;
+    bool ok;
+    int attempts;
+    // last error, code is 0 on success
+    int code;
+    std::string error;
+    // time spent waiting for a free slot, and from the first attempt to completion
+    gint64 queued_us;
+    gint64 elapsed_us;
+};
+
+using BluezBatchFuture = std::future<std::vector<BluezBatchResult>>;
+
+struct BluezSetupResult {
+    std::string object_path;
+    bool ok;
+    // "Pair", "Trust" or "Connect" when that step failed, empty on success
+    std::string step;
+    int code;
+    std::string error;
+    // time per step, 0 for steps skipped because they were already done
+    gint64 pair_us;
+    gint64 trust_us;
+    gint64 connect_us;
+    gint64 total_us;
+};
+
+using BluezSetupFuture = std::future<BluezSetupResult>;
+
+// Adapter1.SetDiscoveryFilter() arguments, empty fields are left out.
+struct BluezDiscoveryFilter {
+    // "auto", "bredr" or "le"
+    std::string transport = "auto";
+    // only report devices at or above this RSSI, 0 for no threshold
+    gint16 rssi = 0;
+    std::vector<std::string> uuids;
+    // address or name prefix, matched by bluetoothd (BlueZ 5.54)
+    std::string pattern;
+    // Checked before a new device enters the registry or raises an event,
+    // empty lets every name through. As in script/bluez.py by default.
+    std::vector<std::string> names = {"Joy-Con (L)", "Joy-Con (R)", "Pro Controller"};
+};
+
+struct BluezScanOptions {
+    BluezDiscoveryFilter filter;
+    // Discovery is on for window_ms out of every interval_ms. A window of 0,
+    // or one not shorter than the interval, scans continuously.
+    int window_ms = 0;
+    int interval_ms = 0;
+    // stop once this many devices matched, 0 for no limit
+    int max_matches = 0;
+    // stop after this long, 0 for no deadline
+    int timeout_ms = 0;
+    // stop discovery while ConnectAsync(), PairAsync() and the batch and
+    // setup calls built on them are in flight
+    bool pause_while_connecting = true;
+    // adapters to scan on, empty for every powered one
+    std::vector<std::string> adapters;
+};
+
+struct BluezScanResult {
+    // devices that passed the name filter while discovery was on, in the
+    // order they were first seen
+    std::vector<std::string> matches;
+    // "matches", "deadline", "stopped" or "replaced"
+    std::string reason;
+    int windows;
+    // time discovery was actually on, and from start to stop
+    gint64 scan_us;
+    gint64 total_us;
+};
+
+using BluezScanFuture = std::future<BluezScanResult>;
+
+struct BluezReplayOptions {
+    // keep the recorded gaps between signals, divided by speed, instead of
+    // feeding them as fast as the loop takes them
+    bool realtime = false;
+    double speed = 1.0;
+};
+
+struct BluezReplayResult {
+    size_t signals;
+    // from the first to the last record, and how long the replay took
+    gint64 recorded_us;
+    gint64 elapsed_us;
+};
+
+using BluezReplayFuture = std::future<BluezReplayResult>;
+
+struct BluetoothAdapterInfo {
+    std::string object_path;
+    std::string address;
+    std::string name;
+    std::string alias;
+    bool powered;
+    bool discovering;
+    bool pairable;
+    bool discoverable;
+    // devices seen by this adapter, and how many of them are connected
+    int devices;
+    int connections;
+};
+
+// What the loop thread does when a listener queue is full.
+enum class EventOverflow : int {
+    // discard the oldest queued event
+    DROP_OLDEST,
+    // keep only the newest pending state per device and property
+    COALESCE,
+    // wait for the listener threads to catch up
+    BLOCK,
+};
+
+// How BluezUtil talks to bluetoothd, see BluezOptions::transport.
+enum class BluezTransportType : int {
+    GDBUS,
+    // sd-bus with in-place decoding, needs a build with BLUEZ_SDBUS
+    SDBUS,
+};
+
+enum class AgentCapability {
+    // no agent, pairing is left to another process
+    NONE,
+    NO_INPUT_NO_OUTPUT,
+    DISPLAY_ONLY,
+    DISPLAY_YES_NO,
+    KEYBOARD_ONLY,
+    KEYBOARD_DISPLAY,
+};
+
+// Pairing agent exported on the library's own connection, so Pair() works on
+// headless systems without bluetoothctl or another agent running.
+struct BluezAgentOptions {
+    AgentCapability capability = AgentCapability::NO_INPUT_NO_OUTPUT;
+    // also answer requests for pairings the library did not start
+    bool default_agent = false;
+    // devices allowed to pair, nullptr accepts Joy-Cons and Pro Controllers
+    BluetoothDeviceFilter policy;
+    // answers for legacy PIN code and passkey requests
+    std::string pin_code = "0000";
+    guint32 passkey = 0;
+};
+
+// How BluezUtil::Supervise() brings dropped devices back.
+struct BluezReconnectOptions {
+    // delay after the first failed attempt, doubled on every further one
+    int backoff_ms = 250;
+    int max_backoff_ms = 10000;
+    // each delay is shortened by a random share of up to this fraction
+    double jitter = 0.5;
+    // Connect calls in flight over all supervised devices
+    int concurrency = 2;
+    // consecutive failures before a device is given up, 0 retries forever
+    int max_failures = 8;
+    // per attempt, < 0 uses the D-Bus default
+    int timeout_ms = -1;
+};
+
+// Input reports of connected controllers, read from their /dev/hidraw* node.
+struct BluezStreamOptions {
+    // open the node of every connected device, see BluezUtil::GetStream()
+    bool enabled = false;
+    // reports buffered per device, rounded up to a power of two
+    size_t ring_reports = 256;
+    // bytes kept per report, longer ones are cut. 362 holds the largest
+    // Joy-Con report.
+    size_t max_report_size = 362;
+    // how long after Connected=true to look for the node
+    int open_timeout_ms = 3000;
+    std::string sysfs_dir = "/sys/class/hidraw";
+    std::string dev_dir = "/dev";
+};
+
+// RSSI history kept per device, see BluezUtil::GetLinkStats(). Each device
+// gets both rings once, on its first sample.
+struct BluezTelemetryOptions {
+    bool enabled = true;
+    // raw samples kept per device, rounded up to a power of two
+    size_t samples = 64;
+    // length of one min/avg/max window
+    int window_ms = 1000;
+    // windows kept per device, the rolling stats cover all of them
+    size_t windows = 30;
+};
+
+// Known devices kept in a file across runs, see BluetoothDevice::cached().
+struct BluezCacheOptions {
+    // empty keeps no cache
+    std::string path;
+    // the file is rewritten this long after a device was added, removed,
+    // paired, trusted, renamed or connected
+    int save_delay_ms = 2000;
+};
+
+struct BluezOptions {
+    // events queued per listener thread, rounded up to a power of two
+    size_t event_queue_capacity = 256;
+    // threads delivering events to listeners, 0 calls them on the loop thread.
+    // Events of one device always go through the same thread, in order.
+    int event_threads = 1;
+    EventOverflow event_overflow = EventOverflow::DROP_OLDEST;
+    BluezAgentOptions agent;
+    // proxies kept by AcquireProxy(), least recently used ones are dropped
+    size_t proxy_pool_size = 16;
+    // return from the constructor at once and connect on the loop thread,
+    // see BluezUtil::Ready()
+    bool lazy_start = false;
+    // no bus connection at all, the registry only changes through Replay()
+    bool offline = false;
+    // Method calls and BlueZ signals go through this transport. The agent,
+    // Pair and the bluetoothd watch always use GDBus.
+    BluezTransportType transport = BluezTransportType::GDBUS;
+    BluezReconnectOptions reconnect;
+    BluezStreamOptions stream;
+    // Devices from the cache are in the registry as soon as the constructor
+    // returns, which with lazy_start is before bluetoothd answered. Ignored
+    // when offline.
+    BluezCacheOptions cache;
+    BluezTelemetryOptions telemetry;
+};
+
+// Restricts a subscription to some devices, empty fields match anything.
+// Adapter events are only filtered by the event mask.
+struct BluetoothDeviceMatch {
+    // compared case-insensitively
+    std::string address;
+    std::string name_prefix;
+};
+
+struct EventQueueStats {
+    size_t capacity;
+    size_t depth;
+    size_t high_water;
+    guint64 pushed;
+    guint64 delivered;
+    guint64 dropped;
+    guint64 coalesced;
+};
+
+// Latency distribution, buckets[i] counts samples below 2^i us and the last
+// bucket everything above.
+struct BluezHistogram {
+    guint64 count;
+    gint64 total_us;
+    gint64 max_us;
+    std::vector<guint64> buckets;
+    // upper bound of the bucket holding the p-th sample, p in [0, 1]
+    gint64 Percentile(double p) const noexcept;
+};
+
+struct BluezReconnectStats {
+    std::string object_path;
+    bool connected;
+    // max_failures attempts in a row failed, until the device connects again
+    // or Supervise() is called again
+    bool given_up;
+    // disconnects seen while supervised, and Connect calls made for them
+    int drops;
+    int attempts;
+    // failed attempts since the last drop
+    int failures;
+    // from Connected=false to Connected=true
+    BluezHistogram recovery;
+};
+
+// One RSSI report, timestamps are g_get_monotonic_time().
+struct BluezLinkSample {
+    gint64 timestamp_us;
+    gint16 rssi;
+    // 127 when the device does not report TxPower
+    gint16 tx_power;
+};
+
+struct BluezLinkWindow {
+    gint64 start_us;
+    guint32 samples;
+    gint16 min_rssi;
+    gint16 max_rssi;
+    float avg_rssi;
+};
+
+// Link quality of one device. The rolling figures cover the windows of the
+// last windows * window_ms and are 0 without samples in that time.
+struct BluezLinkStats {
+    std::string object_path;
+    BluezLinkSample last;
+    guint32 samples;
+    gint16 min_rssi;
+    gint16 max_rssi;
+    float avg_rssi;
+    // oldest first, only filled when history is asked for
+    std::vector<BluezLinkWindow> windows;
+    std::vector<BluezLinkSample> recent;
+};
+
+struct BluezCallStats {
+    // D-Bus method, or 'new GDBusProxy' for proxy construction
+    std::string method;
+    BluezHistogram latency;
+};
+
+struct BluezSignalStats {
+    std::string signal;
+    // payload parsing and registry update, then event dispatch
+    BluezHistogram parse;
+    BluezHistogram dispatch;
+};
+
+// Snapshot of the built-in instrumentation. Call and signal counters are
+// process-wide, the loop times belong to the instance. Building with
+// BLUEZ_STATS off compiles all of it out and leaves enabled false.
+struct BluezStats {
+    bool enabled;
+    std::vector<BluezCallStats> calls;
+    std::vector<BluezSignalStats> signals;
+    // failed calls by BluezError code and by remote D-Bus error name
+    std::map<int, guint64> errors;
+    std::map<std::string, guint64> remote_errors;
+    // loop thread time outside poll(), and since it started
+    gint64 loop_busy_us;
+    gint64 loop_uptime_us;
+    std::string ToText() const;
+    std::string ToJson() const;
+};
+
+// When the phases of the latest connection attempt of a device were reached,
+// g_get_monotonic_time(), 0 for a phase that was not. An attempt starts with
+// our Connect or Pair, or with a link the device brought up itself. A Connect
+// right after our Pair continues the Pair's attempt.
+struct BluezConnectPhases {
+    // our call was sent, 0 for an attempt we did not start
+    gint64 requested_us;
+    gint64 paired_us;
+    // Connected turned true
+    gint64 link_up_us;
+    gint64 resolved_us;
+    // connected, services resolved and our Connect answered
+    gint64 ready_us;
+    // our Connect or Pair failed
+    gint64 failed_us;
+};
+
 class BluetoothDevice {
     friend class BluezUtil;
 
   private:
-    GDBusProxy *proxy;
-    char *name_;
-    char *address_;
-    explicit BluetoothDevice(GDBusConnection *conn, const char *object_path);
-    explicit BluetoothDevice(GDBusConnection *conn, const char *object_path, const char *name, const char *address) ;
+    GDBusConnection *conn;
+    std::string path_;
+    std::string name_;
+    std::string alias_;
+    std::string address_;
+    bool paired_;
+    bool connected_;
+    bool trusted_;
+    bool services_resolved_;
+    gint16 rssi_;
+    guint32 class_;
+    gint16 tx_power_;
+    std::vector<std::string> uuids_;
+    bool cached_;
+    // g_get_real_time()
+    gint64 last_seen_;
+    gint64 last_connected_;
+    // EV_DEVICE_CONNECTING, DISCONNECTING or PAIRING while our call is in
+    // flight, EV_NONE otherwise. Written under devices_mutex by the calling
+    // thread of a sync call, emit() reads it without.
+    std::atomic<BluetoothEvent> transition_;
+    guint8 connect_calls_;
+    // Connected or Paired set by the reply to our call, see confirms()
+    guint8 replied_;
+    BluezConnectPhases phases_;
+    explicit BluetoothDevice(GDBusConnection *conn, const char *object_path) noexcept;
+    BluetoothDevice(const BluetoothDevice &other) noexcept;
+    // apply one decoded property, returns whether the value changed
+    bool apply(const PropertyDelta &delta) noexcept;
+    // apply the properties of the interface the reader is at
+    void update(MessageReader &reader) noexcept;
+    // Connection state machine, devices_mutex must be held. requested()
+    // returns the transitional event to emit, EV_NONE if there is none.
+    BluetoothEvent requested(const char *method, gint64 now_us) noexcept;
+    // A successful reply applies the state the call reached, the signal may
+    // come later.
+    void answered(const char *method, bool failed, gint64 now_us) noexcept;
+    // the signal repeats a value the reply applied, announce it now
+    bool confirms(const PropertyDelta &delta) noexcept;
+    // after apply() changed the property in a signal
+    void changed(Property property, gint64 now_us) noexcept;
+    void check_ready(gint64 now_us) noexcept;
 
   public:
     const char *name() const noexcept;
+    // User given name, BlueZ falls back to the name or the address. In
+    // listener callbacks only set for EV_DEVICE_NAME, like uuids() for
+    // EV_DEVICE_UUIDS.
+    const char *alias() const noexcept;
     const char *address() const noexcept;
     const bool paired() const ;
     const bool connected() const ;
+    bool trusted() const noexcept;
+    // 0 when unknown, BlueZ drops RSSI once discovery stops
+    gint16 rssi() const noexcept;
+    guint32 device_class() const noexcept;
+    // advertised transmit power in dBm, 127 when unknown
+    gint16 tx_power() const noexcept;
+    // the GATT services are discovered
+    bool services_resolved() const noexcept;
+    // service UUIDs as reported by BlueZ
+    const std::vector<std::string> &uuids() const noexcept;
     const char *object_path() const noexcept;
-    BluetoothEvent state() const ;
+    // object path of the adapter the device was seen on
+    std::string adapter() const noexcept;
+    // EV_DEVICE_CONNECTING, EV_DEVICE_DISCONNECTING or EV_DEVICE_PAIRING
+    // while our call is in flight, else EV_DEVICE_CONNECTED,
+    // EV_DEVICE_PAIRED or EV_NONE. Calls made through BluetoothDevice itself
+    // are not tracked.
+    BluetoothEvent state() const noexcept;
+    const BluezConnectPhases &phases() const noexcept;
+    // Loaded from the cache and not confirmed by bluetoothd yet. Only the
+    // address, names, class, paired and trusted are known.
+    bool cached() const noexcept;
+    // wall clock time in us bluetoothd last reported the device, and last
+    // reported it connected, 0 if never. The adapter a controller last
+    // connected through is adapter() of its entry with the latest
+    // last_connected().
+    gint64 last_seen() const noexcept;
+    gint64 last_connected() const noexcept;
 
     ~BluetoothDevice();
 
@@ -53,36 +532,422 @@ class BluetoothDevice {
     std::string to_string() ;
 };
 
-class BluezUtil {
+// Plain copy of one device, the strings point into the snapshot it came from.
+struct BluetoothDeviceInfo {
+    const char *object_path;
+    const char *name;
+    const char *address;
+    bool paired;
+    bool connected;
+    bool trusted;
+    gint16 rssi;
+    guint32 device_class;
+    bool cached;
+};
+
+// Devices at one point in time, in one vector and one string arena. Moving
+// keeps the strings valid, copying is not allowed.
+class BluetoothDeviceSnapshot {
+    friend class BluezUtil;
+
+  private:
+    std::vector<char> arena;
+    std::vector<BluetoothDeviceInfo> devices;
+    const char *store(const std::string &str) noexcept;
+
+  public:
+    BluetoothDeviceSnapshot() = default;
+    BluetoothDeviceSnapshot(BluetoothDeviceSnapshot &&) = default;
+    BluetoothDeviceSnapshot &operator=(BluetoothDeviceSnapshot &&) = default;
+    BluetoothDeviceSnapshot(const BluetoothDeviceSnapshot &) = delete;
+    BluetoothDeviceSnapshot &operator=(const BluetoothDeviceSnapshot &) = delete;
+    size_t size() const noexcept { return devices.size(); }
+    bool empty() const noexcept { return devices.empty(); }
+    const BluetoothDeviceInfo &operator[](size_t i) const noexcept { return devices[i]; }
+    std::vector<BluetoothDeviceInfo>::const_iterator begin() const noexcept { return devices.begin(); }
+    std::vector<BluetoothDeviceInfo>::const_iterator end() const noexcept { return devices.end(); }
+};
+
+// One input report in a stream's ring, the payload follows the header.
+struct HidReport {
+    // g_get_monotonic_time() right after the read returned
+    gint64 timestamp_us;
+    // counts every report read from the node, dropped ones included
+    guint64 sequence;
+    // bytes in data(), at most max_report_size
+    guint32 length;
+    const guint8 *data() const noexcept { return reinterpret_cast<const guint8 *>(this + 1); }
+};
+
+// Unread reports, pointing into the ring. Valid until HidStream::Release().
+class HidReportBatch {
+    friend class HidStream;
+
+  private:
+    const guint8 *base;
+    size_t stride;
+    size_t count;
+
+  public:
+    HidReportBatch() noexcept : base(nullptr), stride(0), count(0) {}
+    size_t size() const noexcept { return count; }
+    bool empty() const noexcept { return count == 0; }
+    const HidReport &operator[](size_t i) const noexcept { return *reinterpret_cast<const HidReport *>(base + i * stride); }
+};
+
+// Single producer, single consumer ring of one device's input reports. The
+// streamer thread fills it, one consumer thread reads it in place. When the
+// ring is full the oldest unread report is overwritten and counted, so the
+// consumer always gets the latest state; only a report the consumer holds
+// in a batch is kept, the new one is dropped then.
+class HidStream {
+    friend class HidStreamer;
+
+  private:
+    std::string address_;
+    int fd;
+    int notify_fd_;
+    size_t mask;
+    size_t stride;
+    size_t max_size;
+    std::unique_ptr<guint8[]> ring;
+    // scratch space for reports that do not fit
+    std::unique_ptr<guint8[]> overflow;
+    // written by the streamer and the consumer thread respectively
+    std::atomic<guint64> head;
+    std::atomic<guint64> tail;
+    // first report of the consumer's batch, and the report the streamer is
+    // overwriting, G_MAXUINT64 for none
+    mutable std::atomic<guint64> held;
+    std::atomic<guint64> overwriting;
+    std::atomic<guint64> dropped_;
+    std::atomic<bool> closed_;
+    guint64 sequence;
+    HidReport *slot(guint64 index) const noexcept;
+    // streamer thread, reads until the node would block, at most one ring
+    // worth unless all is set. False once it hung up.
+    bool fill(bool all = false) noexcept;
+    // first unread report that is still in the ring
+    guint64 oldest(guint64 last) const noexcept;
+    void notify() noexcept;
+    void shutdown() noexcept;
+
+  public:
+    explicit HidStream(const char *address, int fd, size_t reports, size_t max_report_size) noexcept;
+    ~HidStream();
+    HidStream(const HidStream &) = delete;
+    HidStream &operator=(const HidStream &) = delete;
+    const std::string &address() const noexcept { return address_; }
+    // Unread reports in arrival order. A batch stops at the end of the ring,
+    // Peek() again after Release() for the rest. The streamer leaves the
+    // batch alone until Release().
+    HidReportBatch Peek() const noexcept;
+    void Release(size_t count) noexcept;
+    // Waits up to timeout_ms, < 0 forever, for unread reports or the end of
+    // the stream, false on timeout.
+    bool Wait(int timeout_ms) noexcept;
+    // Readable when reports arrived, for the consumer's own poll loop. Wait(0)
+    // resets it.
+    int notify_fd() const noexcept { return notify_fd_; }
+    // reports overwritten or dropped because the ring was full
+    guint64 dropped() const noexcept;
+    // the node went away or the stream was closed, unread reports stay
+    bool closed() const noexcept { return closed_.load(std::memory_order_acquire); }
+};
+
+// Reads hidraw nodes, or any descriptor that returns one report per read(),
+// on one epoll thread into per-device rings keyed by Bluetooth address.
+class HidStreamer {
+  private:
+    BluezStreamOptions options;
+    int epoll_fd;
+    int wake_fd;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable attached;
+    // by upper-case address, and by the id the descriptor is registered with
+    std::map<std::string, std::shared_ptr<HidStream>> streams;
+    std::map<guint64, std::shared_ptr<HidStream>> polled;
+    guint64 next_id;
+    void run() noexcept;
+    // mutex must be held
+    void remove(const std::string &address) noexcept;
+
+  public:
+    explicit HidStreamer(const BluezStreamOptions &options = {}) ;
+    ~HidStreamer();
+    // Streams the reports read from fd, which the stream takes over. A
+    // SOCK_SEQPACKET socketpair stands in for a hidraw node, a pipe does not
+    // keep report boundaries. Replaces the stream of the same address.
+    std::shared_ptr<HidStream> Attach(const char *address, int fd) ;
+    // Opens the hidraw node of the device, nullptr while the kernel has not
+    // created it. Throws BluezError if it cannot be opened.
+    std::shared_ptr<HidStream> Open(const char *address) ;
+    void Close(const char *address) noexcept;
+    // waits up to timeout_ms for the stream to be attached
+    std::shared_ptr<HidStream> Get(const char *address, int timeout_ms = 0) noexcept;
+    // /dev/hidrawN whose HID_UNIQ is the address, empty if there is none
+    std::string FindNode(const char *address) const noexcept;
+};
+
+// A GLib main loop on a private GMainContext, run by a joinable worker thread.
+class EventLoop {
   private:
-    std::mutex loop_mutex;
+    struct State;
+    GMainContext *context_;
     GMainLoop *loop;
+    std::mutex mutex;
+    std::thread thread;
+    std::shared_ptr<State> state;
+
+  public:
+    explicit EventLoop() noexcept;
+    ~EventLoop();
+    GMainContext *context() const noexcept;
+    bool IsLoopThread() const noexcept;
+    // started and not being stopped
+    bool Running() const noexcept;
+    void Start() noexcept;
+    // Quits the loop and joins the worker, false if it took longer than
+    // timeout_ms. Aborts when called on the loop thread, which cannot join
+    // itself.
+    bool Stop(int timeout_ms) noexcept;
+    // Queues fn on the loop thread, after delay_ms if > 0. Returns a source
+    // id for Cancel(). Thread-safe.
+    guint Post(std::function<void()> fn, int delay_ms = 0) noexcept;
+    void Cancel(guint id) noexcept;
+    // time spent outside poll() and since Start(), 0 without BLUEZ_STATS
+    void Usage(gint64 &busy_us, gint64 &uptime_us) const noexcept;
+};
+
+class BluezUtil {
+  private:
+    struct Batch;
+    struct Setup;
+    struct Scan;
+    struct Supervisor;
+    struct Replayer;
+    // known devices keyed by object path, seeded from 'GetManagedObjects'
+    // and kept up to date from signal payloads. Only the loop thread writes,
+    // except for the state machine of a sync call.
+    std::mutex devices_mutex;
+    std::map<std::string, BluetoothDeviceRef> devices;
+    // every Adapter1 object, guarded by devices_mutex as well. Connection
+    // counts are filled in when they are read.
+    std::map<std::string, BluetoothAdapterInfo> adapters;
+    // Devices a filtered scan kept out, guarded by devices_mutex as well.
+    // Admitted once their name matches or the scan ends.
+    std::map<std::string, BluetoothDeviceRef> rejected;
+    // RSSI rings by object path, guarded by devices_mutex as well
+    std::unique_ptr<LinkTelemetry> telemetry;
+    EventLoop loop;
     GDBusConnection *conn;
-    GDBusProxy *object_manager;
-    GDBusProxy *adapter_proxy;
-    guint adapter_handle;
-    guint device_handle;
-    guint iface_added_handle;
-    guint iface_removed_handle;
-    BluetoothEventCallback callback;
-    static void adapter_callback(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, gpointer) noexcept;
-    static void device_callback(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, gpointer) noexcept;
-    static void iface_added_callback(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, gpointer) noexcept;
-    static void iface_removed_callback(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, gpointer) noexcept;
+    // conn for deliver() on the listener threads, swapped with
+    // std::atomic_store() so they never wait for the loop thread
+    std::shared_ptr<GDBusConnection> listener_conn;
+    BluezTransportType transport_type;
+    std::unique_ptr<Transport> transport;
+    // the GDBus connection for calls answered through our agent, unless
+    // transport is that already
+    std::unique_ptr<Transport> agent_transport;
+    std::unique_ptr<ProxyPool> proxies;
+    // StartRecording() log, recording lets the handlers skip the lock
+    std::atomic<bool> recording;
+    std::mutex recorder_mutex;
+    std::unique_ptr<SignalRecorder> recorder;
+    guint name_watch;
+    // loop thread only, the objects of the running bluetoothd are loaded
+    bool objects_loaded;
+    // guarded by devices_mutex
+    bool bluez_running;
+    // the bus connection is set up and the signals are subscribed
+    std::promise<void> connected_promise;
+    std::shared_future<void> connected_;
+    // loop thread only once the constructor returned
+    bool ready_done;
+    std::promise<void> ready_promise;
+    std::shared_future<void> ready_;
+    std::mutex listener_mutex;
+    std::unique_ptr<ListenerSet> listeners;
+    ListenerToken legacy_listener;
+    std::unique_ptr<EventDispatcher> dispatcher;
+    guint flush_source;
+    // loop thread only, the running StartScan() session and the async
+    // Connect/Pair calls in flight
+    std::shared_ptr<Scan> scan;
+    int connecting;
+    void connecting_changed(int delta) noexcept;
+    // devices_mutex must be held, applies the properties to a rejected device
+    // and returns it if it is admitted now
+    BluetoothDevice *recheck(const char *object_path, MessageReader &reader) noexcept;
+    // after the scan ended, loop thread only
+    void readmit() noexcept;
+    std::unique_ptr<Supervisor> supervisor;
+    // reads the hidraw nodes of connected devices if options.stream.enabled
+    std::unique_ptr<HidStreamer> streamer;
+    int stream_timeout_ms;
+    void open_stream(const std::string &object_path, gint64 deadline_us) noexcept;
+    // BluezOptions::cache, the file is only written while the registry
+    // mirrors a running bluetoothd
+    std::string cache_path;
+    int cache_save_delay_ms;
+    guint save_source;
+    void load_cache() noexcept;
+    void save_cache() noexcept;
+    void schedule_save() noexcept;
+    void record(SignalKind kind, const char *object_path, GVariant *parameters) noexcept;
+    // parameters is nullptr if the transport has no GVariant form
+    void on_signal(SignalKind kind, const char *object_path, MessageReader &reader, GVariant *parameters) noexcept;
+    void adapter_changed(MessageReader &reader) noexcept;
+    void device_changed(MessageReader &reader) noexcept;
+    void interfaces_added(MessageReader &reader) noexcept;
+    void interfaces_removed(MessageReader &reader) noexcept;
+    static void agent_method_call(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, GDBusMethodInvocation *, gpointer) noexcept;
+    static void name_appeared(GDBusConnection *, const gchar *, const gchar *, gpointer) noexcept;
+    static void name_vanished(GDBusConnection *, const gchar *, gpointer) noexcept;
+    void setup() ;
+    void disconnect() noexcept;
+    GDBusConnection *connection() ;
+    void mark_ready() noexcept;
+    void export_agent() noexcept;
+    void register_agent() noexcept;
+    void unregister_agent() noexcept;
+    bool agent_approves(const char *object_path) noexcept;
+    void load_objects() ;
+    void load_objects_async() noexcept;
+    void apply_objects(MessageReader &reader, bool announce) noexcept;
+    void forget_objects() noexcept;
+    void update_adapter(const char *object_path, MessageReader &reader) noexcept;
+    std::string default_adapter() ;
+    std::vector<std::string> powered_adapters() noexcept;
+    std::map<std::string, int> adapter_loads() noexcept;
+    void emit(BluetoothEvent event, const char *object_path, const BluetoothDevice *device) noexcept;
+    void schedule_flush() noexcept;
+    void deliver(const BluetoothEventRecord &record) noexcept;
+    BluezAgentOptions agent_options;
+    std::string agent_path;
+    guint agent_registration;
+    Transport *transport_for(const char *method) noexcept;
+    // feed our Connect, Pair and Disconnect into the state machine, from any thread
+    void call_started(const char *object_path, const char *method) noexcept;
+    void call_answered(const char *object_path, const char *method, const BluezError *error) noexcept;
+    void call_sync(const char *object_path, const char *iface, const char *method, const std::function<void(MessageReader &)> &read = nullptr) ;
+    BluezCallRef call_async(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms, BluezCallCallback callback) noexcept;
+    BluezBatchFuture run_batch(const char *method, const std::vector<std::string> &object_paths, const BluezBatchOptions &options) noexcept;
+    std::vector<std::string> filter_devices(BluetoothDeviceFilter filter) ;
+    BluetoothDevice *find_device(const char *object_path, bool create) noexcept;
 
   public:
-    explicit BluezUtil() ;
+    explicit BluezUtil(const BluezOptions &options = {}) ;
+    // Waits for the loop thread and the listener threads to exit, so it must
+    // not run on any of them: not from a listener, a completion callback or
+    // a pairing policy.
     ~BluezUtil();
+    // the loop all signals and async completions are dispatched on
+    EventLoop &event_loop() noexcept;
+    // Completes once the bus is connected and the objects of a running
+    // bluetoothd are loaded, or bluetoothd was found not running. get()
+    // throws BluezError if the system bus is unreachable, or whatever else
+    // made a lazy start fail. Loading reconciles
+    // the cached devices: the ones bluetoothd does not know any more go with
+    // EV_DEVICE_REMOVE, the others report what changed since the cache was
+    // written as the usual events, and new ones arrive as EV_DEVICE_FOUND.
+    std::shared_future<void> Ready() const noexcept;
+    // whether 'org.bluez' has an owner, objects come and go with it
+    bool IsBluezRunning() ;
+    // replaces the listener set by the previous call, nullptr removes it
     void RegisterListener(BluetoothEventCallback callback) noexcept;
+    // Adds a listener for the events in mask. Events nobody subscribed to are
+    // dropped on the loop thread before they are queued.
+    ListenerToken Subscribe(BluetoothEventCallback callback, BluetoothEventMask mask, const BluetoothDeviceMatch &match = {}) noexcept;
+    // once it returns the callback is no longer running, unless it is called
+    // from a listener itself
+    void Unsubscribe(ListenerToken token) noexcept;
+    EventQueueStats GetEventQueueStats() const noexcept;
+    BluezStats Stats() const ;
+    // state of the first adapter
     BluetoothEvent GetAdapterState() ;
-    // adapter methods
+    BluetoothEvent GetAdapterState(const char *adapter_path) ;
+    std::vector<BluetoothAdapterInfo> GetAdapters() ;
+    // adapter methods, without a path they drive every powered adapter
     void StartDiscovery() ;
     void StopDiscovery() ;
+    void StartDiscovery(const char *adapter_path) ;
+    void StopDiscovery(const char *adapter_path) ;
+    // Scans with a discovery filter in duty-cycled windows until enough
+    // devices matched, the deadline passed or StopScan() is called. While it
+    // runs, new devices rejected by filter.names are left out of the
+    // registry. Starting a scan ends the running one.
+    BluezScanFuture StartScan(const BluezScanOptions &options = {}) noexcept;
+    void StopScan() noexcept;
+    // Keeps a device connected. A drop is answered with an immediate
+    // Connect(), failed attempts are retried with jittered exponential
+    // backoff, see BluezOptions::reconnect. Unsupervise() a device before
+    // disconnecting it on purpose.
+    void Supervise(const char *object_path) noexcept;
+    void Unsupervise(const char *object_path) noexcept;
+    std::vector<BluezReconnectStats> GetReconnectStats() ;
+    // Link quality from the RSSI the device reported, false if it has not
+    // reported any. With history the windows and raw samples are copied too.
+    bool GetLinkStats(const char *object_path, BluezLinkStats &stats, bool history = false) noexcept;
+    // BluetoothDevice::state() from the registry, EV_NONE for an unknown
+    // device. phases is filled in if given.
+    BluetoothEvent GetDeviceState(const char *object_path, BluezConnectPhases *phases = nullptr) noexcept;
+    // every device with samples, strongest latest RSSI first
+    std::vector<BluezLinkStats> GetLinkStats(bool history = false) noexcept;
+    // Input reports of a connected device, see BluezStreamOptions. Waits up
+    // to timeout_ms for the hidraw node to be opened, nullptr if it was not.
+    std::shared_ptr<HidStream> GetStream(const char *object_path, int timeout_ms = 0) ;
+    // Writes every signal the handlers receive to a binary log, after the
+    // object tree at the start. Throws BluezError if path cannot be created
+    // or the transport is not GDBus.
+    void StartRecording(const char *path) ;
+    // the log is complete once it returns
+    void StopRecording() noexcept;
+    // Feeds a log from StartRecording() through the same handlers on the loop
+    // thread, see BluezOptions::offline. Throws BluezError if the log cannot
+    // be read.
+    BluezReplayFuture Replay(const char *path, const BluezReplayOptions &options = {}) ;
+    // devices seen by every adapter
     std::list<BluetoothDeviceRef> GetDevices() ;
-    // device methods
+    // Same devices as plain values, filled in one pass over the registry with
+    // two allocations in total. Pass object_path to the path based methods.
+    BluetoothDeviceSnapshot GetDeviceSnapshot() ;
+    // Object path of the device with this address on the powered adapter
+    // with the fewest connections, empty if no adapter has seen it. Between
+    // equally loaded adapters the one that hears the device best recently
+    // wins. Use it to pick where a new controller gets paired.
+    std::string SelectDevice(const char *address) ;
+    // Proxy from a bounded LRU pool keyed by object path and interface, the
+    // caller owns the returned reference. Properties are only loaded, and then
+    // kept up to date on the loop thread, when load_properties is set. Plain
+    // method calls do not need a proxy.
+    GDBusProxy *AcquireProxy(const char *object_path, const char *iface, bool load_properties = false) ;
+    // device methods, one method call without a proxy
     void Connect(const char *object_path) ;
     void Disconnect(const char *object_path) ;
     void Pair(const char *object_path) ;
+    // asynchronous variants, timeout_ms < 0 uses the D-Bus default. Without
+    // a path discovery is driven on the first adapter.
+    BluezCallRef StartDiscoveryAsync(int timeout_ms = -1, BluezCallCallback callback = nullptr) ;
+    BluezCallRef StopDiscoveryAsync(int timeout_ms = -1, BluezCallCallback callback = nullptr) ;
+    BluezCallRef StartDiscoveryAsync(const char *adapter_path, int timeout_ms = -1, BluezCallCallback callback = nullptr) noexcept;
+    BluezCallRef StopDiscoveryAsync(const char *adapter_path, int timeout_ms = -1, BluezCallCallback callback = nullptr) noexcept;
+    BluezCallRef ConnectAsync(const char *object_path, int timeout_ms = -1, BluezCallCallback callback = nullptr) noexcept;
+    BluezCallRef DisconnectAsync(const char *object_path, int timeout_ms = -1, BluezCallCallback callback = nullptr) noexcept;
+    BluezCallRef PairAsync(const char *object_path, int timeout_ms = -1, BluezCallCallback callback = nullptr) noexcept;
+    // Pair, Trust and Connect in one unattended run, timeout_ms applies per
+    // step. Steps that are already done are skipped.
+    BluezSetupFuture PairAndConnectAsync(const char *object_path, int timeout_ms = -1) noexcept;
+    // Fleet operations, results are in the order of object_paths. With a
+    // filter every matching address is handled once, on the least loaded
+    // adapter that has seen it.
+    BluezBatchFuture ConnectAll(const std::vector<std::string> &object_paths, const BluezBatchOptions &options = {}) noexcept;
+    BluezBatchFuture ConnectAll(BluetoothDeviceFilter filter, const BluezBatchOptions &options = {}) ;
+    BluezBatchFuture DisconnectAll(const std::vector<std::string> &object_paths, const BluezBatchOptions &options = {}) noexcept;
+    BluezBatchFuture DisconnectAll(BluetoothDeviceFilter filter, const BluezBatchOptions &options = {}) ;
+    BluezBatchFuture PairAll(const std::vector<std::string> &object_paths, const BluezBatchOptions &options = {}) noexcept;
+    BluezBatchFuture PairAll(BluetoothDeviceFilter filter, const BluezBatchOptions &options = {}) ;
 };
 
 enum class BluetoothEvent : int {
@@ -91,6 +956,8 @@ enum class BluetoothEvent : int {
     EV_ADAPTER_ON = 0x22,
     EV_ADAPTER_DISCOVERY_OFF = 0x23,
     EV_ADAPTER_DISCOVERY_ON = 0x24,
+    EV_ADAPTER_ADDED = 0x25,
+    EV_ADAPTER_REMOVED = 0x26,
     EV_DEVICE_FOUND = 0x11,
     EV_DEVICE_REMOVE = 0x12,
     EV_DEVICE_UNPAIRED = 0x13,
@@ -101,11 +968,34 @@ enum class BluetoothEvent : int {
     EV_DEVICE_DISCONNECTING = 0x18,
     EV_DEVICE_CONNECTING = 0x19,
     EV_DEVICE_CONNECTED = 0x1a,
+    EV_DEVICE_RSSI = 0x1b,
+    EV_DEVICE_TRUSTED = 0x1c,
+    EV_DEVICE_UNTRUSTED = 0x1d,
+    EV_DEVICE_SERVICES_RESOLVED = 0x1e,
+    EV_DEVICE_SERVICES_UNRESOLVED = 0x1f,
+    // 0x11 to 0x1f are taken, device events go on with EV_MORE set. Their
+    // bits follow EV_DEVICE_SERVICES_UNRESOLVED's.
+    // Name or Alias changed
+    EV_DEVICE_NAME = 0x90,
+    EV_DEVICE_UUIDS = 0x91,
+    EV_ADAPTER_PAIRABLE_ON = 0x27,
+    EV_ADAPTER_PAIRABLE_OFF = 0x28,
+    EV_ADAPTER_DISCOVERABLE_ON = 0x29,
+    EV_ADAPTER_DISCOVERABLE_OFF = 0x2a,
+    // Name or Alias changed
+    EV_ADAPTER_NAME = 0x2b,
 };
 static const int EV_ADAPTER = 0x20;
 static const int EV_DEVICE = 0x10;
+// set on the events of a kind after the first 16, bits 16 to 31 of its half
+// of the mask
+static const int EV_MORE = 0x80;
+static const BluetoothEventMask EV_MASK_DEVICE = 0x00000000ffffffffull;
+static const BluetoothEventMask EV_MASK_ADAPTER = 0xffffffff00000000ull;
+static const BluetoothEventMask EV_MASK_ALL = EV_MASK_DEVICE | EV_MASK_ADAPTER;
 bool operator==(const BluetoothEvent &p1, int p2) noexcept;
 int BluetoothEventValue(const BluetoothEvent &event) noexcept;
+BluetoothEventMask BluetoothEventBit(const BluetoothEvent &event) noexcept;
 // namespace bluez
 } // namespace bluez
 
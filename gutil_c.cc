@@ -0,0 +1,254 @@
+#include "gutil_c.h"
+#include "gutil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <new>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define QUEUE_CAPACITY 1024
+
+using namespace bluez;
+
+static_assert(sizeof(bluez_event) == 640, "bluez_event layout is part of the ABI");
+static_assert(sizeof(bluez_device) == 360, "bluez_device layout is part of the ABI");
+
+struct bluez_util {
+    std::unique_ptr<BluezUtil> util;
+    int event_fd;
+    size_t capacity;
+    std::mutex mutex;
+    // guarded by mutex, like everything below
+    std::deque<bluez_event> queue;
+    guint64 dropped;
+    // calls in flight, nullptr until the call was started
+    std::map<guint64, BluezCallRef> calls;
+    std::atomic<guint64> next_id;
+
+    bluez_util() noexcept : event_fd(-1), capacity(QUEUE_CAPACITY), dropped(0), next_id(1) {}
+    void push(const bluez_event &event) noexcept;
+    guint64 call(const char *object_path, bool required, std::function<BluezCallRef(BluezCallCallback)> start) noexcept;
+};
+
+static inline void copy_string(char *dst, size_t size, const char *src) noexcept {
+    if (!src) src = "";
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+}
+
+// Nothing may unwind into the host, every entry point maps what it caught
+// to an error, BluezError or not.
+static BluezError current_error() noexcept {
+    try {
+        throw;
+    } catch (const BluezError &e) {
+        return e;
+    } catch (const std::exception &e) {
+        return BluezError(-1, e.what(), "org.bluez.Error.Failed");
+    } catch (...) {
+        return BluezError(-1, "Unknown error", "org.bluez.Error.Failed");
+    }
+}
+
+// The eventfd is set when the queue stops being empty and reset when it is
+// drained, both under the mutex.
+void bluez_util::push(const bluez_event &event) noexcept {
+    std::lock_guard<std::mutex> _1(mutex);
+    if (queue.size() >= capacity && event.kind == BLUEZ_KIND_EVENT) {
+        auto oldest = std::find_if(queue.begin(), queue.end(), [](const bluez_event &e) { return e.kind == BLUEZ_KIND_EVENT; });
+        dropped++;
+        // only completions queued, the event itself is the oldest
+        if (oldest == queue.end()) return;
+        queue.erase(oldest);
+    }
+    queue.push_back(event);
+    if (queue.size() > 1) return;
+    guint64 one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0) g_warning("[BluezUtil] eventfd write failed: %s", strerror(errno));
+}
+
+guint64 bluez_util::call(const char *object_path, bool required, std::function<BluezCallRef(BluezCallCallback)> start) noexcept {
+    auto id = next_id++;
+    std::string path = object_path ? object_path : "";
+    {
+        std::lock_guard<std::mutex> _1(mutex);
+        calls[id] = nullptr;
+    }
+    auto complete = [this, id, path](const BluezError *e) {
+        bluez_event event = {};
+        event.kind = BLUEZ_KIND_COMPLETION;
+        event.request_id = id;
+        event.timestamp_us = g_get_monotonic_time();
+        copy_string(event.object_path, sizeof(event.object_path), path.c_str());
+        if (e) {
+            event.error_code = e->code ? e->code : -1;
+            copy_string(event.error_name, sizeof(event.error_name), e->name.c_str());
+            copy_string(event.error_message, sizeof(event.error_message), e->message.c_str());
+        }
+        {
+            std::lock_guard<std::mutex> _1(mutex);
+            calls.erase(id);
+        }
+        push(event);
+    };
+    BluezCallRef ref;
+    try {
+        if (!object_path && required) throw BluezError(-1, "No object path", "org.freedesktop.DBus.Error.InvalidArgs");
+        ref = start(complete);
+    } catch (...) {
+        auto e = current_error();
+        complete(&e);
+        return id;
+    }
+    std::lock_guard<std::mutex> _1(mutex);
+    // it may have completed already
+    auto it = calls.find(id);
+    if (it != calls.end()) it->second = ref;
+    return id;
+}
+
+bluez_util *bluez_util_new(const bluez_options *options, char *error, size_t error_size) {
+    std::unique_ptr<bluez_util> util(new (std::nothrow) bluez_util());
+    if (!util) {
+        if (error && error_size) copy_string(error, error_size, strerror(ENOMEM));
+        return nullptr;
+    }
+    util->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (util->event_fd < 0) {
+        if (error && error_size) copy_string(error, error_size, strerror(errno));
+        return nullptr;
+    }
+    try {
+        BluezOptions o;
+        guint64 mask = EV_MASK_ALL;
+        if (options) {
+            o.lazy_start = options->lazy_start != 0;
+            if (options->queue_capacity) util->capacity = options->queue_capacity;
+            if (options->event_mask) mask = options->event_mask;
+            if (options->cache_path) o.cache.path = options->cache_path;
+        }
+        util->util.reset(new BluezUtil(o));
+        auto raw = util.get();
+        util->util->Subscribe([raw](BluetoothEvent ev, const BluetoothDevice *device) {
+            bluez_event event = {};
+            event.kind = BLUEZ_KIND_EVENT;
+            event.event = BluetoothEventValue(ev);
+            event.timestamp_us = g_get_monotonic_time();
+            if (device) {
+                event.device_class = device->device_class();
+                event.rssi = device->rssi();
+                event.paired = device->paired();
+                event.connected = device->connected();
+                event.trusted = device->trusted();
+                event.services_resolved = device->services_resolved();
+                copy_string(event.object_path, sizeof(event.object_path), device->object_path());
+                copy_string(event.address, sizeof(event.address), device->address());
+                copy_string(event.name, sizeof(event.name), device->name());
+            }
+            raw->push(event);
+        }, mask);
+    } catch (...) {
+        auto e = current_error();
+        if (error && error_size) copy_string(error, error_size, e.message.c_str());
+        util->util.reset();
+        close(util->event_fd);
+        return nullptr;
+    }
+    return util.release();
+}
+
+void bluez_util_free(bluez_util *util) {
+    if (!util) return;
+    // stops the loop and the listener threads, nothing completes afterwards
+    util->util.reset();
+    close(util->event_fd);
+    delete util;
+}
+
+int bluez_util_event_fd(bluez_util *util) {
+    return util->event_fd;
+}
+
+size_t bluez_util_drain(bluez_util *util, bluez_event *events, size_t max) {
+    std::lock_guard<std::mutex> _1(util->mutex);
+    size_t n = std::min(max, util->queue.size());
+    std::copy(util->queue.begin(), util->queue.begin() + n, events);
+    util->queue.erase(util->queue.begin(), util->queue.begin() + n);
+    if (util->queue.empty()) {
+        guint64 count;
+        if (read(util->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) g_warning("[BluezUtil] eventfd read failed: %s", strerror(errno));
+    }
+    return n;
+}
+
+uint64_t bluez_util_dropped(bluez_util *util) {
+    std::lock_guard<std::mutex> _1(util->mutex);
+    return util->dropped;
+}
+
+size_t bluez_util_devices(bluez_util *util, bluez_device *devices, size_t max) {
+    BluetoothDeviceSnapshot snapshot;
+    try {
+        snapshot = util->util->GetDeviceSnapshot();
+    } catch (...) {
+        // reported as no devices, the host has no way to catch it
+        return 0;
+    }
+    for (size_t i = 0; i < snapshot.size() && i < max; i++) {
+        auto &d = snapshot[i];
+        auto &out = devices[i];
+        memset(&out, 0, sizeof(out));
+        copy_string(out.object_path, sizeof(out.object_path), d.object_path);
+        copy_string(out.address, sizeof(out.address), d.address);
+        copy_string(out.name, sizeof(out.name), d.name);
+        out.device_class = d.device_class;
+        out.rssi = d.rssi;
+        out.paired = d.paired;
+        out.connected = d.connected;
+        out.trusted = d.trusted;
+        out.cached = d.cached;
+    }
+    return snapshot.size();
+}
+
+uint64_t bluez_util_connect(bluez_util *util, const char *object_path, int timeout_ms) {
+    return util->call(object_path, true, [=](BluezCallCallback done) { return util->util->ConnectAsync(object_path, timeout_ms, done); });
+}
+
+uint64_t bluez_util_disconnect(bluez_util *util, const char *object_path, int timeout_ms) {
+    return util->call(object_path, true, [=](BluezCallCallback done) { return util->util->DisconnectAsync(object_path, timeout_ms, done); });
+}
+
+uint64_t bluez_util_pair(bluez_util *util, const char *object_path, int timeout_ms) {
+    return util->call(object_path, true, [=](BluezCallCallback done) { return util->util->PairAsync(object_path, timeout_ms, done); });
+}
+
+uint64_t bluez_util_start_discovery(bluez_util *util, const char *adapter_path, int timeout_ms) {
+    return util->call(adapter_path, false, [=](BluezCallCallback done) {
+        return adapter_path ? util->util->StartDiscoveryAsync(adapter_path, timeout_ms, done) : util->util->StartDiscoveryAsync(timeout_ms, done);
+    });
+}
+
+uint64_t bluez_util_stop_discovery(bluez_util *util, const char *adapter_path, int timeout_ms) {
+    return util->call(adapter_path, false, [=](BluezCallCallback done) {
+        return adapter_path ? util->util->StopDiscoveryAsync(adapter_path, timeout_ms, done) : util->util->StopDiscoveryAsync(timeout_ms, done);
+    });
+}
+
+void bluez_util_cancel(bluez_util *util, uint64_t request_id) {
+    BluezCallRef ref;
+    {
+        std::lock_guard<std::mutex> _1(util->mutex);
+        auto it = util->calls.find(request_id);
+        if (it == util->calls.end()) return;
+        ref = it->second;
+    }
+    if (ref) ref->Cancel();
+}
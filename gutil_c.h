@@ -0,0 +1,105 @@
+#ifndef _GUTIL_C_H_
+#define _GUTIL_C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// C interface over BluezUtil for FFI hosts. Nothing calls back into the
+// host: device events and call completions are queued and the host drains
+// them from its own thread once bluez_util_event_fd() polls readable.
+
+typedef struct bluez_util bluez_util;
+
+enum bluez_kind {
+    // a BluetoothEvent, see gutil.h for the values
+    BLUEZ_KIND_EVENT = 1,
+    // the end of a call that returned request_id
+    BLUEZ_KIND_COMPLETION = 2,
+};
+
+// Fixed layout, 640 bytes, strings are NUL terminated and cut to fit.
+typedef struct bluez_event {
+    uint32_t kind;
+    // BluetoothEvent value, 0 for completions
+    int32_t event;
+    uint64_t request_id;
+    // g_get_monotonic_time() when it was queued
+    int64_t timestamp_us;
+    // 0 on success, otherwise the BluezError code
+    int32_t error_code;
+    uint32_t device_class;
+    int16_t rssi;
+    uint8_t paired;
+    uint8_t connected;
+    uint8_t trusted;
+    uint8_t services_resolved;
+    uint8_t reserved[2];
+    // device of the event or of the call, empty for adapter events
+    char object_path[64];
+    char address[24];
+    char name[256];
+    // D-Bus error name of a failed call, e.g. 'org.bluez.Error.Failed'
+    char error_name[64];
+    char error_message[192];
+} bluez_event;
+
+typedef struct bluez_device {
+    char object_path[64];
+    char address[24];
+    char name[256];
+    uint32_t device_class;
+    int16_t rssi;
+    uint8_t paired;
+    uint8_t connected;
+    uint8_t trusted;
+    // see BluetoothDevice::cached()
+    uint8_t cached;
+    uint8_t reserved[6];
+} bluez_device;
+
+typedef struct bluez_options {
+    // see BluezOptions::lazy_start
+    int lazy_start;
+    // entries queued before the oldest device event is dropped, completions
+    // are never dropped. 0 uses 1024.
+    size_t queue_capacity;
+    // BluetoothEventBit() values to queue, 0 queues everything
+    uint64_t event_mask;
+    // see BluezCacheOptions::path, NULL keeps no cache
+    const char *cache_path;
+} bluez_options;
+
+// NULL on failure, with the reason in error if it is not NULL. options may
+// be NULL for the defaults.
+bluez_util *bluez_util_new(const bluez_options *options, char *error, size_t error_size);
+void bluez_util_free(bluez_util *util);
+// Readable while entries are queued. Only bluez_util_drain() resets it.
+int bluez_util_event_fd(bluez_util *util);
+// Moves up to max queued entries to events, oldest first, and returns how
+// many were moved.
+size_t bluez_util_drain(bluez_util *util, bluez_event *events, size_t max);
+// device events dropped because the host did not drain in time
+uint64_t bluez_util_dropped(bluez_util *util);
+// Fills up to max devices and returns how many are known.
+size_t bluez_util_devices(bluez_util *util, bluez_device *devices, size_t max);
+
+// Asynchronous calls. Each returns a request id > 0 whose completion is
+// queued exactly once. timeout_ms < 0 uses the D-Bus default, a NULL
+// adapter_path drives the first adapter.
+uint64_t bluez_util_connect(bluez_util *util, const char *object_path, int timeout_ms);
+uint64_t bluez_util_disconnect(bluez_util *util, const char *object_path, int timeout_ms);
+uint64_t bluez_util_pair(bluez_util *util, const char *object_path, int timeout_ms);
+uint64_t bluez_util_start_discovery(bluez_util *util, const char *adapter_path, int timeout_ms);
+uint64_t bluez_util_stop_discovery(bluez_util *util, const char *adapter_path, int timeout_ms);
+// completes the call with an error unless it already finished
+void bluez_util_cancel(bluez_util *util, uint64_t request_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
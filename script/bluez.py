@@ -1,34 +1,25 @@
 #!/usr/bin/python3
 
-import dbus
+import asyncio
 
+import _bluez
 
-class Device:
-    def __init__(self, path, **kw):
-        super().__init__()
-        self.path = str(path)
-        self.name = str(kw['Name'])
-        self.address = str(kw['Address'])
-        self.paired = bool(kw['Paired'])
-        self.connected = bool(kw['Connected'])
+# the controllers the joycon-toolkit cares about, same as StartScan()
+_filter = _bluez.CONTROLLER_NAMES
+_util = None
 
-    def to_dict(self):
-        return {'path': self.path, 'name': self.name, 'address': self.address, 'paired': self.paired, 'conntected': self.connected}
 
-    def to_tuple(self):
-        return (self.path, self.name, self.address, 2 if self.connected else 1 if self.paired else 0)
+def util():
+    """The shared _bluez.Util, created on first use. Blocks until bluetoothd's
+    objects are loaded, raises _bluez.Error if the system bus is unreachable."""
+    global _util
+    if _util is None:
+        _util = _bluez.Util()
+    return _util
 
-    def __str__(self):
-        return '{} - {}\n{}, {}\n{}'.format(self.name, self.address, self.paired, self.connected, self.path)
 
-
-bus = dbus.SystemBus()
-manager = dbus.Interface(bus.get_object("org.bluez", "/"),
-                         "org.freedesktop.DBus.ObjectManager")
-_filter = ('Joy-Con (L)', 'Joy-Con (R)', 'Pro Controller')
-objects = manager.GetManagedObjects()
-devices = (Device(path=path, **iface['org.bluez.Device1']) for path, iface in objects.items()
-           if "org.bluez.Device1" in iface.keys())
+def _state(d):
+    return 2 if d.connected else 1 if d.paired else 0
 
 
 def hello():
@@ -36,11 +27,30 @@ def hello():
 
 
 def get_paired_devices():
-    return [d.to_tuple() for d in devices if d.paired and d.name in _filter]
+    return [(d.object_path, d.name, d.address, _state(d)) for d in util().devices(_filter) if d.paired]
 
 
 def get_connected_devices():
-    return [d.to_dict() for d in devices if d.connected and d.name in _filter]
+    return [{'path': d.object_path, 'name': d.name, 'address': d.address, 'paired': d.paired, 'conntected': d.connected}
+            for d in util().devices(_filter) if d.connected]
+
+
+async def events(u=None):
+    """Yields the _bluez.Event tuples of u, or of util(), until it is closed.
+    Waits on the queue's descriptor, so the asyncio loop is never blocked."""
+    u = u or util()
+    loop = asyncio.get_running_loop()
+    while True:
+        for event in u.drain():
+            yield event
+        if u.closed:
+            return
+        readable = loop.create_future()
+        loop.add_reader(u.fileno(), lambda: readable.done() or readable.set_result(None))
+        try:
+            await readable
+        finally:
+            loop.remove_reader(u.fileno())
 
 
 if __name__ == '__main__':
@@ -0,0 +1,326 @@
+#include "transport.h"
+
+#include <cstring>
+
+#define BLUEZ "org.bluez"
+#define BLUEZ_MANAGER_IFACE "org.freedesktop.DBus.ObjectManager"
+#define BLUEZ_PROPERTY_IFACE "org.freedesktop.DBus.Properties"
+#define BLUEZ_ADAPTER_IFACE "org.bluez.Adapter1"
+#define BLUEZ_DEVICE_IFACE "org.bluez.Device1"
+
+using namespace bluez;
+
+static constexpr PropertySpec PROPERTIES[] = {
+    {"Address", Property::ADDRESS, "s"},
+    {"Name", Property::NAME, "s"},
+    {"Alias", Property::ALIAS, "s"},
+    {"Paired", Property::PAIRED, "b"},
+    {"Connected", Property::CONNECTED, "b"},
+    {"Trusted", Property::TRUSTED, "b"},
+    {"RSSI", Property::RSSI, "n"},
+    {"Class", Property::CLASS, "u"},
+    {"UUIDs", Property::UUIDS, "as"},
+    {"ServicesResolved", Property::SERVICES_RESOLVED, "b"},
+    {"TxPower", Property::TX_POWER, "n"},
+    {"Powered", Property::POWERED, "b"},
+    {"Discovering", Property::DISCOVERING, "b"},
+    {"Pairable", Property::PAIRABLE, "b"},
+    {"Discoverable", Property::DISCOVERABLE, "b"},
+};
+
+#define PROPERTY_SLOT_BITS 5
+#define PROPERTY_SLOTS (1 << PROPERTY_SLOT_BITS)
+
+static constexpr guint32 fnv1a(const char *str, guint32 seed) noexcept {
+    for (; *str; str++) seed = (seed ^ (guint8)*str) * 16777619u;
+    return seed;
+}
+
+// the low bits of the hash only depend on the low bits of the seed, so the
+// slot comes from the top ones
+static constexpr guint32 property_slot(const char *name, guint32 seed) noexcept {
+    return fnv1a(name, seed) >> (32 - PROPERTY_SLOT_BITS);
+}
+
+// the first seed from the FNV offset basis that gives every name its own slot
+static constexpr guint32 perfect_seed() noexcept {
+    for (guint32 seed = 2166136261u;; seed++) {
+        guint32 used = 0;
+        bool unique = true;
+        for (auto &spec : PROPERTIES) {
+            auto bit = 1u << property_slot(spec.name, seed);
+            if (used & bit) unique = false;
+            used |= bit;
+        }
+        if (unique) return seed;
+    }
+}
+
+struct PropertyTable {
+    // index into PROPERTIES plus one, 0 for an empty slot
+    guint8 slots[PROPERTY_SLOTS];
+};
+
+static constexpr guint32 PROPERTY_SEED = perfect_seed();
+
+static constexpr PropertyTable property_table() noexcept {
+    PropertyTable table{};
+    for (size_t i = 0; i < sizeof(PROPERTIES) / sizeof(PROPERTIES[0]); i++) {
+        table.slots[property_slot(PROPERTIES[i].name, PROPERTY_SEED)] = i + 1;
+    }
+    return table;
+}
+
+static constexpr PropertyTable PROPERTY_TABLE = property_table();
+static_assert(sizeof(PROPERTIES) / sizeof(PROPERTIES[0]) <= PROPERTY_SLOTS, "one slot per property");
+
+const PropertySpec *bluez::lookup_property(const char *name) noexcept {
+    auto index = PROPERTY_TABLE.slots[property_slot(name, PROPERTY_SEED)];
+    if (!index || strcmp(PROPERTIES[index - 1].name, name) != 0) return nullptr;
+    return &PROPERTIES[index - 1];
+}
+
+const char *const bluez::SIGNAL_TYPES[] = {"(sa{sv}as)", "(sa{sv}as)", "(oa{sa{sv}})", "(oas)", "(a{oa{sa{sv}}})"};
+
+static inline void clear(GVariant *&value) noexcept {
+    if (value) g_variant_unref(value);
+    value = nullptr;
+}
+
+// Children of a message share its data, so strings read from an entry stay
+// valid after the entry is unreferenced. Only the containers the iterators
+// walk are kept.
+GVariantReader::GVariantReader(SignalKind kind, GVariant *parameters, const char *object_path) noexcept
+    : kind(kind), parameters(parameters), path(object_path ? object_path : ""), object_read(false), interface_read(false),
+      objects_value(nullptr), interfaces_value(nullptr), properties_value(nullptr), invalidated_value(nullptr) {
+    // a malformed message reads as empty
+    if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE(SIGNAL_TYPES[(int)kind]))) {
+        object_read = true;
+        return;
+    }
+    if (kind != SignalKind::OBJECTS) return;
+    objects_value = g_variant_get_child_value(parameters, 0);
+    g_variant_iter_init(&objects, objects_value);
+}
+
+GVariantReader::~GVariantReader() {
+    clear(objects_value);
+    clear(interfaces_value);
+    clear(properties_value);
+    clear(invalidated_value);
+}
+
+bool GVariantReader::NextObject(const char *&object_path) noexcept {
+    clear(interfaces_value);
+    clear(properties_value);
+    clear(invalidated_value);
+    interface_read = false;
+    if (kind == SignalKind::OBJECTS) {
+        auto entry = objects_value ? g_variant_iter_next_value(&objects) : nullptr;
+        if (!entry) {
+            // GVariantIter must not be called again once it returned nullptr
+            clear(objects_value);
+            return false;
+        }
+        g_variant_get_child(entry, 0, "&o", &object_path);
+        interfaces_value = g_variant_get_child_value(entry, 1);
+        g_variant_unref(entry);
+    } else {
+        if (object_read) return false;
+        object_read = true;
+        if (kind == SignalKind::ADAPTER_CHANGED || kind == SignalKind::DEVICE_CHANGED) {
+            object_path = path;
+            return true;
+        }
+        g_variant_get_child(parameters, 0, "&o", &object_path);
+        interfaces_value = g_variant_get_child_value(parameters, 1);
+    }
+    g_variant_iter_init(&interfaces, interfaces_value);
+    return true;
+}
+
+bool GVariantReader::NextInterface(const char *&iface) noexcept {
+    clear(properties_value);
+    clear(invalidated_value);
+    if (kind == SignalKind::ADAPTER_CHANGED || kind == SignalKind::DEVICE_CHANGED) {
+        if (!object_read || interface_read) return false;
+        interface_read = true;
+        g_variant_get_child(parameters, 0, "&s", &iface);
+        properties_value = g_variant_get_child_value(parameters, 1);
+        invalidated_value = g_variant_get_child_value(parameters, 2);
+        g_variant_iter_init(&properties, properties_value);
+        g_variant_iter_init(&invalidated, invalidated_value);
+        return true;
+    }
+    auto entry = interfaces_value ? g_variant_iter_next_value(&interfaces) : nullptr;
+    if (!entry) {
+        clear(interfaces_value);
+        return false;
+    }
+    if (kind == SignalKind::INTERFACES_REMOVED) {
+        iface = g_variant_get_string(entry, nullptr);
+    } else {
+        g_variant_get_child(entry, 0, "&s", &iface);
+        properties_value = g_variant_get_child_value(entry, 1);
+        g_variant_iter_init(&properties, properties_value);
+    }
+    g_variant_unref(entry);
+    return true;
+}
+
+bool GVariantReader::NextProperty(PropertyDelta &delta) noexcept {
+    GVariant *entry;
+    while (properties_value && (entry = g_variant_iter_next_value(&properties))) {
+        const gchar *key;
+        GVariant *value;
+        g_variant_get(entry, "{&sv}", &key, &value);
+        g_variant_unref(entry);
+        auto spec = lookup_property(key);
+        if (!spec || !g_variant_is_of_type(value, G_VARIANT_TYPE(spec->type))) {
+            g_variant_unref(value);
+            continue;
+        }
+        delta = PropertyDelta{spec->property, false, false, 0, 0, "", nullptr};
+        switch (spec->type[0]) {
+        case 'b':
+            delta.b = g_variant_get_boolean(value);
+            break;
+        case 'n':
+            delta.n = g_variant_get_int16(value);
+            break;
+        case 'u':
+            delta.u = g_variant_get_uint32(value);
+            break;
+        case 's':
+            delta.s = g_variant_get_string(value, nullptr);
+            break;
+        default: {
+            strv.clear();
+            GVariantIter iter;
+            const gchar *str;
+            g_variant_iter_init(&iter, value);
+            while (g_variant_iter_next(&iter, "&s", &str)) strv.emplace_back(str);
+            delta.strv = &strv;
+        }
+        }
+        g_variant_unref(value);
+        return true;
+    }
+    clear(properties_value);
+    while (invalidated_value && (entry = g_variant_iter_next_value(&invalidated))) {
+        auto spec = lookup_property(g_variant_get_string(entry, nullptr));
+        g_variant_unref(entry);
+        if (!spec) continue;
+        delta = PropertyDelta{spec->property, true, false, 0, 0, "", nullptr};
+        return true;
+    }
+    clear(invalidated_value);
+    return false;
+}
+
+// The transport the library always had: GDBus subscriptions and calls on the
+// shared system bus connection.
+class GDBusTransport : public Transport {
+  private:
+    struct Subscription {
+        GDBusTransport *transport;
+        SignalKind kind;
+        guint handle;
+    };
+    GDBusConnection *conn;
+    SignalHandler handler;
+    Subscription subscriptions[4];
+    static void signal(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *, gpointer) noexcept;
+    static void finish(GObject *, GAsyncResult *, gpointer) noexcept;
+
+  public:
+    explicit GDBusTransport(GDBusConnection *conn) noexcept
+        : conn(G_DBUS_CONNECTION(g_object_ref(conn))),
+          subscriptions{{this, SignalKind::ADAPTER_CHANGED, 0},
+                        {this, SignalKind::DEVICE_CHANGED, 0},
+                        {this, SignalKind::INTERFACES_ADDED, 0},
+                        {this, SignalKind::INTERFACES_REMOVED, 0}} {}
+    ~GDBusTransport() {
+        Close();
+        g_object_unref(conn);
+    }
+    void Open(GMainContext *context, SignalHandler handler) override;
+    void Close() noexcept override;
+    void Call(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+              const std::function<void(MessageReader &)> &read) override;
+    void CallAsync(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                   GCancellable *cancellable, ReplyHandler done) noexcept override;
+    bool HasVariants() const noexcept override {
+        return true;
+    }
+};
+
+void GDBusTransport::Open(GMainContext *context, SignalHandler handler) {
+    this->handler = handler;
+    // subscriptions dispatch on the thread-default context they are made in
+    g_main_context_push_thread_default(context);
+    for (auto &s : subscriptions) {
+        auto changed = s.kind == SignalKind::ADAPTER_CHANGED || s.kind == SignalKind::DEVICE_CHANGED;
+        auto arg0 = s.kind == SignalKind::ADAPTER_CHANGED ? BLUEZ_ADAPTER_IFACE : s.kind == SignalKind::DEVICE_CHANGED ? BLUEZ_DEVICE_IFACE : nullptr;
+        auto member = changed ? "PropertiesChanged" : s.kind == SignalKind::INTERFACES_ADDED ? "InterfacesAdded" : "InterfacesRemoved";
+        s.handle = g_dbus_connection_signal_subscribe(conn, BLUEZ, changed ? BLUEZ_PROPERTY_IFACE : BLUEZ_MANAGER_IFACE, member, nullptr, arg0,
+                                                      G_DBUS_SIGNAL_FLAGS_NONE, signal, &s, nullptr);
+    }
+    g_main_context_pop_thread_default(context);
+}
+
+void GDBusTransport::Close() noexcept {
+    for (auto &s : subscriptions) {
+        if (s.handle) g_dbus_connection_signal_unsubscribe(conn, s.handle);
+        s.handle = 0;
+    }
+}
+
+void GDBusTransport::signal(GDBusConnection *connection, const gchar *sender_name, const gchar *object_path, const gchar *interface_name,
+                            const gchar *signal_name, GVariant *parameters, gpointer user_data) noexcept {
+    auto s = reinterpret_cast<Subscription *>(user_data);
+    GVariantReader reader(s->kind, parameters, object_path);
+    s->transport->handler(s->kind, object_path, reader, parameters);
+}
+
+void GDBusTransport::Call(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                          const std::function<void(MessageReader &)> &read) {
+    GError *err = nullptr;
+    auto value = g_dbus_connection_call_sync(conn, BLUEZ, object_path, iface, method, parameters, nullptr, G_DBUS_CALL_FLAGS_NONE, timeout_ms,
+                                             nullptr, &err);
+    if (!value) {
+        auto e = BluezError(err);
+        g_error_free(err);
+        throw e;
+    }
+    if (read) {
+        GVariantReader reader(SignalKind::OBJECTS, value);
+        read(reader);
+    }
+    g_variant_unref(value);
+}
+
+void GDBusTransport::CallAsync(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                               GCancellable *cancellable, ReplyHandler done) noexcept {
+    g_dbus_connection_call(conn, BLUEZ, object_path, iface, method, parameters, nullptr, G_DBUS_CALL_FLAGS_NONE, timeout_ms, cancellable,
+                           finish, new ReplyHandler(done));
+}
+
+void GDBusTransport::finish(GObject *source, GAsyncResult *res, gpointer user_data) noexcept {
+    std::unique_ptr<ReplyHandler> done(reinterpret_cast<ReplyHandler *>(user_data));
+    GError *err = nullptr;
+    auto value = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &err);
+    if (!value) {
+        auto e = BluezError(err);
+        g_error_free(err);
+        (*done)(nullptr, &e);
+        return;
+    }
+    GVariantReader reader(SignalKind::OBJECTS, value);
+    (*done)(&reader, nullptr);
+    g_variant_unref(value);
+}
+
+Transport *bluez::new_gdbus_transport(GDBusConnection *conn) noexcept {
+    return new GDBusTransport(conn);
+}
@@ -0,0 +1,143 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include "gutil.h"
+
+namespace bluez {
+
+// Device1 and Adapter1 properties the decoder knows.
+enum class Property : guint8 {
+    ADDRESS,
+    NAME,
+    ALIAS,
+    PAIRED,
+    CONNECTED,
+    TRUSTED,
+    RSSI,
+    CLASS,
+    UUIDS,
+    SERVICES_RESOLVED,
+    TX_POWER,
+    POWERED,
+    DISCOVERING,
+    PAIRABLE,
+    DISCOVERABLE,
+};
+
+struct PropertySpec {
+    const char *name;
+    Property property;
+    // D-Bus signature, values of another type are ignored
+    const char *type;
+};
+
+// one hash and one strcmp, unknown names map to nullptr
+const PropertySpec *lookup_property(const char *name) noexcept;
+
+// One changed or invalidated property. Invalidated ones carry the zero value.
+struct PropertyDelta {
+    Property property;
+    bool invalidated;
+    bool b;
+    gint16 n;
+    guint32 u;
+    const gchar *s;
+    // the 'as' value, owned by the reader
+    const std::vector<std::string> *strv;
+};
+
+// What a signal is handled by, and the record kind in a signal log.
+enum class SignalKind : guint8 {
+    ADAPTER_CHANGED,
+    DEVICE_CHANGED,
+    INTERFACES_ADDED,
+    INTERFACES_REMOVED,
+    // a GetManagedObjects reply
+    OBJECTS,
+};
+
+// GVariant type of the parameters of each SignalKind
+extern const char *const SIGNAL_TYPES[];
+
+// Pull parser over one BlueZ message in the form the transport received it.
+// Every message reads as objects, their interfaces and their properties: a
+// GetManagedObjects reply has any number of objects, the signals have one.
+// PropertiesChanged has a single interface whose invalidated properties
+// follow the changed ones, InterfacesRemoved has interfaces without
+// properties. Strings stay valid while the message does.
+class MessageReader {
+  public:
+    virtual ~MessageReader() = default;
+    virtual bool NextObject(const char *&object_path) noexcept = 0;
+    virtual bool NextInterface(const char *&iface) noexcept = 0;
+    // the next known property of the current interface
+    virtual bool NextProperty(PropertyDelta &delta) noexcept = 0;
+};
+
+// Reads a GVariant message, parameters must outlive the reader. object_path
+// is the path the signal was emitted on, only PropertiesChanged needs it.
+class GVariantReader : public MessageReader {
+  private:
+    SignalKind kind;
+    GVariant *parameters;
+    const char *path;
+    // the single object of a signal and the single interface of
+    // PropertiesChanged were read
+    bool object_read;
+    bool interface_read;
+    // the containers the iterators walk, nullptr when done
+    GVariant *objects_value;
+    GVariant *interfaces_value;
+    GVariant *properties_value;
+    GVariant *invalidated_value;
+    GVariantIter objects;
+    GVariantIter interfaces;
+    GVariantIter properties;
+    GVariantIter invalidated;
+    std::vector<std::string> strv;
+
+  public:
+    explicit GVariantReader(SignalKind kind, GVariant *parameters, const char *object_path = nullptr) noexcept;
+    ~GVariantReader();
+    bool NextObject(const char *&object_path) noexcept override;
+    bool NextInterface(const char *&iface) noexcept override;
+    bool NextProperty(PropertyDelta &delta) noexcept override;
+};
+
+// called on the loop thread for every BlueZ signal. parameters is the
+// GVariant form of the message if the transport has one, for the recorder.
+using SignalHandler = std::function<void(SignalKind kind, const char *object_path, MessageReader &reader, GVariant *parameters)>;
+// called on the loop thread, reply is nullptr on error
+using ReplyHandler = std::function<void(MessageReader *reply, const BluezError *error)>;
+
+// The connection BluezUtil sends method calls and receives BlueZ signals
+// through. The pairing agent and the 'org.bluez' name watch always use the
+// GDBus connection, they carry next to no traffic.
+class Transport {
+  public:
+    virtual ~Transport() = default;
+    // Subscribes to the BlueZ signals and dispatches them on the loop of
+    // context until Close(). Throws BluezError.
+    virtual void Open(GMainContext *context, SignalHandler handler) = 0;
+    virtual void Close() noexcept = 0;
+    // Blocking call with the arguments of the tuple parameters, which is
+    // consumed if floating. read, if set, gets an OBJECTS reader over the
+    // reply. Throws BluezError.
+    virtual void Call(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                      const std::function<void(MessageReader &)> &read) = 0;
+    // Must be called on the loop thread, done runs there exactly once.
+    virtual void CallAsync(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                           GCancellable *cancellable, ReplyHandler done) noexcept = 0;
+    // whether signals come with their GVariant form
+    virtual bool HasVariants() const noexcept = 0;
+};
+
+Transport *new_gdbus_transport(GDBusConnection *conn) noexcept;
+#ifdef BLUEZ_SDBUS
+// Throws BluezError if the system bus cannot be reached.
+Transport *new_sdbus_transport() ;
+#endif
+
+} // namespace bluez
+
+#endif
@@ -0,0 +1,585 @@
+#ifdef BLUEZ_SDBUS
+
+#include "transport.h"
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <systemd/sd-bus.h>
+
+#define BLUEZ "org.bluez"
+#define BLUEZ_MANAGER_IFACE "org.freedesktop.DBus.ObjectManager"
+#define BLUEZ_PROPERTY_IFACE "org.freedesktop.DBus.Properties"
+#define BLUEZ_ADAPTER_IFACE "org.bluez.Adapter1"
+#define BLUEZ_DEVICE_IFACE "org.bluez.Device1"
+
+#define log(fmt, ...) g_message("[BluezUtil]" fmt "", __VA_ARGS__)
+
+using namespace bluez;
+
+// Containers the reader may have open at once: the object entry and its
+// interface array, the interface entry and its property array.
+#define READER_LEVELS 2
+
+// Reads a message in place. Strings point into the message buffer and
+// nothing is allocated, except for the 'as' value of UUIDs.
+class SdBusReader : public MessageReader {
+  private:
+    sd_bus_message *m;
+    SignalKind kind;
+    // an sd-bus call failed, everything after reads as empty
+    bool failed;
+    bool object_read;
+    bool interface_read;
+    // reading the invalidated names of PropertiesChanged
+    bool in_invalidated;
+    // containers entered per level, closed again when the caller moves on
+    int opened[READER_LEVELS];
+    int depth;
+    std::vector<std::string> strv;
+
+    // r > 0, something was read or entered
+    bool check(int r) noexcept {
+        if (r < 0) failed = true;
+        return r > 0;
+    }
+    // r >= 0, for calls that report success as 0
+    bool ok(int r) noexcept {
+        if (r < 0) failed = true;
+        return r >= 0;
+    }
+    bool enter(char type, const char *contents) noexcept {
+        if (!check(sd_bus_message_enter_container(m, type, contents))) return false;
+        opened[depth - 1]++;
+        return true;
+    }
+    // Leaves the containers opened below level, skipping what the caller
+    // did not read, sd-bus only exits fully consumed containers.
+    void unwind(int level) noexcept {
+        while (depth > level) {
+            for (; opened[depth - 1] > 0; opened[depth - 1]--) {
+                int r = 0;
+                while (!failed && (r = sd_bus_message_skip(m, nullptr)) > 0) {
+                }
+                // the end of a dict entry reads as -ENXIO, of an array as 0
+                if (r < 0 && r != -ENXIO) failed = true;
+                if (!failed) ok(sd_bus_message_exit_container(m));
+            }
+            depth--;
+        }
+    }
+    bool read_value(const PropertySpec *spec, PropertyDelta &delta) noexcept;
+
+  public:
+    explicit SdBusReader(SignalKind kind, sd_bus_message *m) noexcept
+        : m(m), kind(kind), failed(false), object_read(false), interface_read(false), in_invalidated(false), opened{}, depth(0) {
+        if (kind == SignalKind::OBJECTS) failed = sd_bus_message_enter_container(m, 'a', "{oa{sa{sv}}}") <= 0;
+    }
+    bool NextObject(const char *&object_path) noexcept override;
+    bool NextInterface(const char *&iface) noexcept override;
+    bool NextProperty(PropertyDelta &delta) noexcept override;
+};
+
+bool SdBusReader::NextObject(const char *&object_path) noexcept {
+    unwind(0);
+    if (failed) return false;
+    interface_read = false;
+    in_invalidated = false;
+    depth = 1;
+    switch (kind) {
+    case SignalKind::OBJECTS:
+        return enter('e', "oa{sa{sv}}") && check(sd_bus_message_read_basic(m, 'o', &object_path)) && enter('a', "{sa{sv}}");
+    case SignalKind::ADAPTER_CHANGED:
+    case SignalKind::DEVICE_CHANGED:
+        if (object_read) return false;
+        object_read = true;
+        object_path = sd_bus_message_get_path(m);
+        return object_path != nullptr;
+    default:
+        if (object_read) return false;
+        object_read = true;
+        return check(sd_bus_message_read_basic(m, 'o', &object_path)) &&
+               enter('a', kind == SignalKind::INTERFACES_ADDED ? "{sa{sv}}" : "s");
+    }
+}
+
+bool SdBusReader::NextInterface(const char *&iface) noexcept {
+    unwind(1);
+    if (failed || depth < 1) return false;
+    in_invalidated = false;
+    depth = 2;
+    switch (kind) {
+    case SignalKind::ADAPTER_CHANGED:
+    case SignalKind::DEVICE_CHANGED:
+        if (interface_read) return false;
+        interface_read = true;
+        return check(sd_bus_message_read_basic(m, 's', &iface)) && enter('a', "{sv}");
+    case SignalKind::INTERFACES_REMOVED:
+        return check(sd_bus_message_read_basic(m, 's', &iface));
+    default:
+        return enter('e', "sa{sv}") && check(sd_bus_message_read_basic(m, 's', &iface)) && enter('a', "{sv}");
+    }
+}
+
+bool SdBusReader::read_value(const PropertySpec *spec, PropertyDelta &delta) noexcept {
+    int b;
+    switch (spec->type[0]) {
+    case 'b':
+        if (!check(sd_bus_message_read_basic(m, 'b', &b))) return false;
+        delta.b = b;
+        return true;
+    case 'n':
+        return check(sd_bus_message_read_basic(m, 'n', &delta.n));
+    case 'u':
+        return check(sd_bus_message_read_basic(m, 'u', &delta.u));
+    case 's':
+        return check(sd_bus_message_read_basic(m, 's', &delta.s));
+    default: {
+        const char *str;
+        strv.clear();
+        if (!check(sd_bus_message_enter_container(m, 'a', "s"))) return false;
+        while (check(sd_bus_message_read_basic(m, 's', &str))) strv.emplace_back(str);
+        delta.strv = &strv;
+        return !failed && ok(sd_bus_message_exit_container(m));
+    }
+    }
+}
+
+bool SdBusReader::NextProperty(PropertyDelta &delta) noexcept {
+    if (failed || depth < 2 || opened[1] == 0) return false;
+    while (!in_invalidated) {
+        const char *key, *contents;
+        char type;
+        if (!check(sd_bus_message_enter_container(m, 'e', "sv"))) {
+            if (failed || kind == SignalKind::OBJECTS || kind == SignalKind::INTERFACES_ADDED) return false;
+            // the changed properties are done, the invalidated names follow
+            if (!ok(sd_bus_message_exit_container(m))) return false;
+            opened[1]--;
+            if (!enter('a', "s")) return false;
+            in_invalidated = true;
+            break;
+        }
+        auto decoded = false;
+        if (check(sd_bus_message_read_basic(m, 's', &key)) && check(sd_bus_message_peek_type(m, &type, &contents))) {
+            auto spec = lookup_property(key);
+            if (spec && strcmp(contents, spec->type) == 0) {
+                delta = PropertyDelta{spec->property, false, false, 0, 0, "", nullptr};
+                decoded = check(sd_bus_message_enter_container(m, 'v', contents)) && read_value(spec, delta) &&
+                          ok(sd_bus_message_exit_container(m));
+            } else {
+                ok(sd_bus_message_skip(m, "v"));
+            }
+        }
+        if (failed || !ok(sd_bus_message_exit_container(m))) return false;
+        if (decoded) return true;
+    }
+    const char *key;
+    while (check(sd_bus_message_read_basic(m, 's', &key))) {
+        auto spec = lookup_property(key);
+        if (!spec) continue;
+        delta = PropertyDelta{spec->property, true, false, 0, 0, "", nullptr};
+        return true;
+    }
+    return false;
+}
+
+// Appends a GVariant to a message, for the few parameters BluezUtil sends.
+static int append_variant(sd_bus_message *m, GVariant *value) noexcept {
+    auto type = g_variant_get_type_string(value);
+    int r = 0;
+    switch (type[0]) {
+    case 'b': {
+        int b = g_variant_get_boolean(value);
+        return sd_bus_message_append_basic(m, 'b', &b);
+    }
+    case 'y': {
+        auto y = g_variant_get_byte(value);
+        return sd_bus_message_append_basic(m, 'y', &y);
+    }
+    case 'n': {
+        auto n = g_variant_get_int16(value);
+        return sd_bus_message_append_basic(m, 'n', &n);
+    }
+    case 'q': {
+        auto q = g_variant_get_uint16(value);
+        return sd_bus_message_append_basic(m, 'q', &q);
+    }
+    case 'i': {
+        auto i = g_variant_get_int32(value);
+        return sd_bus_message_append_basic(m, 'i', &i);
+    }
+    case 'u': {
+        auto u = g_variant_get_uint32(value);
+        return sd_bus_message_append_basic(m, 'u', &u);
+    }
+    case 'x': {
+        auto x = g_variant_get_int64(value);
+        return sd_bus_message_append_basic(m, 'x', &x);
+    }
+    case 't': {
+        auto t = g_variant_get_uint64(value);
+        return sd_bus_message_append_basic(m, 't', &t);
+    }
+    case 'd': {
+        auto d = g_variant_get_double(value);
+        return sd_bus_message_append_basic(m, 'd', &d);
+    }
+    case 's':
+    case 'o':
+    case 'g':
+        return sd_bus_message_append_basic(m, type[0], g_variant_get_string(value, nullptr));
+    case 'v': {
+        auto inner = g_variant_get_variant(value);
+        r = sd_bus_message_open_container(m, 'v', g_variant_get_type_string(inner));
+        if (r >= 0) r = append_variant(m, inner);
+        g_variant_unref(inner);
+        return r < 0 ? r : sd_bus_message_close_container(m);
+    }
+    default: {
+        // arrays, dict entries and tuples, contents without the brackets
+        auto container = type[0] == 'a' ? 'a' : type[0] == '{' ? 'e' : 'r';
+        std::string contents = type[0] == 'a' ? std::string(type + 1) : std::string(type + 1, strlen(type) - 2);
+        r = sd_bus_message_open_container(m, container, contents.c_str());
+        for (gsize i = 0, n = g_variant_n_children(value); r >= 0 && i < n; i++) {
+            auto child = g_variant_get_child_value(value, i);
+            r = append_variant(m, child);
+            g_variant_unref(child);
+        }
+        return r < 0 ? r : sd_bus_message_close_container(m);
+    }
+    }
+}
+
+// sd-bus reports errors as errno values or error replies, both are mapped to
+// what GDBus would have reported.
+static BluezError sdbus_error(int r, const sd_bus_error *error) noexcept {
+    if (error && error->name) {
+        if (strcmp(error->name, "org.freedesktop.DBus.Error.NoReply") == 0 || strcmp(error->name, "org.freedesktop.DBus.Error.Timeout") == 0) {
+            return BluezError(G_IO_ERROR_TIMED_OUT, error->message ? error->message : "Timeout was reached");
+        }
+        return BluezError(G_IO_ERROR_DBUS_ERROR, error->message ? error->message : error->name, error->name);
+    }
+    return BluezError(g_io_error_from_errno(-r), strerror(-r));
+}
+
+static inline guint64 timeout_usec(int timeout_ms) noexcept {
+    // 0 is the sd-bus default of 25 s, as -1 is for GDBus
+    return timeout_ms < 0 ? 0 : timeout_ms * 1000ull;
+}
+
+// GSource driving the bus on the loop thread in place of sd_bus_wait().
+struct SdBusSource {
+    GSource source;
+    sd_bus *bus;
+    gpointer tag;
+    // messages were queued outside of sd_bus_process(), e.g. by sd_bus_call()
+    bool *pending;
+};
+
+// sd-bus objects are not thread-safe, everything on bus runs on the thread
+// that owns the loop context. Sync calls from other threads get a caller
+// connection of their own.
+class SdBusTransport : public Transport {
+  private:
+    struct Match {
+        SdBusTransport *transport;
+        SignalKind kind;
+        sd_bus_slot *slot;
+    };
+    // An async call, loop thread only. done is emptied when it ran.
+    struct Pending {
+        SdBusTransport *transport;
+        ReplyHandler done;
+        sd_bus_slot *slot;
+        GCancellable *cancellable;
+        gulong cancel_handler;
+        // released by finish(), a cancellation in flight holds another
+        std::shared_ptr<Pending> self;
+    };
+    sd_bus *bus;
+    GMainContext *context;
+    GSource *source;
+    bool pending;
+    SignalHandler handler;
+    Match matches[4];
+    // Connections for sync calls from threads that do not own the context,
+    // one per concurrent caller. They have no matches, so a call there
+    // neither waits for nor stalls the loop thread.
+    std::mutex callers_mutex;
+    std::vector<sd_bus *> callers;
+    sd_bus *take_caller_bus() ;
+    void put_caller_bus(sd_bus *caller) noexcept;
+    void call_on(sd_bus *target, const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                 const std::function<void(MessageReader &)> &read) ;
+    static int signal(sd_bus_message *m, void *userdata, sd_bus_error *) noexcept;
+    static int reply(sd_bus_message *m, void *userdata, sd_bus_error *) noexcept;
+    static void finish(Pending *call, sd_bus_message *m, const BluezError *error) noexcept;
+    static GSourceFuncs SOURCE_FUNCS;
+
+  public:
+    explicit SdBusTransport(sd_bus *bus) noexcept
+        : bus(bus), context(nullptr), source(nullptr), pending(false),
+          matches{{this, SignalKind::ADAPTER_CHANGED, nullptr},
+                  {this, SignalKind::DEVICE_CHANGED, nullptr},
+                  {this, SignalKind::INTERFACES_ADDED, nullptr},
+                  {this, SignalKind::INTERFACES_REMOVED, nullptr}} {}
+    ~SdBusTransport() {
+        Close();
+        sd_bus_flush_close_unref(bus);
+        for (auto caller : callers) sd_bus_flush_close_unref(caller);
+    }
+    void Open(GMainContext *context, SignalHandler handler) override;
+    void Close() noexcept override;
+    void Call(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+              const std::function<void(MessageReader &)> &read) override;
+    void CallAsync(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                   GCancellable *cancellable, ReplyHandler done) noexcept override;
+    bool HasVariants() const noexcept override {
+        return false;
+    }
+};
+
+GSourceFuncs SdBusTransport::SOURCE_FUNCS = {
+    // prepare
+    [](GSource *source, gint *timeout) -> gboolean {
+        auto s = reinterpret_cast<SdBusSource *>(source);
+        *timeout = -1;
+        if (*s->pending) return TRUE;
+        auto events = sd_bus_get_events(s->bus);
+        if (events >= 0) g_source_modify_unix_fd(source, s->tag, (GIOCondition)events);
+        guint64 until;
+        if (sd_bus_get_timeout(s->bus, &until) > 0 && until != G_MAXUINT64) {
+            auto now = g_get_monotonic_time();
+            if ((gint64)until <= now) return TRUE;
+            *timeout = (gint)MIN((until - now + 999) / 1000, (guint64)G_MAXINT);
+        }
+        return FALSE;
+    },
+    // check
+    [](GSource *source) -> gboolean {
+        auto s = reinterpret_cast<SdBusSource *>(source);
+        guint64 until;
+        return *s->pending || g_source_query_unix_fd(source, s->tag) != 0 ||
+               (sd_bus_get_timeout(s->bus, &until) > 0 && until != G_MAXUINT64 && (gint64)until <= g_get_monotonic_time());
+    },
+    // dispatch, until sd-bus has nothing left to do
+    [](GSource *source, GSourceFunc, gpointer) -> gboolean {
+        auto s = reinterpret_cast<SdBusSource *>(source);
+        *s->pending = false;
+        int r;
+        while ((r = sd_bus_process(s->bus, nullptr)) > 0) {
+        }
+        if (r < 0) log("sd-bus process error: %s", strerror(-r));
+        return G_SOURCE_CONTINUE;
+    },
+    nullptr,
+    nullptr,
+    nullptr,
+};
+
+void SdBusTransport::Open(GMainContext *context, SignalHandler handler) {
+    this->handler = handler;
+    this->context = context;
+    static const char *RULES[] = {
+        "type='signal',sender='" BLUEZ "',interface='" BLUEZ_PROPERTY_IFACE "',member='PropertiesChanged',arg0='" BLUEZ_ADAPTER_IFACE "'",
+        "type='signal',sender='" BLUEZ "',interface='" BLUEZ_PROPERTY_IFACE "',member='PropertiesChanged',arg0='" BLUEZ_DEVICE_IFACE "'",
+        "type='signal',sender='" BLUEZ "',interface='" BLUEZ_MANAGER_IFACE "',member='InterfacesAdded'",
+        "type='signal',sender='" BLUEZ "',interface='" BLUEZ_MANAGER_IFACE "',member='InterfacesRemoved'",
+    };
+    for (int i = 0; i < 4; i++) {
+        auto r = sd_bus_add_match(bus, &matches[i].slot, RULES[i], signal, &matches[i]);
+        if (r < 0) {
+            Close();
+            throw BluezError(g_io_error_from_errno(-r), (std::string("sd_bus_add_match: ") + strerror(-r)).c_str());
+        }
+    }
+    source = g_source_new(&SOURCE_FUNCS, sizeof(SdBusSource));
+    auto s = reinterpret_cast<SdBusSource *>(source);
+    s->bus = bus;
+    s->pending = &pending;
+    s->tag = g_source_add_unix_fd(source, sd_bus_get_fd(bus), G_IO_IN);
+    g_source_attach(source, context);
+}
+
+void SdBusTransport::Close() noexcept {
+    for (auto &match : matches) {
+        if (match.slot) sd_bus_slot_unref(match.slot);
+        match.slot = nullptr;
+    }
+    if (!source) return;
+    g_source_destroy(source);
+    g_source_unref(source);
+    source = nullptr;
+}
+
+int SdBusTransport::signal(sd_bus_message *m, void *userdata, sd_bus_error *) noexcept {
+    auto match = reinterpret_cast<Match *>(userdata);
+    SdBusReader reader(match->kind, m);
+    match->transport->handler(match->kind, sd_bus_message_get_path(m), reader, nullptr);
+    return 0;
+}
+
+sd_bus *SdBusTransport::take_caller_bus()  {
+    {
+        std::lock_guard<std::mutex> _1(callers_mutex);
+        if (!callers.empty()) {
+            auto caller = callers.back();
+            callers.pop_back();
+            return caller;
+        }
+    }
+    sd_bus *caller = nullptr;
+    auto r = sd_bus_open_system(&caller);
+    if (r < 0) throw BluezError(g_io_error_from_errno(-r), (std::string("sd_bus_open_system: ") + strerror(-r)).c_str());
+    return caller;
+}
+
+void SdBusTransport::put_caller_bus(sd_bus *caller) noexcept {
+    // a connection the bus daemon dropped is not reused
+    if (sd_bus_is_open(caller) <= 0) {
+        sd_bus_flush_close_unref(caller);
+        return;
+    }
+    std::lock_guard<std::mutex> _1(callers_mutex);
+    callers.push_back(caller);
+}
+
+void SdBusTransport::call_on(sd_bus *target, const char *object_path, const char *iface, const char *method, GVariant *parameters,
+                             int timeout_ms, const std::function<void(MessageReader &)> &read)  {
+    sd_bus_message *m = nullptr, *reply = nullptr;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    auto r = sd_bus_message_new_method_call(target, &m, BLUEZ, object_path, iface, method);
+    for (gsize i = 0, n = parameters ? g_variant_n_children(parameters) : 0; r >= 0 && i < n; i++) {
+        auto child = g_variant_get_child_value(parameters, i);
+        r = append_variant(m, child);
+        g_variant_unref(child);
+    }
+    if (r >= 0) r = sd_bus_call(target, m, timeout_usec(timeout_ms), &error, &reply);
+    if (target == bus) {
+        // signals that arrived while waiting are queued, not dispatched
+        pending = true;
+        if (context) g_main_context_wakeup(context);
+    }
+    if (m) sd_bus_message_unref(m);
+    if (r < 0) {
+        auto e = sdbus_error(r, &error);
+        sd_bus_error_free(&error);
+        throw e;
+    }
+    if (read) {
+        SdBusReader reader(SignalKind::OBJECTS, reply);
+        read(reader);
+    }
+    sd_bus_message_unref(reply);
+}
+
+// Blocks on the signal connection only on the thread owning the context, or
+// before anybody does. Everyone else uses a connection of their own, so the
+// loop thread keeps dispatching and a listener calling in cannot deadlock
+// against it.
+void SdBusTransport::Call(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                          const std::function<void(MessageReader &)> &read) {
+    if (parameters) g_variant_ref_sink(parameters);
+    auto owner = !context || g_main_context_acquire(context);
+    sd_bus *target = owner ? bus : nullptr;
+    std::exception_ptr error;
+    try {
+        if (!target) target = take_caller_bus();
+        call_on(target, object_path, iface, method, parameters, timeout_ms, read);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    if (owner && context) g_main_context_release(context);
+    if (!owner && target) put_caller_bus(target);
+    if (parameters) g_variant_unref(parameters);
+    if (error) std::rethrow_exception(error);
+}
+
+void SdBusTransport::CallAsync(const char *object_path, const char *iface, const char *method, GVariant *parameters, int timeout_ms,
+                               GCancellable *cancellable, ReplyHandler done) noexcept {
+    auto call = std::make_shared<Pending>();
+    call->transport = this;
+    call->done = done;
+    call->slot = nullptr;
+    call->cancellable = cancellable ? G_CANCELLABLE(g_object_ref(cancellable)) : nullptr;
+    call->cancel_handler = 0;
+    call->self = call;
+    sd_bus_message *m = nullptr;
+    if (parameters) g_variant_ref_sink(parameters);
+    auto r = sd_bus_message_new_method_call(bus, &m, BLUEZ, object_path, iface, method);
+    for (gsize i = 0, n = parameters ? g_variant_n_children(parameters) : 0; r >= 0 && i < n; i++) {
+        auto child = g_variant_get_child_value(parameters, i);
+        r = append_variant(m, child);
+        g_variant_unref(child);
+    }
+    if (parameters) g_variant_unref(parameters);
+    if (r >= 0) r = sd_bus_call_async(bus, &call->slot, m, reply, call.get(), timeout_usec(timeout_ms));
+    if (m) sd_bus_message_unref(m);
+    if (r < 0) {
+        auto e = sdbus_error(r, nullptr);
+        finish(call.get(), nullptr, &e);
+        return;
+    }
+    if (!cancellable) return;
+    // Cancel() may run on any thread, the call completes on the loop thread
+    // and the reply is dropped with the slot. finish() disconnects first, so
+    // self is valid here.
+    call->cancel_handler = g_cancellable_connect(cancellable, G_CALLBACK(+[](GCancellable *, gpointer data) {
+        auto call = reinterpret_cast<Pending *>(data);
+        auto source = g_idle_source_new();
+        g_source_set_callback(source, [](gpointer data) -> gboolean {
+            auto call = reinterpret_cast<std::shared_ptr<Pending> *>(data)->get();
+            BluezError e(G_IO_ERROR_CANCELLED, "Operation was cancelled");
+            finish(call, nullptr, &e);
+            return G_SOURCE_REMOVE;
+        }, new std::shared_ptr<Pending>(call->self), [](gpointer data) { delete reinterpret_cast<std::shared_ptr<Pending> *>(data); });
+        g_source_attach(source, call->transport->context);
+        g_source_unref(source);
+    }), call.get(), nullptr);
+}
+
+int SdBusTransport::reply(sd_bus_message *m, void *userdata, sd_bus_error *) noexcept {
+    auto call = reinterpret_cast<Pending *>(userdata);
+    if (sd_bus_message_is_method_error(m, nullptr)) {
+        auto e = sdbus_error(-EIO, sd_bus_message_get_error(m));
+        finish(call, nullptr, &e);
+    } else {
+        finish(call, m, nullptr);
+    }
+    return 0;
+}
+
+// Runs the handler unless the call finished already, whichever of the reply
+// and the cancellation comes second is ignored.
+void SdBusTransport::finish(Pending *call, sd_bus_message *m, const BluezError *error) noexcept {
+    if (!call->done) return;
+    auto done = std::move(call->done);
+    call->done = nullptr;
+    if (call->slot) sd_bus_slot_unref(call->slot);
+    call->slot = nullptr;
+    if (call->cancellable) {
+        g_cancellable_disconnect(call->cancellable, call->cancel_handler);
+        g_object_unref(call->cancellable);
+        call->cancellable = nullptr;
+    }
+    // may free call, the idle of a cancellation keeps it otherwise
+    auto self = std::move(call->self);
+    if (m) {
+        SdBusReader reader(SignalKind::OBJECTS, m);
+        done(&reader, nullptr);
+    } else {
+        done(nullptr, error);
+    }
+}
+
+Transport *bluez::new_sdbus_transport()  {
+    sd_bus *bus = nullptr;
+    // honours DBUS_SYSTEM_BUS_ADDRESS like GDBus does
+    auto r = sd_bus_open_system(&bus);
+    if (r < 0) throw BluezError(g_io_error_from_errno(-r), (std::string("sd_bus_open_system: ") + strerror(-r)).c_str());
+    return new SdBusTransport(bus);
+}
+
+#endif